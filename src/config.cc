@@ -18,9 +18,48 @@
 extern int64_t num_worker_threads;
 extern int64_t thread_work_interval;
 extern int64_t storage_sync_interval;
+extern int64_t storage_stats_concurrency;
+extern int64_t meta_conn_pool_size;
+extern int64_t shard_conn_keepalive_interval;
+extern int64_t shard_conn_idle_timeout;
+extern int64_t max_shard_conns;
+extern int64_t share_shard_conns;
+extern int64_t node_breaker_threshold;
+extern int64_t node_probe_min_backoff_ms;
+extern int64_t node_probe_max_backoff_ms;
+extern int64_t health_check_timeout_ms;
+extern int64_t mgr_progress_refresh_interval;
+extern int64_t mgr_lag_sample_interval;
+extern int64_t mgr_lag_history;
+extern int64_t enable_cluster_partition;
+extern int64_t enable_warm_standby;
+extern std::string cluster_mgr_instance_name;
+extern int64_t cluster_lease_timeout;
+extern std::string topology_snapshot_path;
+extern int64_t topology_snapshot_interval;
+extern int64_t enable_primary_balance;
+extern int64_t primary_balance_interval;
+extern int64_t primary_balance_max_moves;
+extern int64_t primary_move_timeout_ms;
+extern int64_t comp_node_probe_interval_ms;
+extern int64_t comp_node_probe_timeout_ms;
+extern int64_t comp_node_down_probes;
+extern int64_t stats_push_batch_size;
+extern int64_t stats_change_threshold_pct;
+extern int64_t catalog_cache_ttl;
+extern int64_t pgsql_conn_cache_size;
+extern int64_t pgsql_conn_idle_timeout;
+extern int64_t pgsql_conn_check_interval;
+extern int64_t pgsql_stmt_timeout_ms;
+extern int64_t shard_load_history;
+extern int64_t hot_shard_load_ratio;
+extern int64_t hot_shard_min_row_ops;
 extern int64_t commit_log_retention_hours;
 
 extern int64_t num_job_threads;
+extern int64_t num_notify_threads;
+extern int64_t node_notify_retries;
+extern int64_t node_notify_retry_interval_ms;
 extern int64_t num_http_threads;
 extern int64_t cluster_mgr_http_port;
 extern std::string http_web_path;
@@ -189,12 +228,84 @@ void Configs::define_configs()
 		"meta data server user account");
 	define_str_config("meta_pwd", meta_svr_pwd, "",
 		"meta data server user's password");
+	define_int_config("meta_conn_pool_size", meta_conn_pool_size, 1, 256, 8,
+		"Max NO. of pooled connections to meta data server master used concurrently by API and job threads.");
+	define_int_config("enable_cluster_partition", enable_cluster_partition, 0, 1, 0,
+		"Whether clusters are split among cluster_mgr instances sharing the meta data server, 1 to split, 0 to work on all clusters.");
+	define_int_config("enable_warm_standby", enable_warm_standby, 0, 1, 0,
+		"Whether cluster_mgr instances sharing the meta data server elect a leader to work on all clusters, the rest being warm standbys, 1 to elect, 0 not. Ignored if enable_cluster_partition is set.");
+	define_str_config("cluster_mgr_instance_name", cluster_mgr_instance_name, "",
+		"Unique name of this cluster_mgr instance, hostname:cluster_mgr_http_port if empty.");
+	define_int_config("cluster_lease_timeout", cluster_lease_timeout, 10, 3600, 30,
+		"Seconds a dead cluster_mgr instance's clusters or leadership are taken over by live ones after. Half of it must exceed thread_work_interval plus mysql_connect_timeout.");
+	define_str_config("topology_snapshot_path", topology_snapshot_path, "",
+		"Local file to save clusters' topology and recovery states in, loaded at startup to work on shards before the meta data server is queried. Empty to disable.");
+	define_int_config("topology_snapshot_interval", topology_snapshot_interval, 1, 86400, 60,
+		"Interval in seconds the topology snapshot is saved.");
+	define_int_config("enable_primary_balance", enable_primary_balance, 0, 1, 0,
+		"Whether MGR shard primaries are moved in background to spread them evenly over machines and racks, 1 to move, 0 not.");
+	define_int_config("primary_balance_interval", primary_balance_interval, 10, 86400, 300,
+		"Interval in seconds shard primaries are checked and moved for balance.");
+	define_int_config("primary_balance_max_moves", primary_balance_max_moves, 1, 1000, 1,
+		"Max NO. of shard primaries moved for balance in one primary_balance_interval.");
+	define_int_config("primary_move_timeout_ms", primary_move_timeout_ms, 1000, 3600000, 60000,
+		"Timeout in milliseconds of moving a shard primary for balance, which waits for the primary's running txns.");
+	define_int_config("comp_node_probe_interval_ms", comp_node_probe_interval_ms, 0, 3600000, 0,
+		"Interval in milliseconds computer nodes are probed for liveness, 0(default) to not probe.");
+	define_int_config("comp_node_probe_timeout_ms", comp_node_probe_timeout_ms, 100, 60000, 1000,
+		"Timeout in milliseconds of a round of computer node probes.");
+	define_int_config("comp_node_down_probes", comp_node_down_probes, 1, 100, 2,
+		"NO. of consecutive failed probes after which a computer node is down.");
 	define_int_config("check_shard_interval", check_shard_interval, 1, 100, 3,
 		"Interval in seconds a shard's two checks should be apart.");
+	define_int_config("shard_conn_keepalive_interval", shard_conn_keepalive_interval, 1, 3600, 10,
+		"Interval in seconds shard nodes' connections are checked and connected in background, and idle ones pinged.");
+	define_int_config("shard_conn_idle_timeout", shard_conn_idle_timeout, 0, 86400, 600,
+		"Seconds a shard node's connection can be idle before it is closed, 0 to never close idle ones.");
+	define_int_config("max_shard_conns", max_shard_conns, 0, 1000000, 0,
+		"Max NO. of open shard node connections, least recently used ones are closed beyond it, 0 for no limit.");
+	define_int_config("share_shard_conns", share_shard_conns, 0, 1, 0,
+		"Whether storage stats sync shares shard node connections with shard maintenance, 1 to share, 0 not.");
+	define_int_config("node_breaker_threshold", node_breaker_threshold, 1, 1000, 3,
+		"NO. of consecutive failures to connect a shard node after which statements to it fail fast until a probe connects it.");
+	define_int_config("node_probe_min_backoff_ms", node_probe_min_backoff_ms, 100, 3600000, 1000,
+		"Min interval in milliseconds to probe a shard node known down, doubled after each failed probe.");
+	define_int_config("node_probe_max_backoff_ms", node_probe_max_backoff_ms, 100, 3600000, 60000,
+		"Max interval in milliseconds to probe a shard node known down.");
+	define_int_config("health_check_timeout_ms", health_check_timeout_ms, 100, 3600000, 3000,
+		"Deadline in milliseconds of a shard node's MGR state check, including connects and retries.");
+	define_int_config("mgr_progress_refresh_interval", mgr_progress_refresh_interval, 1, 86400, 30,
+		"Interval in seconds shard nodes' executed GTIDs are fetched to rank them as primary candidates.");
+	define_int_config("mgr_lag_sample_interval", mgr_lag_sample_interval, 0, 86400, 10,
+		"Interval in seconds shard nodes' MGR replication lag is sampled, 0 to not sample.");
+	define_int_config("mgr_lag_history", mgr_lag_history, 1, 10000, 60,
+		"NO. of MGR replication lag samples kept for each shard node.");
 	define_int_config("thread_work_interval", thread_work_interval, 1, 100, 3,
 		"Interval in seconds a thread waits after it finds no work to do.");
 	define_int_config("storage_sync_interval", storage_sync_interval, 1, 300, 60,
 		"Interval in seconds a thread waits next storage stats sync.");
+	define_int_config("storage_stats_concurrency", storage_stats_concurrency, 1, 256, 8,
+		"Max NO. of storage shards whose table stats are collected concurrently in a storage stats sync.");
+	define_int_config("stats_push_batch_size", stats_push_batch_size, 1, 100000, 1000,
+		"NO. of tables whose pages&rows are updated to pg_class of a computer node by one statement.");
+	define_int_config("stats_change_threshold_pct", stats_change_threshold_pct, 0, 100, 10,
+		"Min change in percent of a table's or shard's stats since last pushed to push it again, 0 to push any change.");
+	define_int_config("catalog_cache_ttl", catalog_cache_ttl, 1, 86400, 300,
+		"Max seconds the databases&namespaces of computer nodes are cached for storage stats sync if no DDL is logged.");
+	define_int_config("shard_load_history", shard_load_history, 2, 1440, 10,
+		"NO. of storage shards' workload samples kept, one is taken by each storage stats sync.");
+	define_int_config("hot_shard_load_ratio", hot_shard_load_ratio, 2, 1000, 3,
+		"A storage shard is hot if its row reads&writes per second is over this many times the median of its cluster's shards.");
+	define_int_config("hot_shard_min_row_ops", hot_shard_min_row_ops, 0, 100000000, 1000,
+		"Min row reads&writes per second of a hot storage shard.");
+	define_int_config("pgsql_conn_cache_size", pgsql_conn_cache_size, 1, 1024, 8,
+		"Max NO. of connections to different databases cached for each computer node.");
+	define_int_config("pgsql_conn_idle_timeout", pgsql_conn_idle_timeout, 1, 86400, 300,
+		"Seconds a cached connection to a computer node can be idle before it is closed.");
+	define_int_config("pgsql_conn_check_interval", pgsql_conn_check_interval, 1, 3600, 30,
+		"Min interval in seconds to check a cached connection to a computer node before reusing it.");
+	define_int_config("pgsql_stmt_timeout_ms", pgsql_stmt_timeout_ms, 100, 3600000, 30000,
+		"Deadline in milliseconds of stmts sent to computer nodes by storage stats sync, including connects.");
 	define_int_config("commit_log_retention_hours", commit_log_retention_hours, 24, 24*30, 24,
 		"Interval in hours a thread waits next commit_log clear.");
 	define_int_config("statement_retries", stmt_retries, 1, 10000, 3,
@@ -204,6 +315,12 @@ void Configs::define_configs()
 
 	define_int_config("num_job_threads", num_job_threads, 1, 10, 3,
 		"Number of job work threads to create.");
+	define_int_config("num_notify_threads", num_notify_threads, 1, 32, 3,
+		"Number of threads sending instance update notifications to node_mgr in parallel.");
+	define_int_config("node_notify_retries", node_notify_retries, 0, 100, 5,
+		"NO. of times a failed node_mgr notification is resent before it's given up.");
+	define_int_config("node_notify_retry_interval_ms", node_notify_retry_interval_ms, 10, 60000, 1000,
+		"Initial interval in milli-seconds a failed node_mgr notification is resent, doubled for each further failure.");
 	define_int_config("num_http_threads", num_http_threads, 1, 10, 3,
 		"Number of http server threads to create.");
 	define_int_config("cluster_mgr_http_port", cluster_mgr_http_port, 1000, 65535, 5000,
@@ -457,6 +574,29 @@ int Configs::check_key_vars_set(std::string &vars)
 	return cnt;
 }
 
+/*
+  Check the configs that constrain each other.
+  @retval 0 if all are consistent, -1 otherwise.
+*/
+int Configs::check_var_constraints()
+{
+	/*
+	  Owned cluster leases are renewed by the main thread once a round, which
+	  waits thread_work_interval seconds and may wait a connect to the meta
+	  data server, and they are trusted for half of cluster_lease_timeout.
+	  If it's too short, ownership lapses between renewals and all work stops.
+	*/
+	if ((enable_cluster_partition || enable_warm_standby) &&
+		cluster_lease_timeout / 2 <= thread_work_interval + mysql_connect_timeout)
+	{
+		syslog(Logger::ERROR,
+			"cluster_lease_timeout(%ld) must be more than twice of thread_work_interval(%ld) plus mysql_connect_timeout(%ld).",
+			cluster_lease_timeout, thread_work_interval, mysql_connect_timeout);
+		return -1;
+	}
+	return 0;
+}
+
 class FILE_closer
 {
 	FILE *_fp;
@@ -470,6 +610,7 @@ public:
   Return 0 on success;
   -9 on log entry format error
   -8 if there are vars that must be assigned a value are not so.
+  -7 if configs contradict each other.
 */
 int Configs::process_config_file(const std::string &fn)
 {
@@ -535,6 +676,9 @@ int Configs::process_config_file(const std::string &fn)
 			nbad, bad_vars.c_str());
 		return -8;
 	}
+
+	if (check_var_constraints())
+		return -7;
 	return 0;
 }
 
@@ -74,6 +74,7 @@ class Configs
 	int set_bool_cfg(const std::string &name, const char * val);
 	int set_enum_cfg(const std::string &name, const char * val);
 	int check_key_vars_set(std::string &vars);
+	int check_var_constraints();
 public:
 	static Configs *get_instance();
 	int process_config_file(const std::string &fn);
@@ -0,0 +1,137 @@
+/*
+   Copyright (c) 2019-2021 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "sys_config.h"
+#include "global.h"
+#include "gtid_set.h"
+#include <algorithm>
+#include <charconv>
+
+static std::string_view trim_space(std::string_view s)
+{
+	while (!s.empty() && isspace((unsigned char)s.front()))
+		s.remove_prefix(1);
+	while (!s.empty() && isspace((unsigned char)s.back()))
+		s.remove_suffix(1);
+	return s;
+}
+
+static bool parse_txn_no(std::string_view s, uint64_t &val)
+{
+	auto res = std::from_chars(s.data(), s.data() + s.size(), val);
+	return res.ec == std::errc() && res.ptr == s.data() + s.size() && val > 0;
+}
+
+bool Gtid_set::parse(std::string_view text)
+{
+	clear();
+
+	while (!(text = trim_space(text)).empty())
+	{
+		size_t comma = text.find(',');
+		std::string_view uuid_set = trim_space(text.substr(0, comma));
+		text = (comma == std::string_view::npos ? std::string_view() : text.substr(comma + 1));
+
+		size_t colon = uuid_set.find(':');
+		if (colon == 0 || colon == std::string_view::npos)
+			goto err;
+
+		std::vector<Interval> &intervals = sets[std::string(uuid_set.substr(0, colon))];
+		uuid_set.remove_prefix(colon + 1);
+
+		// each interval is 'N' or 'N-M', separated by ':'
+		while (true)
+		{
+			colon = uuid_set.find(':');
+			std::string_view intvl = uuid_set.substr(0, colon);
+			size_t dash = intvl.find('-');
+			Interval iv;
+
+			if (!parse_txn_no(intvl.substr(0, dash), iv.first))
+				goto err;
+			if (dash == std::string_view::npos)
+				iv.second = iv.first;
+			else if (!parse_txn_no(intvl.substr(dash + 1), iv.second) || iv.second < iv.first)
+				goto err;
+			intervals.emplace_back(iv);
+
+			if (colon == std::string_view::npos)
+				break;
+			uuid_set.remove_prefix(colon + 1);
+		}
+	}
+
+	// sort and merge overlapping or adjacent intervals of each uuid.
+	for (auto &i:sets)
+	{
+		std::vector<Interval> &intervals = i.second;
+		std::sort(intervals.begin(), intervals.end());
+		size_t n = 0;
+		for (size_t j = 1; j < intervals.size(); j++)
+		{
+			if (intervals[j].first <= intervals[n].second + 1)
+				intervals[n].second = std::max(intervals[n].second, intervals[j].second);
+			else
+				intervals[++n] = intervals[j];
+		}
+		intervals.resize(n + 1);
+
+		for (auto &iv:intervals)
+			ntxns += iv.second - iv.first + 1;
+	}
+	return true;
+err:
+	clear();
+	return false;
+}
+
+bool Gtid_set::contains(const Gtid_set &other) const
+{
+	for (auto &i:other.sets)
+	{
+		auto itr = sets.find(i.first);
+		if (itr == sets.end())
+			return false;
+
+		// both are sorted and merged, so each of other's intervals must be
+		// within one of ours.
+		const std::vector<Interval> &mine = itr->second;
+		size_t j = 0;
+		for (auto &iv:i.second)
+		{
+			while (j < mine.size() && mine[j].second < iv.first)
+				j++;
+			if (j == mine.size() || mine[j].first > iv.first || mine[j].second < iv.second)
+				return false;
+		}
+	}
+	return true;
+}
+
+uint64_t Gtid_set::count_not_in(const Gtid_set &other) const
+{
+	uint64_t common = 0;
+	for (auto &i:sets)
+	{
+		auto itr = other.sets.find(i.first);
+		if (itr == other.sets.end())
+			continue;
+
+		// sum the overlaps of both sorted interval lists in one merge pass.
+		const std::vector<Interval> &theirs = itr->second;
+		size_t j = 0;
+		for (auto &iv:i.second)
+		{
+			while (j < theirs.size() && theirs[j].second < iv.first)
+				j++;
+			for (size_t k = j; k < theirs.size() && theirs[k].first <= iv.second; k++)
+				common += std::min(iv.second, theirs[k].second) -
+					std::max(iv.first, theirs[k].first) + 1;
+		}
+	}
+	return ntxns - common;
+}
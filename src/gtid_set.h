@@ -0,0 +1,56 @@
+/*
+   Copyright (c) 2019-2021 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef GTID_SET_H
+#define GTID_SET_H
+#include "sys_config.h"
+#include "global.h"
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+  A MySQL GTID set, e.g. the value of @@global.gtid_executed:
+  'uuid1:1-100:105-200,\nuuid2:1-5'. Intervals of each source uuid are kept
+  sorted and merged, so that sets can be compared precisely, rather than by
+  the last transaction number of one source.
+*/
+class Gtid_set
+{
+public:
+	typedef std::pair<uint64_t, uint64_t> Interval; // [first, last]
+private:
+	std::map<std::string, std::vector<Interval> > sets;
+	uint64_t ntxns;
+public:
+	Gtid_set() : ntxns(0) {}
+
+	/*
+	  Parse text of a GTID set, replacing current content.
+	  @retval false if text isn't a valid GTID set, the set is then empty.
+	*/
+	bool parse(std::string_view text);
+
+	void clear()
+	{
+		sets.clear();
+		ntxns = 0;
+	}
+
+	bool empty() const { return ntxns == 0; }
+	// NO. of transactions in the set.
+	uint64_t count() const { return ntxns; }
+	// whether every transaction in other is also in this set.
+	bool contains(const Gtid_set &other) const;
+	// NO. of transactions in this set but not in other.
+	uint64_t count_not_in(const Gtid_set &other) const;
+	bool operator==(const Gtid_set &other) const { return sets == other.sets; }
+};
+
+#endif // !GTID_SET_H
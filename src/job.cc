@@ -31,6 +31,9 @@ Job* Job::m_inst = NULL;
 int Job::do_exit = 0;
 
 int64_t num_job_threads = 3;
+int64_t num_notify_threads = 3;
+int64_t node_notify_retries = 5;
+int64_t node_notify_retry_interval_ms = 1000;
 std::string http_cmd_version;
 
 extern int64_t cluster_mgr_http_port;
@@ -51,6 +54,10 @@ int64_t storage_instance_port_start;
 int64_t computer_instance_port_start;
 
 extern "C" void *thread_func_job_work(void*thrdarg);
+extern "C" void *thread_func_notify_work(void*thrdarg);
+
+// upper bound of the backoff between two notify attempts to a node_mgr.
+static const int64_t node_notify_max_backoff_ms = 60*1000;
 
 Job::Job()
 {
@@ -67,6 +74,8 @@ int Job::start_job_thread()
 	int error = 0;
 	pthread_mutex_init(&thread_mtx, NULL);
 	pthread_cond_init(&thread_cond, NULL);
+	pthread_mutex_init(&notify_mtx, NULL);
+	pthread_cond_init(&notify_cond, NULL);
 	get_user_name();
 	get_local_ip();
 	
@@ -85,6 +94,21 @@ int Job::start_job_thread()
 		vec_pthread.emplace_back(hdl);
 	}
 
+	//start node_mgr notify thread
+	for(int i=0; i<num_notify_threads; i++)
+	{
+		pthread_t hdl;
+		if ((error = pthread_create(&hdl,NULL, thread_func_notify_work, m_inst)))
+		{
+			char errmsg_buf[256];
+			syslog(Logger::ERROR, "Can not create node_mgr notify thread, error: %d, %s",
+						error, errno, strerror_r(errno, errmsg_buf, sizeof(errmsg_buf)));
+			do_exit = 1;
+			return -1;
+		}
+		vec_notify_pthread.emplace_back(hdl);
+	}
+
 	return 0;
 }
 
@@ -94,39 +118,163 @@ void Job::join_all()
 	pthread_mutex_lock(&thread_mtx);
 	pthread_cond_broadcast(&thread_cond);
 	pthread_mutex_unlock(&thread_mtx);
+
+	pthread_mutex_lock(&notify_mtx);
+	pthread_cond_broadcast(&notify_cond);
+	pthread_mutex_unlock(&notify_mtx);
 	
 	for (auto &i:vec_pthread)
 	{
 		pthread_join(i, NULL);
 	}
+
+	for (auto &i:vec_notify_pthread)
+	{
+		pthread_join(i, NULL);
+	}
 }
 
+/*
+  Queue node_mgr notifications for the notify threads and return at once,
+  the caller may hold the metadata shard mutex. A notification for an ip
+  which is already pending is merged into the pending one.
+  @param type 0: meta_instance; 1: storage_instance; 2: computer_instance
+*/
 void Job::notify_node_update(std::set<std::string> &alterant_node_ip, int type)
 {
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&notify_mtx);
 	for(auto &node_ip: alterant_node_ip)
 	{
+		Node_notify &nn = map_notify_node[node_ip];
+		nn.instance_types |= (1 << type);
+		// a new topology change deserves a fresh round of retries
+		nn.nfails = 0;
+		nn.next_try = now;
+	}
+	pthread_cond_broadcast(&notify_cond);
+	pthread_mutex_unlock(&notify_mtx);
+}
+
+/*
+  Post one update_instance request to node_mgr on node_ip for each instance
+  type in the instance_types bitmap.
+  @retval true if all posts succeeded; false otherwise.
+*/
+bool Job::post_node_update(const std::string &node_ip, int instance_types)
+{
+	static const char *instance_type_strs[] =
+		{"meta_instance", "storage_instance", "computer_instance"};
+	bool ret = true;
+	
+	std::string post_url = "http://" + node_ip + ":" + std::to_string(node_mgr_http_port);
+	//syslog(Logger::INFO, "post_url=%s",post_url.c_str());
+
+	for(int type=0; type<3; type++)
+	{
+		if(!(instance_types & (1 << type)))
+			continue;
+
 		cJSON *root;
 		char *cjson;
 		
 		root = cJSON_CreateObject();
 		cJSON_AddStringToObject(root, "job_type", "update_instance");
-		if(type == 0)
-			cJSON_AddStringToObject(root, "instance_type", "meta_instance");
-		else if(type == 1)
-			cJSON_AddStringToObject(root, "instance_type", "storage_instance");
-		else if(type == 2)
-			cJSON_AddStringToObject(root, "instance_type", "computer_instance");
+		cJSON_AddStringToObject(root, "instance_type", instance_type_strs[type]);
 		
 		cjson = cJSON_Print(root);
 		cJSON_Delete(root);
 		
-		std::string post_url = "http://" + node_ip + ":" + std::to_string(node_mgr_http_port);
-		//syslog(Logger::INFO, "post_url=%s",post_url.c_str());
-		
 		std::string result_str;
-		int ret = Http_client::get_instance()->Http_client_post_para(post_url.c_str(), cjson, result_str);
+		if(Http_client::get_instance()->Http_client_post_para(post_url.c_str(), cjson, result_str))
+			ret = false;
 		free(cjson);
 	}
+
+	return ret;
+}
+
+/*
+  Notify thread body. Pick a due notification whose ip is not being posted
+  by another notify thread, post it without the mutex held, and on failure
+  put it back with exponential backoff, up to node_notify_retries times.
+*/
+void Job::notify_work()
+{
+	pthread_mutex_lock(&notify_mtx);
+
+	while (!Job::do_exit)
+	{
+		time_t now = time(NULL);
+		time_t next_wakeup = 0;
+		auto itr = map_notify_node.begin();
+
+		for (; itr != map_notify_node.end(); ++itr)
+		{
+			if (set_notify_busy.find(itr->first) != set_notify_busy.end())
+				continue;
+			if (itr->second.next_try <= now)
+				break;
+			if (next_wakeup == 0 || itr->second.next_try < next_wakeup)
+				next_wakeup = itr->second.next_try;
+		}
+
+		if (itr == map_notify_node.end())
+		{
+			if (next_wakeup == 0)
+				pthread_cond_wait(&notify_cond, &notify_mtx);
+			else
+			{
+				timespec ts = {next_wakeup, 0};
+				pthread_cond_timedwait(&notify_cond, &notify_mtx, &ts);
+			}
+			continue;
+		}
+
+		std::string node_ip = itr->first;
+		Node_notify nn = itr->second;
+		map_notify_node.erase(itr);
+		set_notify_busy.insert(node_ip);
+		pthread_mutex_unlock(&notify_mtx);
+
+		bool ok = post_node_update(node_ip, nn.instance_types);
+
+		pthread_mutex_lock(&notify_mtx);
+		set_notify_busy.erase(node_ip);
+
+		if (!ok && !Job::do_exit)
+		{
+			if (nn.nfails++ < node_notify_retries)
+			{
+				int64_t backoff_ms = node_notify_retry_interval_ms;
+				for (int i = 1; i < nn.nfails && backoff_ms < node_notify_max_backoff_ms; i++)
+					backoff_ms *= 2;
+				if (backoff_ms > node_notify_max_backoff_ms)
+					backoff_ms = node_notify_max_backoff_ms;
+
+				/*
+				  If another notification of the ip came in meanwhile, merge
+				  the failed types into it, it's due already.
+				*/
+				auto jtr = map_notify_node.find(node_ip);
+				if (jtr == map_notify_node.end())
+				{
+					nn.next_try = time(NULL) + (backoff_ms + 999) / 1000;
+					map_notify_node[node_ip] = nn;
+				}
+				else
+					jtr->second.instance_types |= nn.instance_types;
+			}
+			else
+				syslog(Logger::ERROR, "Failed to notify node_mgr on %s of instance update after %d attempts, given up.",
+					node_ip.c_str(), nn.nfails);
+		}
+
+		pthread_cond_broadcast(&notify_cond);
+	}
+
+	pthread_mutex_unlock(&notify_mtx);
 }
 
 bool Job::check_timestamp(cJSON *root, std::string &str_ret)
@@ -4551,6 +4699,12 @@ bool Job::get_job_type(char *str, Job_type &job_type)
 		job_type = JOB_GET_STORAGE;
 	else if(strcmp(str, "get_computer")==0)
 		job_type = JOB_GET_COMPUTER;
+	else if(strcmp(str, "get_shard_load")==0)
+		job_type = JOB_GET_SHARD_LOAD;
+	else if(strcmp(str, "get_shard_lag")==0)
+		job_type = JOB_GET_SHARD_LAG;
+	else if(strcmp(str, "get_computer_health")==0)
+		job_type = JOB_GET_COMPUTER_HEALTH;
 	else if(strcmp(str, "check_timestamp")==0)
 		job_type = JOB_CHECK_TIMESTAMP;
 	else if(strcmp(str, "get_variable")==0)
@@ -4651,6 +4805,18 @@ bool Job::job_handle_ahead(const std::string &para, std::string &str_ret)
 	{
 		ret = System::get_instance()->get_computer(root, str_ret);
 	}
+	else if(job_type == JOB_GET_SHARD_LOAD)
+	{
+		ret = System::get_instance()->get_shard_load(root, str_ret);
+	}
+	else if(job_type == JOB_GET_SHARD_LAG)
+	{
+		ret = System::get_instance()->get_shard_lag(root, str_ret);
+	}
+	else if(job_type == JOB_GET_COMPUTER_HEALTH)
+	{
+		ret = System::get_instance()->get_computer_health(root, str_ret);
+	}
 	else if(job_type == JOB_GET_VARIABLE)
 	{
 		ret = System::get_instance()->get_variable(root, str_ret);
@@ -4826,3 +4992,14 @@ extern "C" void *thread_func_job_work(void*thrdarg)
 	return NULL;
 }
 
+extern "C" void *thread_func_notify_work(void*thrdarg)
+{
+	Job* job = (Job*)thrdarg;
+	Assert(job);
+
+	signal(SIGPIPE, SIG_IGN);
+	job->notify_work();
+	
+	return NULL;
+}
+
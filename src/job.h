@@ -31,6 +31,9 @@ JOB_GET_META,
 JOB_GET_CLUSTER,
 JOB_GET_STORAGE,
 JOB_GET_COMPUTER,
+JOB_GET_SHARD_LOAD,
+JOB_GET_SHARD_LAG,
+JOB_GET_COMPUTER_HEALTH,
 JOB_CHECK_TIMESTAMP,
 JOB_GET_VARIABLE,
 JOB_SET_VARIABLE,
@@ -76,6 +79,26 @@ private:
 	std::string operation_info;
 
 	std::mutex mutex_operation_;
+
+	/*
+	  Pending node_mgr notifications keyed by node ip. Repeated notifications
+	  to the same ip are merged into one entry until it's sent, and an ip is
+	  never posted to by two notify threads at the same time.
+	*/
+	struct Node_notify
+	{
+		Node_notify() : instance_types(0), nfails(0), next_try(0) {}
+		int instance_types; // bitmap of (1 << type) of notify_node_update()
+		int nfails;
+		time_t next_try;
+	};
+	std::vector<pthread_t> vec_notify_pthread;
+	pthread_mutex_t notify_mtx;
+	pthread_cond_t notify_cond;
+	std::map<std::string, Node_notify> map_notify_node;
+	std::set<std::string> set_notify_busy;
+
+	bool post_node_update(const std::string &node_ip, int instance_types);
 	
 public:
 	Job();
@@ -89,6 +112,7 @@ public:
 	void join_all();
 
 	void notify_node_update(std::set<std::string> &alterant_node_ip, int type);
+	void notify_work();
 	bool check_timestamp(cJSON *root, std::string &str_ret);
 	bool check_local_ip(std::string &ip);
 	void get_local_ip();
@@ -14,45 +14,277 @@
 #include "kl_cluster.h"
 #include "os.h"
 #include "thread_manager.h"
+#include "mysql_row.h"
 #include <unistd.h>
 #include <utility>
+#include <algorithm>
 #include <time.h>
 #include <sys/time.h>
+#include <poll.h>
+
+int64_t storage_stats_concurrency = 8;
+int64_t stats_push_batch_size = 1000;
+int64_t stats_change_threshold_pct = 10;
+int64_t catalog_cache_ttl = 300;
+int64_t pgsql_conn_cache_size = 8;
+int64_t pgsql_conn_idle_timeout = 300;
+int64_t pgsql_conn_check_interval = 30;
+int64_t pgsql_stmt_timeout_ms = 30000;
+int64_t shard_load_history = 10;
+int64_t hot_shard_load_ratio = 3;
+int64_t hot_shard_min_row_ops = 1000;
+
+extern "C" void *thread_func_shard_stats(void*thrdarg);
 
-int PGSQL_CONN::connect(const char *database)
+/*
+  Check an idle cached connection every pgsql_conn_check_interval seconds,
+  a connection closed by the server has EOF to consume.
+  @retval true if the connection is usable.
+*/
+bool PGSQL_CONN::check_conn(Db_conn &dbconn, time_t now)
+{
+	if(now - dbconn.last_check < pgsql_conn_check_interval)
+		return PQstatus(dbconn.conn) == CONNECTION_OK;
+
+	dbconn.last_check = now;
+	if(PQstatus(dbconn.conn) != CONNECTION_OK || !PQconsumeInput(dbconn.conn))
+	{
+		syslog(Logger::INFO, "pgsql connection to %s:%d database %s broken: %s",
+					ip.c_str(), port, dbconn.db.c_str(), PQerrorMessage(dbconn.conn));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+  Make the cached connection to database current if it's usable, a broken
+  one is closed.
+  @retval true if a cached connection is made current.
+*/
+bool PGSQL_CONN::use_cached_conn(const char *database, time_t now)
+{
+	for(auto it=conns.begin(); it!=conns.end(); ++it)
+	{
+		if(it->db != database)
+			continue;
+
+		if(!check_conn(*it, now))
+		{
+			PQfinish(it->conn);
+			conns.erase(it);
+			return false;
+		}
+
+		it->last_used = now;
+		conns.splice(conns.begin(), conns, it);
+		conn = it->conn;
+		db = database;
+		connected = true;
+		return true;
+	}
+	return false;
+}
+
+/*
+  Cache a new connection to database and make it current. The least
+  recently used connection is closed if more than pgsql_conn_cache_size
+  are cached.
+*/
+void PGSQL_CONN::cache_conn(const char *database, PGconn *newconn, time_t now)
+{
+	conns.push_front(Db_conn{database, newconn, now, now, 0});
+	while((int64_t)conns.size() > pgsql_conn_cache_size)
+	{
+		PQfinish(conns.back().conn);
+		conns.pop_back();
+	}
+
+	conn = newconn;
+	db = database;
+	connected = true;
+}
+
+/*
+  Make the connection to database current, reuse the cached one if any,
+  otherwise connect and cache it.
+  If deadline_ms isn't 0 a new connection must be made before it.
+*/
+int PGSQL_CONN::connect(const char *database, int64_t deadline_ms)
 {
 	if(connected && db == database)
+	{
+		conns.front().last_used = time(NULL);
+		return 0;
+	}
+
+	abort_connect();
+	connected = false;
+	conn = NULL;
+
+	time_t now = time(NULL);
+	if(use_cached_conn(database, now))
 		return 0;
-	else
-		close_conn();
 	
+	int64_t remaining = deadline_remaining_ms(deadline_ms);
+	if (remaining <= 0)
+		return 1;
+
 	char conninfo[256];
-	sprintf(conninfo, "dbname=%s host=%s port=%d user=%s password=%s",
+	int len = snprintf(conninfo, sizeof(conninfo), "dbname=%s host=%s port=%d user=%s password=%s",
 						database, ip.c_str(), port, user.c_str(), pwd.c_str());
+	// libpq's resolution is 1 second, and it takes 1 as 2.
+	if (deadline_ms != 0 && len > 0 && len < (int)sizeof(conninfo))
+		snprintf(conninfo + len, sizeof(conninfo) - len, " connect_timeout=%ld",
+				 std::max<int64_t>((remaining + 999) / 1000, 2));
 
-	conn = PQconnectdb(conninfo);
+	PGconn *newconn = PQconnectdb(conninfo);
 
-	if (PQstatus(conn) != CONNECTION_OK)
+	if (PQstatus(newconn) != CONNECTION_OK)
 	{
-		syslog(Logger::ERROR, "Connected to pgsql fail: %s", PQerrorMessage(conn));
+		syslog(Logger::ERROR, "Connected to pgsql fail: %s", PQerrorMessage(newconn));
+		PQfinish(newconn);
 		return 1;
 	}
 
-	db = database;
-	connected = true;
-		
+	cache_conn(database, newconn, now);
+	return 0;
+}
+
+/*
+  Start to make the connection to database current without blocking, it's
+  done by poll_connect() calls when get_socket() is ready for
+  get_poll_events(), unless a cached connection is reused.
+  @retval 0 if connected; 1 if connecting; -1 on error.
+*/
+int PGSQL_CONN::start_connect(const char *database)
+{
+	if(connected && db == database)
+	{
+		conns.front().last_used = time(NULL);
+		return 0;
+	}
+
+	abort_connect();
+	connected = false;
+	conn = NULL;
+
+	if(use_cached_conn(database, time(NULL)))
+		return 0;
+
+	std::string port_str = std::to_string(port);
+	const char *keys[] = {"host", "port", "user", "password", "dbname", NULL};
+	const char *vals[] = {ip.c_str(), port_str.c_str(), user.c_str(), pwd.c_str(), database, NULL};
+
+	connecting = PQconnectStartParams(keys, vals, 0);
+	if (connecting == NULL || PQstatus(connecting) == CONNECTION_BAD)
+	{
+		syslog(Logger::ERROR, "Connected to pgsql %s:%d fail: %s", ip.c_str(), port,
+			   connecting ? PQerrorMessage(connecting) : "out of memory");
+		abort_connect();
+		return -1;
+	}
+	connecting_db = database;
+	// as if the last poll returned PGRES_POLLING_WRITING, by libpq's protocol.
+	connect_status = PGRES_POLLING_WRITING;
+	return 1;
+}
+
+/*
+  Advance the connection started by start_connect(), when its socket is
+  ready. Once connected, it's cached and made current.
+  @retval 0 if connected; 1 if still connecting; -1 on error.
+*/
+int PGSQL_CONN::poll_connect()
+{
+	Assert(connecting);
+	connect_status = PQconnectPoll(connecting);
+	if (connect_status == PGRES_POLLING_FAILED)
+	{
+		syslog(Logger::ERROR, "Connected to pgsql %s:%d fail: %s", ip.c_str(), port,
+			   PQerrorMessage(connecting));
+		abort_connect();
+		return -1;
+	}
+	if (connect_status != PGRES_POLLING_OK)
+		return 1;
+
+	PGconn *newconn = connecting;
+	connecting = NULL;
+	cache_conn(connecting_db.c_str(), newconn, time(NULL));
 	return 0;
 }
 
+void PGSQL_CONN::abort_connect()
+{
+	if (connecting)
+	{
+		PQfinish(connecting);
+		connecting = NULL;
+	}
+}
+
+/*
+  Close the current connection, used when it's broken or its session
+  state must be dropped. Other cached connections are kept.
+*/
 void PGSQL_CONN::close_conn()
 {
+	abort_connect();
+	flushing = false;
 	if(connected)
 	{
+		for(auto it=conns.begin(); it!=conns.end(); ++it)
+		{
+			if(it->conn == conn)
+			{
+				conns.erase(it);
+				break;
+			}
+		}
 		PQfinish(conn);
+		conn = NULL;
 		connected = false;
 	}
 }
 
+void PGSQL_CONN::close_all_conns()
+{
+	abort_connect();
+	flushing = false;
+	free_pgsql_result();
+	for(auto &dbconn:conns)
+		PQfinish(dbconn.conn);
+	conns.clear();
+	conn = NULL;
+	connected = false;
+}
+
+/*
+  Close the cached connections idle for pgsql_conn_idle_timeout seconds,
+  and those found broken by the health check.
+*/
+void PGSQL_CONN::reap_idle_conns()
+{
+	time_t now = time(NULL);
+	for(auto it=conns.begin(); it!=conns.end(); )
+	{
+		if(now - it->last_used < pgsql_conn_idle_timeout && check_conn(*it, now))
+		{
+			++it;
+			continue;
+		}
+
+		if(connected && it->conn == conn)
+		{
+			conn = NULL;
+			connected = false;
+		}
+		PQfinish(it->conn);
+		it = conns.erase(it);
+	}
+}
+
 void PGSQL_CONN::free_pgsql_result()
 {
     if (result)
@@ -62,16 +294,52 @@ void PGSQL_CONN::free_pgsql_result()
     }
 }
 
-int PGSQL_CONN::send_stmt(int pgres, const char *database, const char *stmt)
+/*
+  Make stmt_str of stmt to run on the current connection. If deadline_ms
+  isn't 0, the session's statement_timeout is set to the time left before
+  it, in the same query so no extra round trip is needed; and it's reset
+  when a later stmt has no deadline, so that a cached session never keeps
+  a stale timeout.
+  @retval false if the deadline passed.
+*/
+bool PGSQL_CONN::make_timed_stmt(const char *stmt, int64_t deadline_ms, std::string &stmt_str)
+{
+	int64_t stmt_timeout_ms = 0;
+	if (deadline_ms != 0 && (stmt_timeout_ms = deadline_remaining_ms(deadline_ms)) <= 0)
+	{
+		syslog(Logger::WARNING, "pgsql stmt to %s:%d not sent, deadline passed.", ip.c_str(), port);
+		return false;
+	}
+
+	Db_conn &dbconn = conns.front();
+	if (stmt_timeout_ms != dbconn.stmt_timeout_ms)
+	{
+		stmt_str = "set statement_timeout=" + std::to_string(stmt_timeout_ms) + ";" + stmt;
+		dbconn.stmt_timeout_ms = stmt_timeout_ms;
+	}
+	else
+		stmt_str = stmt;
+	return true;
+}
+
+/*
+  Execute the stmt on database, within deadline_ms if it isn't 0, see
+  make_timed_stmt().
+*/
+int PGSQL_CONN::send_stmt(int pgres, const char *database, const char *stmt, int64_t deadline_ms)
 {
-	if (connect(database))
+	if (connect(database, deadline_ms))
 	{
 		syslog(Logger::ERROR, "pgsql need to connect first");
 		return 1;
 	}
 
+	std::string stmt_str;
+	if (!make_timed_stmt(stmt, deadline_ms, stmt_str))
+		return 1;
+
 	int ret = 0;
-	result = PQexec(conn, stmt);
+	result = PQexec(conn, stmt_str.c_str());
 
 	if(pgres == PG_COPYRES_TUPLES)
 	{
@@ -95,18 +363,110 @@ int PGSQL_CONN::send_stmt(int pgres, const char *database, const char *stmt)
 	return ret;
 }
 
+/*
+  Send the stmt without waiting for its result or blocking on a full socket
+  buffer, connect to database first if not connected to it. The rest of
+  the stmt not sent yet is sent by flush_query() calls, see is_flushing().
+  The stmt must be done by deadline_ms if it isn't 0, see make_timed_stmt().
+  @retval 1 on error, the connection is closed; 0 if sent.
+*/
+int PGSQL_CONN::send_query(const char *database, const char *stmt, int64_t deadline_ms)
+{
+	if (connect(database, deadline_ms))
+	{
+		syslog(Logger::ERROR, "pgsql need to connect first");
+		return 1;
+	}
+
+	std::string stmt_str;
+	if (!make_timed_stmt(stmt, deadline_ms, stmt_str))
+		return 1;
+
+	if (PQsetnonblocking(conn, 1) || !PQsendQuery(conn, stmt_str.c_str()))
+	{
+		syslog(Logger::ERROR, "PQsendQuery error: %s", PQerrorMessage(conn));
+		close_conn();
+		return 1;
+	}
+
+	flushing = true;
+	return flush_query() < 0 ? 1 : 0;
+}
+
+/*
+  Send more of the query sent by send_query(), when the socket is ready.
+  Input is consumed too, as the server may block on sending results
+  before it reads the rest of the query.
+  @retval 0 if all sent; 1 if there is more to send; -1 on error, the
+  connection is closed.
+*/
+int PGSQL_CONN::flush_query()
+{
+	int ret = PQconsumeInput(conn) ? PQflush(conn) : -1;
+	if (ret < 0)
+	{
+		syslog(Logger::ERROR, "PQflush error: %s", PQerrorMessage(conn));
+		close_conn();
+		return -1;
+	}
+	flushing = (ret == 1);
+	return ret;
+}
+
+/*
+  Consume the input available on the connection for the stmt sent by
+  send_query() without blocking, and check its results if all arrived.
+  @param done set to true if all results of the stmt arrived.
+  @retval 1 on error, the connection is closed; 0 otherwise.
+*/
+int PGSQL_CONN::get_query_result(bool &done)
+{
+	int ret = 0;
+	done = false;
+
+	if (!PQconsumeInput(conn))
+	{
+		syslog(Logger::ERROR, "PQconsumeInput error: %s", PQerrorMessage(conn));
+		close_conn();
+		return 1;
+	}
+
+	while (!PQisBusy(conn))
+	{
+		PGresult *res = PQgetResult(conn);
+		if (res == NULL)
+		{
+			done = true;
+			break;
+		}
+
+		ExecStatusType status = PQresultStatus(res);
+		if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK)
+		{
+			syslog(Logger::ERROR, "PQresultStatus error: %s", PQerrorMessage(conn));
+			ret = 1;
+		}
+		PQclear(res);
+	}
+
+	if (done && ret)
+		close_conn();
+
+	return ret;
+}
+
 /*
   If send stmt fails because connection broken, reconnect and
   retry sending the stmt. Retry pgsql_stmt_conn_retries times.
   @retval 1 on error, 0 if successful.
 */
 int Computer_node::
-send_stmt(int pgres, const char *database, const char *stmt, int nretries)
+send_stmt(int pgres, const char *database, const char *stmt, int nretries, int64_t deadline_ms)
 {
 	int ret = 1;
 	for (int i = 0; i < nretries; i++)
 	{
-		if (gpsql_conn.send_stmt(pgres, database, stmt) == 0)
+		if (gpsql_conn.send_stmt(pgres, database, stmt, deadline_ms) == 0)
 		{
 			ret = 0;
 			break;
@@ -116,6 +476,9 @@ send_stmt(int pgres, const char *database, const char *stmt, int nretries)
 			return 1;
 
 		close_conn();
+		// no use to wait if the retry can't start before the deadline
+		if (i + 1 == nretries || deadline_remaining_ms(deadline_ms) <= stmt_retry_interval_ms)
+			break;
 		usleep(stmt_retry_interval_ms * 1000);
 	}
 	return ret;
@@ -153,10 +516,112 @@ bool Computer_node::set_variables(std::string &variable, std::string &value_int,
 	return true;
 }
 
+static Slab<Computer_node> computer_node_slab;
+
+void *Computer_node::operator new(size_t sz)
+{
+	Assert(sz == sizeof(Computer_node));
+	return computer_node_slab.alloc();
+}
+
+void Computer_node::operator delete(void *p)
+{
+	computer_node_slab.free(p);
+}
+
+void probe_computer_nodes(std::vector<Comp_probe> &probes, int64_t deadline_ms)
+{
+	struct Pending
+	{
+		Comp_probe *probe;
+		PGconn *conn;
+		PostgresPollingStatusType status;
+	};
+	std::vector<Pending> pending;
+	int64_t start_us = monotonic_us();
+
+	for (auto &probe:probes)
+	{
+		std::string port = std::to_string(probe.port);
+		const char *keys[] = {"host", "port", "user", "password", "dbname", NULL};
+		const char *vals[] = {probe.ip.c_str(), port.c_str(), probe.user.c_str(),
+			probe.pwd.c_str(), "postgres", NULL};
+
+		PGconn *conn = PQconnectStartParams(keys, vals, 0);
+		if (conn == NULL || PQstatus(conn) == CONNECTION_BAD)
+		{
+			probe.error = conn ? PQerrorMessage(conn) : "out of memory";
+			PQfinish(conn);
+			continue;
+		}
+		// as if the last poll returned PGRES_POLLING_WRITING, by libpq's protocol.
+		pending.emplace_back(Pending{&probe, conn, PGRES_POLLING_WRITING});
+	}
+
+	std::vector<pollfd> pfds;
+	while (!pending.empty() && !Thread_manager::do_exit)
+	{
+		int64_t remaining = deadline_remaining_ms(deadline_ms);
+		if (remaining <= 0)
+			break;
+
+		pfds.resize(pending.size());
+		for (size_t i = 0; i < pending.size(); i++)
+		{
+			// the socket may change when libpq tries the next address.
+			pfds[i].fd = PQsocket(pending[i].conn);
+			pfds[i].events = (pending[i].status == PGRES_POLLING_READING ? POLLIN : POLLOUT);
+			pfds[i].revents = 0;
+		}
+
+		int n = poll(pfds.data(), pfds.size(), (int)std::min<int64_t>(remaining, 1000));
+		if (n < 0 && errno != EINTR)
+		{
+			char errmsg_buf[256];
+			syslog(Logger::ERROR, "poll() failed probing computer nodes, error: %d, %s",
+				   errno, strerror_r(errno, errmsg_buf, sizeof(errmsg_buf)));
+			break;
+		}
+		if (n <= 0)
+			continue;
+
+		for (size_t i = 0, j = 0; i < pfds.size(); i++)
+		{
+			Pending &pd = pending[j];
+			if (pfds[i].revents != 0)
+				pd.status = PQconnectPoll(pd.conn);
+
+			if (pd.status == PGRES_POLLING_OK)
+			{
+				pd.probe->alive = true;
+				pd.probe->latency_us = monotonic_us() - start_us;
+			}
+			else if (pd.status == PGRES_POLLING_FAILED)
+				pd.probe->error = PQerrorMessage(pd.conn);
+			else
+			{
+				j++;
+				continue;
+			}
+
+			PQfinish(pd.conn);
+			pending.erase(pending.begin() + j);
+		}
+	}
+
+	for (auto &pd:pending)
+	{
+		pd.probe->error = "timed out";
+		PQfinish(pd.conn);
+	}
+}
+
 KunlunCluster::KunlunCluster(uint id_, const std::string &name_):
-	id(id_),name(name_)
+	id(id_),name(name_),median_shard_load(0),meta_shard_space_synced(false),
+	catalog_refresh_time(0),catalog_ddl_op_id(0)
 {
 	pthread_mutex_init(&mtx, NULL);
+	pthread_mutex_init(&push_mtx, NULL);
 }
 
 KunlunCluster::~KunlunCluster()
@@ -165,202 +630,235 @@ KunlunCluster::~KunlunCluster()
 		delete i;
 	for (auto &i:computer_nodes)
 		delete i;
+	for (auto &i:master_push_targets)
+		delete i.second.conn;
 }
 
 /*
-  Connect to storage node, get tables' rows & pages, 
-  and update to computer nodes.
+  Make master_push_targets match computer_nodes, called with System::mtx
+  held after computer_nodes is refreshed. A node whose connection params
+  changed may be another instance, it's pushed all primaries again.
 */
-int KunlunCluster::refresh_storages_to_computers()
+void KunlunCluster::refresh_master_push_conns()
 {
-	int ret;
-	PGresult *presult;
-	MYSQL_RES *result;
-	MYSQL_ROW row;
-	char *endptr = NULL;
-	std::string str_sql;
-	
-	std::vector<std::string> vec_database;
-	std::vector<std::tuple<std::string, std::string, uint>> vec_database_namespace_oid;
-	//map 				database	namespace	oid					table				page	row
-	std::map<std::tuple<std::string, std::string, uint>, std::map<std::string, std::pair<uint, uint>>> map_dbnsid_table_page_row;
-	
-	////////////////////////////////////////////////////////
-	//get TABLE_SCHEMA from one comp
-	if(computer_nodes.size() == 0)
-		return 0;
-	Computer_node* computer = computer_nodes[0];
-	
-	//get database
-	ret = computer->send_stmt(PG_COPYRES_TUPLES, "postgres", "select datname from pg_database", stmt_retries);
-	if(ret)
-		return ret;
+	Scopped_mutex sm(push_mtx);
+	std::map<uint, Master_push_target> targets;
+	std::string ip, user, pwd;
+	int port = 0;
 
-	presult = computer->get_result();
-	for(int i=0;i<PQntuples(presult);i++)
+	for (auto &comp:computer_nodes)
 	{
-		//syslog(Logger::ERROR, "presult %d = %s", i, PQgetvalue(presult,i,0));
-		std::string db = PQgetvalue(presult,i,0);
-		if(db == "template1")
-			continue;
-		else if(db == "template0")
-			continue;
+		comp->get_ip_port(ip, port);
+		comp->get_user_pwd(user, pwd);
 
-		vec_database.emplace_back(db);
+		auto itr = master_push_targets.find(comp->id);
+		if (itr != master_push_targets.end())
+		{
+			PGSQL_CONN *conn = itr->second.conn;
+			if (conn->ip == ip && conn->port == port && conn->user == user && conn->pwd == pwd)
+			{
+				targets[comp->id] = itr->second;
+				master_push_targets.erase(itr);
+				continue;
+			}
+			delete conn;
+			master_push_targets.erase(itr);
+		}
+		targets[comp->id] = Master_push_target{
+			new PGSQL_CONN(ip.c_str(), port, user.c_str(), pwd.c_str(), NULL), {}, 0, 0};
 	}
-	computer->free_pgsql_result();
 
-	////////////////////////////////////////////////////////
-	//get namespace from every database
-	for(auto &db:vec_database)
-	{
-		ret = computer->send_stmt(PG_COPYRES_TUPLES, db.c_str(), "select oid,nspname from pg_namespace", stmt_retries);
-		if(ret)
-			return ret;
+	// the rest are of removed computer nodes
+	for (auto &i:master_push_targets)
+		delete i.second.conn;
+	master_push_targets.swap(targets);
+}
 
-		presult = computer->get_result();
-		for(int i=0;i<PQntuples(presult);i++)
-		{
-			//syslog(Logger::ERROR, "presult %d = %s", i, PQgetvalue(presult,i,0));
-			std::string ns = PQgetvalue(presult,i,1);
-			if(ns == "pg_toast")
-				continue;
-			else if(ns == "pg_temp_1")
-				continue;
-			else if(ns == "pg_toast_temp_1")
-				continue;
-			else if(ns == "pg_catalog")
-				continue;
-			else if(ns == "information_schema")
-				continue;
+/*
+  Update a shard's primary node to pg_shard of the computer nodes which
+  haven't acknowledged it, concurrently, so that they route writes to it
+  at once instead of finding it out by themselves. Called by the worker
+  thread maintaining the shard, so it tries once within
+  health_check_timeout_ms, nodes failed are retried by later calls after
+  their backoff, and nodes done are never pushed again.
+  @retval 0 if all computer nodes have the primary, 1 otherwise.
+*/
+int KunlunCluster::push_shard_master(uint shard_id, uint master_node_id)
+{
+	Scopped_mutex sm(push_mtx);
+	if (master_push_targets.empty())
+		return 1; // computer nodes not fetched yet
 
-			uint oid = strtol(PQgetvalue(presult,i,0), &endptr, 10);
-			vec_database_namespace_oid.emplace_back(std::make_tuple(db, ns, oid));
-		}
-		computer->free_pgsql_result();
-		computer->close_conn();
-	}
+	const std::vector<std::string> stmts{"update pg_shard set master_node_id=" +
+		std::to_string(master_node_id) + " where id=" + std::to_string(shard_id)};
 
-	////////////////////////////////////////////////////////
-	//get TABLE_NAME,TABLE_ROWS by TABLE_SCHEMA from storage_shards
-	for(auto &shard:storage_shards)
+	int64_t now = monotonic_ms();
+	int ret = 0;
+	std::vector<Computer_stmts> vec_comp_stmts;
+	std::vector<Master_push_target *> vec_targets;
+	for (auto &i:master_push_targets)
 	{
-		Shard_node *master_sn = shard->get_master();
-		if(shard->get_type() == Shard::METADATA || master_sn == NULL)
+		Master_push_target &tgt = i.second;
+		auto itr = tgt.pushed.find(shard_id);
+		if (itr != tgt.pushed.end() && itr->second == master_node_id)
 			continue;
 
-		////////////////////////////////////////////////////////
-		//get innodb_page_size
-		uint page_size = shard->get_innodb_page_size();
-		if(page_size == 0)
+		ret = 1;
+		if (now < tgt.next_push_ms)
 			continue;
+		vec_comp_stmts.emplace_back(Computer_stmts(tgt.conn, &stmts));
+		vec_targets.emplace_back(&tgt);
+	}
 
-		////////////////////////////////////////////////////////
-		//get tables' rows&size, pages = size/page_size from every databases _$$_ namespace
-		for(auto &db_ns_id:vec_database_namespace_oid)
-		{
-			str_sql = "select TABLE_NAME,TABLE_ROWS,DATA_LENGTH from information_schema.tables where table_type='BASE TABLE' and TABLE_SCHEMA='" + 
-						std::get<0>(db_ns_id) + "_$$_" + std::get<1>(db_ns_id) + "'";
-			//syslog(Logger::INFO, "str_sql11111111 = %s", str_sql.c_str());
-
-			Scopped_mutex sm(shard->mtx);
-			ret = master_sn->send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
+	if (vec_comp_stmts.empty())
+		return ret;
 
-			if (ret)
-			   continue;
-			result = master_sn->get_result();
-			endptr = NULL;
+	send_stmts_to_computers("postgres", vec_comp_stmts, now + health_check_timeout_ms);
 
-			while ((row = mysql_fetch_row(result)))
-			{
-				uint rows = strtol(row[1], &endptr, 10);
-				Assert(endptr == NULL || *endptr == '\0');
-				uint pages = strtol(row[2], &endptr, 10);
-				Assert(endptr == NULL || *endptr == '\0');
-				pages = pages/page_size;
-
-				auto it0 = map_dbnsid_table_page_row.find(db_ns_id);
-				if(it0 == map_dbnsid_table_page_row.end())
-				{
-					std::map<std::string, std::pair<uint, uint>> map_table_page_row;
-					map_table_page_row[row[0]] = std::make_pair(pages, rows);
-					map_dbnsid_table_page_row[db_ns_id] = map_table_page_row;
-				}
-				else
-				{
-					auto it1 = it0->second.find(row[0]);
-					if(it1 == it0->second.end())
-					{
-						it0->second[row[0]] = std::make_pair(pages, rows);
-					}
-					else	//may be a table in two shards
-					{
-						it1->second.first += pages;
-						it1->second.second += rows;
-					}
-				}
-			}
-			
-			master_sn->free_mysql_result();
+	ret = 0;
+	for (size_t i = 0; i < vec_comp_stmts.size(); i++)
+	{
+		Master_push_target &tgt = *vec_targets[i];
+		if (vec_comp_stmts[i].ret == 0)
+		{
+			tgt.pushed[shard_id] = master_node_id;
+			tgt.nfails = 0;
+			tgt.next_push_ms = 0;
+			continue;
 		}
+
+		int64_t backoff = stmt_retry_interval_ms << std::min(tgt.nfails++, 20);
+		tgt.next_push_ms = monotonic_ms() + std::min(backoff, node_probe_max_backoff_ms);
+		syslog(Logger::ERROR, "push primary node %u of shard %u to computer node %s:%d fail, to retry in %ld ms",
+			   master_node_id, shard_id, tgt.conn->ip.c_str(), tgt.conn->port,
+			   std::min(backoff, node_probe_max_backoff_ms));
 	}
 
-	////////////////////////////////////////////////////////
-	// refresh tables' pages&rows to computer_nodes by db,ns,ns_oid
-	for(auto &comp:computer_nodes)
+	for (auto &i:master_push_targets)
+	{
+		auto itr = i.second.pushed.find(shard_id);
+		if (itr == i.second.pushed.end() || itr->second != master_node_id)
+			ret = 1;
+	}
+	return ret;
+}
+
+/*
+  Shared by the threads running one run_on_shards_parallel() call, each of
+  them takes the next shard index until all are done.
+*/
+struct Shard_stats_task
+{
+	Shard_stats_task(size_t n, const std::function<void(size_t)> &f) :
+		nshards(n), next(0), fn(f)
+	{}
+	size_t nshards;
+	std::atomic<size_t> next;
+	const std::function<void(size_t)> &fn;
+};
+
+extern "C" void *thread_func_shard_stats(void*thrdarg)
+{
+	Shard_stats_task *task = (Shard_stats_task*)thrdarg;
+	size_t i;
+
+	while (!Thread_manager::do_exit && (i = task->next++) < task->nshards)
+		task->fn(i);
+	return NULL;
+}
+
+/*
+  Call fn(0) ... fn(nshards - 1) in up to storage_stats_concurrency threads,
+  the calling thread being one of them, and return when all calls are done.
+  fn must only use the stats connections of shard nodes.
+*/
+void KunlunCluster::run_on_shards_parallel(size_t nshards,
+	const std::function<void(size_t)> &fn)
+{
+	Shard_stats_task task(nshards, fn);
+	std::vector<pthread_t> thds;
+	size_t nthds = std::min((size_t)storage_stats_concurrency, nshards);
+
+	for (size_t i = 1; i < nthds; i++)
 	{
-		for(auto &dbnsid:map_dbnsid_table_page_row)
+		pthread_t hdl;
+		int error;
+		if ((error = pthread_create(&hdl, NULL, thread_func_shard_stats, &task)))
 		{
-			for(auto &tb_p_r:dbnsid.second)
-			{
-				str_sql = "update pg_class set relpages=" + std::to_string(tb_p_r.second.first) +
-							",reltuples=" + std::to_string(tb_p_r.second.second) +
-							" where relname='" + tb_p_r.first + 
-							"' and relnamespace=" + std::to_string(std::get<2>(dbnsid.first));
-
-				//syslog(Logger::INFO, "str_sql222222 = %s", str_sql.c_str());
-				bool ret = comp->send_stmt(PG_COPYRES_EVENTS, std::get<0>(dbnsid.first).c_str(), str_sql.c_str(), stmt_retries);
-				comp->free_pgsql_result();
-				comp->close_conn();
-			}
+			// the threads already created and this one will do all the work.
+			syslog(Logger::WARNING, "Can not create shard stats thread, error: %d", error);
+			break;
 		}
+		thds.emplace_back(hdl);
 	}
 
-	return 0;
+	thread_func_shard_stats(&task);
+
+	for (auto &hdl:thds)
+		pthread_join(hdl, NULL);
 }
 
 /*
-  Connect to storage node, get num_tablets & space_volumn, 
-  and update to computer nodes and meta shard.
+  Refresh the databases&namespaces cached from computer_nodes[0], if the
+  cache is older than catalog_cache_ttl seconds or any DDL was logged into
+  the cluster's ddl_ops_log table since the cache was refreshed.
+  @retval 0 if the cache is valid, otherwise the cache is invalid.
 */
-int KunlunCluster::refresh_storages_to_computers_metashard(MetadataShard &meta_shard)
+int KunlunCluster::refresh_catalog_cache(MetadataShard &meta_shard)
 {
 	int ret;
 	PGresult *presult;
 	MYSQL_RES *result;
-	MYSQL_ROW row;
+	Mysql_row row;
 	char *endptr = NULL;
-	
 	std::string str_sql;
-	std::vector<std::string> vec_database;
-	std::vector<std::pair<std::string, std::string>> vec_database_namespace;
-	std::map<uint, std::pair<uint, uint>> map_shard_tables_space;
-	
+	uint64_t ddl_op_id = 0;
+	bool ddl_op_id_ok = false;
+
+	////////////////////////////////////////////////////////
+	//get the latest ddl op id of the cluster
+	Shard_node *meta_master_sn = meta_shard.get_master();
+	if(meta_master_sn)
+	{
+		str_sql = "select max(id) from ddl_ops_log_" + get_name();
+
+		Scopped_mutex sm(meta_shard.mtx);
+		if(!meta_master_sn->send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries))
+		{
+			result = meta_master_sn->get_result();
+			if (row.fetch(result))
+			{
+				ddl_op_id = row.get_or(0, (uint64_t)0);
+				ddl_op_id_ok = true;
+			}
+			meta_master_sn->free_mysql_result();
+		}
+	}
+
+	time_t now = time(NULL);
+	if(catalog_refresh_time != 0 && now - catalog_refresh_time < catalog_cache_ttl &&
+		ddl_op_id_ok && ddl_op_id == catalog_ddl_op_id)
+		return 0;
+
+	catalog_refresh_time = 0;
+	catalog_db_ns_oid.clear();
+
 	////////////////////////////////////////////////////////
 	//get TABLE_SCHEMA from one comp
 	if(computer_nodes.size() == 0)
-		return 0;
+		return 1;
 	Computer_node* computer = computer_nodes[0];
+	std::vector<std::string> vec_database;
 	
 	//get database
-	ret = computer->send_stmt(PG_COPYRES_TUPLES, "postgres", "select datname from pg_database", stmt_retries);
+	ret = computer->send_stmt(PG_COPYRES_TUPLES, "postgres", "select datname from pg_database",
+		stmt_retries, monotonic_ms() + pgsql_stmt_timeout_ms);
 	if(ret)
 		return ret;
 
 	presult = computer->get_result();
 	for(int i=0;i<PQntuples(presult);i++)
 	{
-		//syslog(Logger::ERROR, "presult %d = %s", i, PQgetvalue(presult,i,0));
 		std::string db = PQgetvalue(presult,i,0);
 		if(db == "template1")
 			continue;
@@ -375,15 +873,18 @@ int KunlunCluster::refresh_storages_to_computers_metashard(MetadataShard &meta_s
 	//get namespace from every database
 	for(auto &db:vec_database)
 	{
-		ret = computer->send_stmt(PG_COPYRES_TUPLES, db.c_str(), "select nspname from pg_namespace", stmt_retries);
+		ret = computer->send_stmt(PG_COPYRES_TUPLES, db.c_str(), "select oid,nspname from pg_namespace",
+			stmt_retries, monotonic_ms() + pgsql_stmt_timeout_ms);
 		if(ret)
+		{
+			catalog_db_ns_oid.clear();
 			return ret;
+		}
 
 		presult = computer->get_result();
 		for(int i=0;i<PQntuples(presult);i++)
 		{
-			//syslog(Logger::ERROR, "presult %d = %s", i, PQgetvalue(presult,i,0));
-			std::string ns = PQgetvalue(presult,i,0);
+			std::string ns = PQgetvalue(presult,i,1);
 			if(ns == "pg_toast")
 				continue;
 			else if(ns == "pg_temp_1")
@@ -395,62 +896,589 @@ int KunlunCluster::refresh_storages_to_computers_metashard(MetadataShard &meta_s
 			else if(ns == "information_schema")
 				continue;
 
-			vec_database_namespace.emplace_back(std::make_pair(db, ns));
+			uint oid = strtol(PQgetvalue(presult,i,0), &endptr, 10);
+			catalog_db_ns_oid.emplace_back(std::make_tuple(db, ns, oid));
 		}
 		computer->free_pgsql_result();
-		computer->close_conn();
 	}
 
-	////////////////////////////////////////////////////////
-	//get tables' size&number from every shard
+	// without a ddl op id, the cache expires by catalog_cache_ttl only
+	catalog_ddl_op_id = ddl_op_id;
+	catalog_refresh_time = now;
+
+	return 0;
+}
+
+/*
+  Fetch from every storage shard's master the rows&size of all tables in
+  the databases' _$$_ namespaces, by one query per shard, all shards
+  concurrently via the masters' stats connections. The result is kept in
+  shard_table_stats for refresh_storages_to_computers() and
+  refresh_storages_to_computers_metashard() of the same sync round.
+*/
+int KunlunCluster::collect_storage_stats()
+{
+	std::vector<std::pair<Shard*, Shard_node*>> vec_shard_master;
 	for(auto &shard:storage_shards)
 	{
 		Shard_node *master_sn = shard->get_master();
 		if(shard->get_type() == Shard::METADATA || master_sn == NULL)
 			continue;
+		vec_shard_master.emplace_back(std::make_pair(shard, master_sn));
+	}
+
+	shard_table_stats.clear();
+	shard_table_stats.resize(vec_shard_master.size());
+
+	auto collect_shard_stats = [&](size_t idx)
+	{
+		Shard *shard = vec_shard_master[idx].first;
+		Shard_node *master_sn = vec_shard_master[idx].second;
+		Shard_table_stats &stats = shard_table_stats[idx];
+		MYSQL_RES *result;
+		Mysql_row row;
+
+		stats.shard_id = shard->get_id();
 
 		////////////////////////////////////////////////////////
-		//get tables' size&number from every databases _$$_ namespace
-		uint num_tablets = 0;
-		uint64_t space_volumn = 0;
-		
-		for(auto &db_ns:vec_database_namespace)
+		//get innodb_page_size
+		stats.page_size = shard->get_innodb_page_size(master_sn);
+
+		////////////////////////////////////////////////////////
+		//get tables' rows&size from all _$$_ namespaces in one query,
+		//'\_' is a literal '_' in LIKE patterns
+		if (master_sn->send_stats_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
+				"select TABLE_SCHEMA,TABLE_NAME,TABLE_ROWS,DATA_LENGTH from information_schema.tables where table_type='BASE TABLE' and TABLE_SCHEMA like '%\\_$$\\_%'"),
+				stmt_retries))
+			return;
+		result = master_sn->get_stats_result();
+		stats.tables.reserve(mysql_num_rows(result));
+
+		while (row.fetch(result))
 		{
-			str_sql = "select count(*),sum(DATA_LENGTH) from information_schema.tables where table_type='BASE TABLE' and TABLE_SCHEMA='" + 
-						db_ns.first + "_$$_" + db_ns.second + "'";
-			//syslog(Logger::INFO, "str_sql777777 = %s", str_sql.c_str());
+			Shard_table_stats::Table_stats ts;
+			ts.schema = row.str(0);
+			ts.table = row.str(1);
+			ts.rows = row.get_or(2, (uint64_t)0);
+			ts.data_length = row.get_or(3, (uint64_t)0);
+			stats.tables.emplace_back(std::move(ts));
+		}
 
-			Scopped_mutex sm(shard->mtx);
-			ret = master_sn->send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
-			
-			if (ret)
-			   return ret;
-			result = master_sn->get_result();
-			endptr = NULL;
+		master_sn->free_stats_result();
+		stats.valid = true;
+
+		////////////////////////////////////////////////////////
+		//sample workload counters, cheap to read from global_status
+		if (master_sn->send_stats_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
+				"select VARIABLE_NAME, VARIABLE_VALUE from performance_schema.global_status where VARIABLE_NAME in ('Questions','Com_commit','Com_xa_commit','Innodb_rows_read','Innodb_rows_inserted','Innodb_rows_updated','Innodb_rows_deleted') "
+				"union all select 'apply_queue', max(COUNT_TRANSACTIONS_REMOTE_IN_APPLIER_QUEUE) from performance_schema.replication_group_member_stats"),
+				stmt_retries))
+			return;
+		result = master_sn->get_stats_result();
+		Shard_workload_sample &ws = stats.workload;
+		while (row.fetch(result))
+		{
+			std::string_view var = row.str(0);
+			uint64_t val = row.get_or(1, (uint64_t)0);
+			if (var == "Questions")
+				ws.questions = val;
+			else if (var == "Com_commit" || var == "Com_xa_commit")
+				ws.commits += val;
+			else if (var == "Innodb_rows_read")
+				ws.rows_read = val;
+			else if (var == "apply_queue")
+				ws.apply_queue = val;
+			else
+				ws.rows_written += val;
+		}
+		master_sn->free_stats_result();
+		ws.time = time(NULL);
+		ws.master_id = master_sn->get_id();
+		ws.valid = true;
+	};
+
+	run_on_shards_parallel(vec_shard_master.size(), [&](size_t idx)
+	{
+		// stats queries go via mysql_conn if shared, under the shard's mtx
+		if(share_shard_conns)
+		{
+			Scopped_mutex sm(vec_shard_master[idx].first->mtx);
+			collect_shard_stats(idx);
+		}
+		else
+			collect_shard_stats(idx);
+	});
+
+	update_shard_workloads();
+	return 0;
+}
+
+/*
+  Append the workload samples collected by collect_storage_stats() to each
+  shard's series, recompute the rates, and flag the shards whose load is
+  over hot_shard_load_ratio times the cluster's median shard load.
+*/
+void KunlunCluster::update_shard_workloads()
+{
+	// series of shards removed from the cluster are dropped.
+	std::map<uint, Shard_workload> workloads;
+	for (auto &shard:storage_shards)
+	{
+		auto itr = shard_workloads.find(shard->get_id());
+		if (itr != shard_workloads.end())
+			workloads[itr->first] = std::move(itr->second);
+	}
+	shard_workloads.swap(workloads);
+
+	for (auto &stats:shard_table_stats)
+	{
+		Shard_workload &wl = shard_workloads[stats.shard_id];
+		if (!stats.workload.valid)
+			continue;
+
+		// a new master or a restart resets the counters, so does the series.
+		const Shard_workload_sample &cur = stats.workload;
+		if (!wl.samples.empty())
+		{
+			const Shard_workload_sample &last = wl.samples.back();
+			if (last.master_id != cur.master_id || cur.questions < last.questions ||
+				cur.rows_read < last.rows_read || cur.rows_written < last.rows_written ||
+				cur.commits < last.commits)
+			{
+				wl.samples.clear();
+				wl.qps = wl.commits_ps = wl.row_reads_ps = wl.row_writes_ps = 0;
+			}
+		}
+		wl.samples.emplace_back(cur);
+		while (wl.samples.size() > (size_t)shard_load_history)
+			wl.samples.pop_front();
+
+		wl.apply_queue = cur.apply_queue;
+		const Shard_workload_sample &first = wl.samples.front();
+		double secs = (double)(cur.time - first.time);
+		if (secs <= 0)
+			continue;
+		wl.qps = (cur.questions - first.questions) / secs;
+		wl.commits_ps = (cur.commits - first.commits) / secs;
+		wl.row_reads_ps = (cur.rows_read - first.rows_read) / secs;
+		wl.row_writes_ps = (cur.rows_written - first.rows_written) / secs;
+	}
+
+	std::vector<double> loads;
+	for (auto &i:shard_workloads)
+		if (i.second.samples.size() > 1)
+			loads.emplace_back(i.second.load());
+	if (loads.empty())
+	{
+		median_shard_load = 0;
+		return;
+	}
+	std::sort(loads.begin(), loads.end());
+	size_t mid = loads.size() / 2;
+	median_shard_load = (loads.size() % 2) ? loads[mid] : (loads[mid - 1] + loads[mid]) / 2;
+
+	for (auto &i:shard_workloads)
+	{
+		Shard_workload &wl = i.second;
+		bool hot = loads.size() > 1 && wl.samples.size() > 1 &&
+			wl.load() >= hot_shard_min_row_ops &&
+			wl.load() > median_shard_load * hot_shard_load_ratio;
+		if (hot && !wl.hot)
+			syslog(Logger::WARNING, "Shard %u of cluster (%s, %u) is hot: %.0f row ops/s, cluster median %.0f, %.0f queries/s, %.0f commits/s, applier queue %lu.",
+				   i.first, name.c_str(), id, wl.load(), median_shard_load,
+				   wl.qps, wl.commits_ps, (unsigned long)wl.apply_queue);
+		else if (!hot && wl.hot)
+			syslog(Logger::INFO, "Shard %u of cluster (%s, %u) is no longer hot: %.0f row ops/s, cluster median %.0f.",
+				   i.first, name.c_str(), id, wl.load(), median_shard_load);
+		wl.hot = hot;
+	}
+}
+
+/*
+  Whether a stats value changed from the last pushed one by more than
+  stats_change_threshold_pct percent.
+*/
+static bool stats_changed(uint64_t last, uint64_t cur)
+{
+	uint64_t diff = (cur > last) ? cur - last : last - cur;
+	if(diff == 0)
+		return false;
+
+	return diff * 100 > last * stats_change_threshold_pct;
+}
+
+/*
+  Double the single quotes of a string to be put in a pgsql literal.
+*/
+static std::string escape_pg_literal(const std::string &str)
+{
+	std::string ret;
+	ret.reserve(str.length());
+	for(auto c:str)
+	{
+		if(c == '\'')
+			ret += '\'';
+		ret += c;
+	}
+	return ret;
+}
+
+/*
+  Make the stmts updating relpages&reltuples of tables of one database in
+  one transaction, stats_push_batch_size tables per statement.
+  @param vec_values "('relname',relnamespace,relpages,reltuples)" items.
+*/
+static void make_pg_class_stmts(const std::vector<std::string> &vec_values,
+	std::vector<std::string> &vec_stmts)
+{
+	std::string str_sql;
+
+	vec_stmts.clear();
+	if(vec_values.size() == 0)
+		return;
+
+	vec_stmts.emplace_back("begin");
+	for(size_t i=0; i<vec_values.size(); i+=stats_push_batch_size)
+	{
+		str_sql = "update pg_class c set relpages=v.relpages,reltuples=v.reltuples from (values ";
+		for(size_t j=i; j<vec_values.size() && j<i+stats_push_batch_size; j++)
+		{
+			if(j > i)
+				str_sql += ",";
+			str_sql += vec_values[j];
+		}
+		str_sql += ") as v(relname,relnamespace,relpages,reltuples)"
+					" where c.relname=v.relname::name and c.relnamespace=v.relnamespace::oid";
+		vec_stmts.emplace_back(str_sql);
+	}
+	vec_stmts.emplace_back("commit");
+}
+
+/*
+  Run each node's stmts in order on all the computer nodes concurrently,
+  the connection to database of each node is reused. Connects, sends and
+  results of all nodes are done without blocking in one poll() loop, so a
+  slow or unreachable node delays no others. A node stops at its first
+  failed stmt and its connection is closed, so an open transaction of it
+  is rolled back. Results are set to each Computer_stmts::ret.
+  All stmts must be done by deadline_ms of monotonic_ms() if it isn't 0,
+  nodes not done by then fail.
+*/
+void KunlunCluster::send_stmts_to_computers(const char *database,
+	std::vector<Computer_stmts> &vec_comp_stmts, int64_t deadline_ms)
+{
+	std::vector<struct pollfd> pollfds;
+	std::vector<Computer_stmts*> vec_running;
+
+	auto fail = [](Computer_stmts *cs, const char *why)
+	{
+		PGSQL_CONN &conn = *cs->conn;
+		syslog(Logger::ERROR, "computer node %s:%d fail to run stmt (%s): %s",
+					conn.ip.c_str(), conn.port, why, (*cs->stmts)[cs->next].c_str());
+		conn.close_conn();
+		cs->ret = 1;
+	};
+
+	for(auto &cs:vec_comp_stmts)
+	{
+		cs.next = 0;
+		cs.ret = 0;
+		if(cs.stmts->size() == 0)
+			continue;
+
+		int ret = cs.conn->start_connect(database);
+		if(ret < 0 || (ret == 0 && cs.conn->send_query(database, (*cs.stmts)[0].c_str(), deadline_ms)))
+			cs.ret = 1;
+		else
+			vec_running.emplace_back(&cs);
+	}
+
+	while(vec_running.size() > 0)
+	{
+		int64_t remaining = deadline_remaining_ms(deadline_ms);
+		if(remaining <= 0 || Thread_manager::do_exit)
+		{
+			for(auto cs:vec_running)
+				fail(cs, Thread_manager::do_exit ? "exiting" : "timed out");
+			break;
+		}
+
+		pollfds.resize(vec_running.size());
+		for(size_t i=0; i<vec_running.size(); i++)
+		{
+			// the socket may change when libpq tries the next address.
+			pollfds[i].fd = vec_running[i]->conn->get_socket();
+			pollfds[i].events = vec_running[i]->conn->get_poll_events();
+			pollfds[i].revents = 0;
+		}
+
+		// wake up every second to check exit
+		int nready = poll(&*pollfds.begin(), pollfds.size(), (int)std::min<int64_t>(remaining, 1000));
+		if(nready < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			syslog(Logger::ERROR, "poll computer nodes failed: %d", errno);
+			for(auto cs:vec_running)
+				fail(cs, "poll failed");
+			break;
+		}
 
-			if ((row = mysql_fetch_row(result)))
+		std::vector<Computer_stmts*> vec_still_running;
+		for(size_t i=0; i<vec_running.size(); i++)
+		{
+			Computer_stmts *cs = vec_running[i];
+			PGSQL_CONN &conn = *cs->conn;
+			if(pollfds[i].revents == 0)
+			{
+				vec_still_running.emplace_back(cs);
+				continue;
+			}
+
+			if(conn.is_connecting())
 			{
-				if(row[0] != NULL && row[1] != NULL)
+				int ret = conn.poll_connect();
+				if(ret < 0 || (ret == 0 && conn.send_query(database, (*cs->stmts)[0].c_str(), deadline_ms)))
+					cs->ret = 1;
+				else
+					vec_still_running.emplace_back(cs);
+				continue;
+			}
+
+			// results may have arrived with the flush, so check them too.
+			if(conn.is_flushing() && conn.flush_query() < 0)
+			{
+				cs->ret = 1;
+				continue;
+			}
+
+			bool done = false;
+			if(conn.get_query_result(done))
+			{
+				if(!done)
+					conn.close_conn();
+				cs->ret = 1;
+				syslog(Logger::ERROR, "computer node %s:%d fail to run stmt: %s",
+							conn.ip.c_str(), conn.port, (*cs->stmts)[cs->next].c_str());
+				continue;
+			}
+			if(!done)
+			{
+				vec_still_running.emplace_back(cs);
+				continue;
+			}
+
+			if(++cs->next == cs->stmts->size())
+				continue;
+
+			if(conn.send_query(database, (*cs->stmts)[cs->next].c_str(), deadline_ms))
+				cs->ret = 1;
+			else
+				vec_still_running.emplace_back(cs);
+		}
+		vec_running.swap(vec_still_running);
+	}
+}
+
+/*
+  Get tables' rows & pages from the stats collected by collect_storage_stats(),
+  and update to computer nodes. The catalog cache must have been refreshed
+  by refresh_catalog_cache().
+*/
+int KunlunCluster::refresh_storages_to_computers()
+{
+	//map 				database	namespace	oid					table				page	row
+	std::map<std::tuple<std::string, std::string, uint>, std::map<std::string, std::pair<uint, uint>>> map_dbnsid_table_page_row;
+	
+	if(catalog_refresh_time == 0)
+		return 1;
+	const auto &vec_database_namespace_oid = catalog_db_ns_oid;
+
+	////////////////////////////////////////////////////////
+	//sum tables' rows&pages of every databases _$$_ namespace from all shards,
+	//pages = size/page_size
+	std::map<std::string, size_t> map_schema_dbnsid;
+	for(size_t i=0; i<vec_database_namespace_oid.size(); i++)
+	{
+		auto &db_ns_id = vec_database_namespace_oid[i];
+		map_schema_dbnsid[std::get<0>(db_ns_id) + "_$$_" + std::get<1>(db_ns_id)] = i;
+	}
+
+	for(auto &shard_stats:shard_table_stats)
+	{
+		if(!shard_stats.valid || shard_stats.page_size == 0)
+			continue;
+
+		for(auto &ts:shard_stats.tables)
+		{
+			auto it0 = map_schema_dbnsid.find(ts.schema);
+			if(it0 == map_schema_dbnsid.end())
+				continue;
+
+			uint rows = ts.rows;
+			uint pages = ts.data_length/shard_stats.page_size;
+
+			auto &table_map = map_dbnsid_table_page_row[vec_database_namespace_oid[it0->second]];
+			auto it1 = table_map.find(ts.table);
+			if(it1 == table_map.end())
+			{
+				table_map[ts.table] = std::make_pair(pages, rows);
+			}
+			else	//may be a table in two shards
+			{
+				it1->second.first += pages;
+				it1->second.second += rows;
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////
+	// find tables whose pages&rows changed since last pushed, the others
+	// keep their last pushed values to compare with next time
+	//map database	values of all tables	values of changed tables
+	std::map<std::string, std::pair<std::vector<std::string>, std::vector<std::string>>> map_db_values;
+	for(auto &dbnsid:map_dbnsid_table_page_row)
+	{
+		auto &db_values = map_db_values[std::get<0>(dbnsid.first)];
+		auto it_last_ns = last_pushed_table_page_row.find(dbnsid.first);
+
+		for(auto &tb_p_r:dbnsid.second)
+		{
+			std::string value = "('" + escape_pg_literal(tb_p_r.first) + "'," +
+						std::to_string(std::get<2>(dbnsid.first)) + "," +
+						std::to_string(tb_p_r.second.first) + "," +
+						std::to_string(tb_p_r.second.second) + ")";
+
+			bool changed = true;
+			if(it_last_ns != last_pushed_table_page_row.end())
+			{
+				auto it_last = it_last_ns->second.find(tb_p_r.first);
+				if(it_last != it_last_ns->second.end() &&
+					!stats_changed(it_last->second.first, tb_p_r.second.first) &&
+					!stats_changed(it_last->second.second, tb_p_r.second.second))
 				{
-					num_tablets += strtol(row[0], &endptr, 10);
-					Assert(endptr == NULL || *endptr == '\0');
-					space_volumn += strtol(row[1], &endptr, 10);
-					Assert(endptr == NULL || *endptr == '\0');
+					changed = false;
+					tb_p_r.second = it_last->second;
 				}
 			}
-			
-			master_sn->free_mysql_result();
+
+			if(changed)
+				db_values.second.emplace_back(value);
+			db_values.first.emplace_back(std::move(value));
+		}
+	}
+
+	////////////////////////////////////////////////////////
+	// refresh tables' pages&rows to all computer_nodes concurrently, one
+	// transaction per database on each computer_node, reusing its connection
+	std::set<uint> set_failed_comps;
+	std::vector<std::string> vec_all_stmts, vec_changed_stmts;
+	for(auto &db_values:map_db_values)
+	{
+		make_pg_class_stmts(db_values.second.first, vec_all_stmts);
+		make_pg_class_stmts(db_values.second.second, vec_changed_stmts);
+
+		std::vector<Computer_stmts> vec_comp_stmts;
+		for(auto &comp:computer_nodes)
+		{
+			bool synced = (set_pg_class_synced_comps.find(comp->id) != set_pg_class_synced_comps.end());
+			vec_comp_stmts.emplace_back(Computer_stmts(comp, synced ? &vec_changed_stmts : &vec_all_stmts));
 		}
 
-		map_shard_tables_space[shard->get_id()] = std::make_pair(num_tablets, space_volumn);
+		send_stmts_to_computers(db_values.first.c_str(), vec_comp_stmts,
+			monotonic_ms() + pgsql_stmt_timeout_ms);
+
+		for(auto &cs:vec_comp_stmts)
+		{
+			if(cs.ret == 0)
+				continue;
+			syslog(Logger::ERROR, "push pg_class stats of database %s to computer node %s fail",
+						db_values.first.c_str(), cs.comp->get_name().c_str());
+			set_failed_comps.insert(cs.comp->id);
+		}
+	}
+
+	std::set<uint> set_synced_comps;
+	for(auto &comp:computer_nodes)
+	{
+		if(set_failed_comps.find(comp->id) == set_failed_comps.end())
+			set_synced_comps.insert(comp->id);
+	}
+
+	last_pushed_table_page_row.swap(map_dbnsid_table_page_row);
+
+	for(auto &comp:computer_nodes)
+		comp->reap_idle_conns();
+	set_pg_class_synced_comps.swap(set_synced_comps);
+
+	return 0;
+}
+
+/*
+  Get num_tablets & space_volumn from the stats collected by
+  collect_storage_stats(), and update to computer nodes and meta shard.
+  The catalog cache must have been refreshed by refresh_catalog_cache().
+*/
+int KunlunCluster::refresh_storages_to_computers_metashard(MetadataShard &meta_shard)
+{
+	std::string str_sql;
+	std::map<uint, std::pair<uint, uint64_t>> map_shard_tables_space;
+	
+	if(catalog_refresh_time == 0)
+		return 1;
+
+	////////////////////////////////////////////////////////
+	//sum tables' size&number of every databases _$$_ namespace for each shard
+	std::set<std::string> set_schema;
+	for(auto &db_ns_id:catalog_db_ns_oid)
+		set_schema.insert(std::get<0>(db_ns_id) + "_$$_" + std::get<1>(db_ns_id));
+
+	for(auto &shard_stats:shard_table_stats)
+	{
+		if(!shard_stats.valid)
+			continue;
+
+		uint num_tablets = 0;
+		uint64_t space_volumn = 0;
+
+		for(auto &ts:shard_stats.tables)
+		{
+			if(set_schema.find(ts.schema) == set_schema.end())
+				continue;
+
+			num_tablets++;
+			space_volumn += ts.data_length;
+		}
+
+		map_shard_tables_space[shard_stats.shard_id] = std::make_pair(num_tablets, space_volumn);
+	}
+
+	////////////////////////////////////////////////////////
+	// find shards whose size&number changed since last pushed, the others
+	// keep their last pushed values to compare with next time
+	std::map<uint, std::pair<uint, uint64_t>> map_changed_tables_space;
+	for(auto &sd_tb_sp:map_shard_tables_space)
+	{
+		auto it_last = last_pushed_shard_tables_space.find(sd_tb_sp.first);
+		if(it_last != last_pushed_shard_tables_space.end() &&
+			it_last->second.first == sd_tb_sp.second.first &&
+			!stats_changed(it_last->second.second, sd_tb_sp.second.second))
+		{
+			sd_tb_sp.second = it_last->second;
+			continue;
+		}
+
+		map_changed_tables_space.insert(sd_tb_sp);
 	}
 
 	////////////////////////////////////////////////////////
 	// refresh tables' size&number to MetadataShard by master meta
 	Shard_node *meta_master_sn = meta_shard.get_master();
+	bool meta_synced = (meta_master_sn != NULL);
 	if(meta_master_sn)
 	{
-		for(auto &sd_tb_sp:map_shard_tables_space)
+		auto &map_tables_space = meta_shard_space_synced ? map_changed_tables_space : map_shard_tables_space;
+		for(auto &sd_tb_sp:map_tables_space)
 		{
 			str_sql = "update shards set space_volumn=" + std::to_string(sd_tb_sp.second.second) +
 				",num_tablets=" + std::to_string(sd_tb_sp.second.first) +
@@ -459,27 +1487,47 @@ int KunlunCluster::refresh_storages_to_computers_metashard(MetadataShard &meta_s
 			//syslog(Logger::INFO, "str_sql88888 = %s", str_sql.c_str());
 
 			Scopped_mutex sm(meta_shard.mtx);
-			meta_master_sn->send_stmt(SQLCOM_UPDATE, str_sql.c_str(), str_sql.length(), stmt_retries);
+			if(meta_master_sn->send_stmt(SQLCOM_UPDATE, str_sql.c_str(), str_sql.length(), stmt_retries))
+				meta_synced = false;
 			meta_master_sn->free_mysql_result();
 		}
 	}
+	meta_shard_space_synced = meta_synced;
 	
 	////////////////////////////////////////////////////////
-	// refresh tables' size&number to computer_nodes by any database
+	// refresh tables' size&number to all computer_nodes concurrently
+	std::vector<std::string> vec_all_stmts, vec_changed_stmts;
+	for(auto &sd_tb_sp:map_shard_tables_space)
+	{
+		str_sql = "update pg_shard set space_volumn=" + std::to_string(sd_tb_sp.second.second) +
+					",num_tablets=" + std::to_string(sd_tb_sp.second.first) +
+					" where id=" + std::to_string(sd_tb_sp.first);
+		
+		//syslog(Logger::INFO, "str_sql99999 = %s", str_sql.c_str());
+		if(map_changed_tables_space.find(sd_tb_sp.first) != map_changed_tables_space.end())
+			vec_changed_stmts.emplace_back(str_sql);
+		vec_all_stmts.emplace_back(str_sql);
+	}
+
+	std::vector<Computer_stmts> vec_comp_stmts;
 	for(auto &comp:computer_nodes)
 	{
-		for(auto &sd_tb_sp:map_shard_tables_space)
-		{
-			str_sql = "update pg_shard set space_volumn=" + std::to_string(sd_tb_sp.second.second) +
-						",num_tablets=" + std::to_string(sd_tb_sp.second.first) +
-						" where id=" + std::to_string(sd_tb_sp.first);
-			
-			//syslog(Logger::INFO, "str_sql99999 = %s", str_sql.c_str());
-			bool ret = comp->send_stmt(PG_COPYRES_EVENTS, "postgres", str_sql.c_str(), stmt_retries);
-			comp->free_pgsql_result();
-		}
+		bool synced = (set_pg_shard_synced_comps.find(comp->id) != set_pg_shard_synced_comps.end());
+		vec_comp_stmts.emplace_back(Computer_stmts(comp, synced ? &vec_changed_stmts : &vec_all_stmts));
 	}
 
+	send_stmts_to_computers("postgres", vec_comp_stmts, monotonic_ms() + pgsql_stmt_timeout_ms);
+
+	std::set<uint> set_synced_comps;
+	for(auto &cs:vec_comp_stmts)
+	{
+		if(cs.ret == 0)
+			set_synced_comps.insert(cs.comp->id);
+	}
+
+	last_pushed_shard_tables_space.swap(map_shard_tables_space);
+	set_pg_shard_synced_comps.swap(set_synced_comps);
+
 	return 0;
 }
 
@@ -12,35 +12,102 @@
 #include <map>
 #include <vector>
 #include <tuple>
+#include <functional>
+#include <list>
+#include <deque>
+#include <poll.h>
 
 #include "pgsql/libpq-fe.h"
 
+extern int64_t storage_stats_concurrency;
+extern int64_t stats_push_batch_size;
+extern int64_t stats_change_threshold_pct;
+extern int64_t catalog_cache_ttl;
+extern int64_t pgsql_conn_cache_size;
+extern int64_t pgsql_conn_idle_timeout;
+extern int64_t pgsql_conn_check_interval;
+extern int64_t pgsql_stmt_timeout_ms;
+extern int64_t shard_load_history;
+extern int64_t hot_shard_load_ratio;
+extern int64_t hot_shard_min_row_ops;
+
 class PGSQL_CONN
 {
 private:
+	/*
+	  A connection to one database, kept in conns after the stmt on it
+	  finished, so that switching back to the database reuses it.
+	*/
+	struct Db_conn
+	{
+		std::string db;
+		PGconn *conn;
+		time_t last_used;
+		time_t last_check;
+		int64_t stmt_timeout_ms; // statement_timeout of the session, 0 for none
+	};
+
 	bool connected;
 	int port;
 	std::string db, ip, user, pwd;
 	PGconn	   *conn;
 	PGresult   *result;
 	Computer_node *owner;
+	// connections to databases, most recently used first, conn is in it if connected
+	std::list<Db_conn> conns;
+	/*
+	  A connection being made by start_connect() and poll_connect() without
+	  blocking, to connecting_db, and what its last poll waits for.
+	*/
+	PGconn *connecting;
+	std::string connecting_db;
+	PostgresPollingStatusType connect_status;
+	bool flushing; // a query sent by send_query() is not all flushed yet
 	friend class Computer_node;
+	friend class KunlunCluster;
 	void free_pgsql_result();
+	bool check_conn(Db_conn &dbconn, time_t now);
+	bool make_timed_stmt(const char *stmt, int64_t deadline_ms, std::string &stmt_str);
+	bool use_cached_conn(const char *database, time_t now);
+	void cache_conn(const char *database, PGconn *newconn, time_t now);
+	void abort_connect();
 public:
 	PGSQL_CONN(const char * ip_, int port_, const char * user_,		const char * pwd_, Computer_node *owner_):
-		connected(false), port(port_), ip(ip_), user(user_), pwd(pwd_), owner(owner_)
+		connected(false), port(port_), ip(ip_), user(user_), pwd(pwd_), owner(owner_),
+		connecting(NULL), connect_status(PGRES_POLLING_FAILED), flushing(false)
 	{
+		conn = NULL;
 		result = NULL;
 	}
 
-	~PGSQL_CONN() { close_conn(); }
+	~PGSQL_CONN() { close_all_conns(); }
 
-	int send_stmt(int pgres, const char *database, const char *stmt);
+	int send_stmt(int pgres, const char *database, const char *stmt, int64_t deadline_ms = 0);
+	int send_query(const char *database, const char *stmt, int64_t deadline_ms = 0);
+	int flush_query();
+	int get_query_result(bool &done);
+	int get_socket() const
+	{
+		return connected ? PQsocket(conn) : (connecting ? PQsocket(connecting) : -1);
+	}
+	// poll() events the socket is waited for by send_stmts_to_computers().
+	short get_poll_events() const
+	{
+		if (connecting)
+			return connect_status == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+		return flushing ? (POLLIN | POLLOUT) : POLLIN;
+	}
+	bool is_connecting() const { return connecting != NULL; }
+	bool is_flushing() const { return flushing; }
 
 	Computer_node *get_owner() { return owner; }
 
-	int connect(const char *database);
+	int connect(const char *database, int64_t deadline_ms = 0);
+	int start_connect(const char *database);
+	int poll_connect();
 	void close_conn();
+	void close_all_conns();
+	void reap_idle_conns();
 };
 
 class Computer_node
@@ -52,6 +119,10 @@ public:
 	friend class PGSQL_CONN;
 	PGSQL_CONN gpsql_conn;
 
+	// Computer_node objects are stored in a Slab, see computer_node_slab.
+	static void *operator new(size_t sz);
+	static void operator delete(void *p);
+
 	Computer_node(uint id_, uint cluster_id_, int port_,
 		const char * name_, const char * ip_, const char * user_, const char * pwd_):
 		id(id_), cluster_id(cluster_id_), name(name_),
@@ -116,21 +187,129 @@ public:
 			is_change = true;
 		}
 
-		// close connect, it will be reconnect while next send_stmt
+		// close connects, it will be reconnect while next send_stmt
 		if(is_change)
-			close_conn();
+			gpsql_conn.close_all_conns();
 
 		return is_change;
 	}
 
-	int send_stmt(int pgres, const char *database, const char *stmt, int nretries = 1);
+	/*
+	  deadline_ms is the monotonic_ms() by which the stmt must be done,
+	  including all connects and retries, 0 for no deadline.
+	*/
+	int send_stmt(int pgres, const char *database, const char *stmt,
+		int nretries = 1, int64_t deadline_ms = 0);
 	void close_conn() { gpsql_conn.close_conn(); }
 	PGresult *get_result() { return gpsql_conn.result; }
+	PGSQL_CONN &get_conn() { return gpsql_conn; }
+	void reap_idle_conns() { gpsql_conn.reap_idle_conns(); }
 	void free_pgsql_result() { gpsql_conn.free_pgsql_result(); }
 	bool get_variables(std::string &variable, std::string &value);
 	bool set_variables(std::string &variable, std::string &value_int, std::string &value_str);
 };
 
+/*
+  A liveness probe of a computer node by probe_computer_nodes(): a
+  connection made from scratch and closed, i.e. the work of any new client.
+*/
+struct Comp_probe
+{
+	Comp_probe(uint comp_id_, const std::string &ip_, int port_,
+		const std::string &user_, const std::string &pwd_) :
+		comp_id(comp_id_), ip(ip_), port(port_), user(user_), pwd(pwd_),
+		alive(false), latency_us(0) {}
+	uint comp_id;
+	std::string ip;
+	int port;
+	std::string user;
+	std::string pwd;
+	bool alive;
+	int64_t latency_us; // to connect, if alive
+	std::string error; // why it's not alive
+};
+
+/*
+  Probe the computer nodes concurrently, all connections are made with
+  nonblocking libpq calls in one poll() loop, so a node hanging costs no
+  more than deadline_ms of monotonic_ms() to the whole round.
+*/
+void probe_computer_nodes(std::vector<Comp_probe> &probes, int64_t deadline_ms);
+
+/*
+  Statements to run in order on a computer node by
+  KunlunCluster::send_stmts_to_computers(), with the node's result.
+*/
+struct Computer_stmts
+{
+	Computer_stmts(Computer_node *comp_, const std::vector<std::string> *stmts_) :
+		comp(comp_), conn(&comp_->get_conn()), stmts(stmts_), next(0), ret(0) {}
+	// run on a connection not of a Computer_node object, comp is NULL.
+	Computer_stmts(PGSQL_CONN *conn_, const std::vector<std::string> *stmts_) :
+		comp(NULL), conn(conn_), stmts(stmts_), next(0), ret(0) {}
+	Computer_node *comp;
+	PGSQL_CONN *conn;
+	const std::vector<std::string> *stmts;
+	size_t next; // index of the stmt running
+	int ret; // 1 if a stmt failed, the rest are not run; 0 if all succeeded
+};
+
+/*
+  Cumulative workload counters of a shard's master, sampled by each storage
+  stats sync. Rates are derived from the differences of samples.
+*/
+struct Shard_workload_sample
+{
+	Shard_workload_sample() :
+		time(0), master_id(0), questions(0), commits(0), rows_read(0),
+		rows_written(0), apply_queue(0), valid(false) {}
+	time_t time;
+	uint master_id; // counters are reset by a new master or its restart
+	uint64_t questions;
+	uint64_t commits; // Com_commit + Com_xa_commit
+	uint64_t rows_read;
+	uint64_t rows_written; // innodb rows inserted, updated and deleted
+	uint64_t apply_queue; // max MGR applier queue of the group's members, not cumulative
+	bool valid;
+};
+
+/*
+  Recent workload of a storage shard, rates are per second averaged over
+  the samples taken since the master last changed or restarted.
+*/
+struct Shard_workload
+{
+	Shard_workload() :
+		qps(0), commits_ps(0), row_reads_ps(0), row_writes_ps(0),
+		apply_queue(0), hot(false) {}
+	std::deque<Shard_workload_sample> samples; // oldest first, at most shard_load_history
+	double qps, commits_ps, row_reads_ps, row_writes_ps;
+	uint64_t apply_queue;
+	// load is row reads and writes per second, hot if it's far above the cluster's median
+	double load() const { return row_reads_ps + row_writes_ps; }
+	bool hot;
+};
+
+/*
+  Tables of one storage shard, fetched from its master by one query per
+  storage stats sync, shared by both stats sync passes.
+*/
+struct Shard_table_stats
+{
+	struct Table_stats
+	{
+		std::string schema, table; // schema is 'db_$$_namespace'
+		uint64_t rows, data_length;
+	};
+
+	Shard_table_stats() : shard_id(0), page_size(0), valid(false) {}
+	uint shard_id;
+	uint page_size; // 0 if unknown
+	bool valid; // false if the stats query failed
+	std::vector<Table_stats> tables;
+	Shard_workload_sample workload;
+};
+
 class KunlunCluster
 {
 private:
@@ -143,6 +322,63 @@ public:
 	std::vector<Computer_node *> computer_nodes;
 	std::vector<Shard *> storage_shards;
 
+private:
+	// filled by collect_storage_stats(), only used by the storage sync thread
+	std::vector<Shard_table_stats> shard_table_stats;
+
+	/*
+	  Workload of storage shards by shard id, updated by each storage stats
+	  sync. Guarded by System::mtx like the other stats.
+	*/
+	std::map<uint, Shard_workload> shard_workloads;
+	double median_shard_load;
+
+	void update_shard_workloads();
+
+	/*
+	  Stats last pushed by the storage sync thread, only stats changed beyond
+	  stats_change_threshold_pct are pushed again. A computer node not in the
+	  synced sets (new, or a push to it failed) gets all stats pushed.
+	*/
+	//map 				database	namespace	oid					table				page	row
+	std::map<std::tuple<std::string, std::string, uint>, std::map<std::string, std::pair<uint, uint>>> last_pushed_table_page_row;
+	std::set<uint> set_pg_class_synced_comps;
+	//map shard_id		num_tablets	space_volumn
+	std::map<uint, std::pair<uint, uint64_t>> last_pushed_shard_tables_space;
+	std::set<uint> set_pg_shard_synced_comps;
+	bool meta_shard_space_synced;
+
+	// databases&namespaces of computer nodes shared by both storage sync passes
+	//vector 			database	namespace	oid
+	std::vector<std::tuple<std::string, std::string, uint>> catalog_db_ns_oid;
+	time_t catalog_refresh_time; // 0 if the cache is invalid
+	uint64_t catalog_ddl_op_id; // max id of ddl_ops_log table when cached
+
+	/*
+	  A computer node to push new shard primaries to, with the primaries it
+	  has acknowledged. A node failed is retried after a backoff doubled
+	  from stmt_retry_interval_ms up to node_probe_max_backoff_ms.
+	*/
+	struct Master_push_target
+	{
+		PGSQL_CONN *conn;
+		std::map<uint, uint> pushed; // shard id -> primary node id
+		int nfails; // consecutive failed pushes
+		int64_t next_push_ms; // monotonic_ms() before which it's not retried
+	};
+
+	/*
+	  Push targets by computer node id. Their connections are not the
+	  nodes' own connections, which are used by the storage sync thread
+	  with System::mtx held for a whole stats pass, so that a push never
+	  waits for a stats pass. Guarded by push_mtx.
+	*/
+	pthread_mutex_t push_mtx;
+	std::map<uint, Master_push_target> master_push_targets;
+
+	void run_on_shards_parallel(size_t nshards, const std::function<void(size_t)> &fn);
+	void send_stmts_to_computers(const char *database, std::vector<Computer_stmts> &vec_comp_stmts,
+		int64_t deadline_ms = 0);
 public:
 	KunlunCluster(uint id_, const std::string &name_);
 	~KunlunCluster();
@@ -159,6 +395,13 @@ public:
 		return name;
 	}
 
+	void refresh_master_push_conns();
+	int push_shard_master(uint shard_id, uint master_node_id);
+
+	int refresh_catalog_cache(MetadataShard &meta_shard);
+	int collect_storage_stats();
+	const std::map<uint, Shard_workload> &get_shard_workloads() const { return shard_workloads; }
+	double get_median_shard_load() const { return median_shard_load; }
 	int refresh_storages_to_computers();
 	int refresh_storages_to_computers_metashard(MetadataShard &meta_shard);
 	int truncate_commit_log_from_metadata_server(std::vector<KunlunCluster *> &kl_clusters, MetadataShard &meta_shard);
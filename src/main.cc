@@ -57,8 +57,10 @@ int main(int argc, char **argv)
 		{
 			System::get_instance()->refresh_shards_from_metadata_server();
 			System::get_instance()->refresh_computers_from_metadata_server();
+			System::get_instance()->refresh_cluster_ownership();
 			System::get_instance()->meta_shard_maintenance();
 			System::get_instance()->process_recovered_prepared();
+			System::get_instance()->save_topology_snapshot();
 		}
 
 		Thread_manager::get_instance()->sleep_wait(&main_thd, thread_work_interval * 1000);
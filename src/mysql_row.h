@@ -0,0 +1,105 @@
+/*
+   Copyright (c) 2019-2021 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef MYSQL_ROW_H
+#define MYSQL_ROW_H
+#include "sys_config.h"
+#include "global.h"
+
+#include <charconv>
+#include <string_view>
+#include <time.h>
+#include "mysql/mysql.h"
+
+/*
+  View of the current row of a MYSQL_RES. Columns are accessed by the
+  lengths from mysql_fetch_lengths(), so no strlen() is needed, and are
+  converted in place without any allocation. A view is valid until the
+  next fetch() or until the result is freed.
+*/
+class Mysql_row
+{
+private:
+	MYSQL_ROW row;
+	unsigned long *lengths;
+public:
+	Mysql_row() : row(NULL), lengths(NULL) {}
+
+	/*
+	  Fetch the next row of result.
+	  @retval false if no more rows.
+	*/
+	bool fetch(MYSQL_RES *result)
+	{
+		if ((row = mysql_fetch_row(result)) == NULL)
+			return false;
+		lengths = mysql_fetch_lengths(result);
+		return true;
+	}
+
+	bool is_null(uint i) const { return row[i] == NULL; }
+
+	// c string of column i, NULL if the column is NULL.
+	const char *c_str(uint i) const { return row[i]; }
+
+	// column i, empty if the column is NULL.
+	std::string_view str(uint i) const
+	{
+		return row[i] ? std::string_view(row[i], lengths[i]) : std::string_view();
+	}
+
+	/*
+	  Convert column i to an integer.
+	  @retval false if the column is NULL or not an integer of type T.
+	*/
+	template <typename T>
+	bool get(uint i, T &val) const
+	{
+		if (row[i] == NULL)
+			return false;
+		const char *end = row[i] + lengths[i];
+		auto res = std::from_chars(row[i], end, val);
+		return res.ec == std::errc() && res.ptr == end;
+	}
+
+	// Same as get() but returns def if column i is NULL or not an integer.
+	template <typename T>
+	T get_or(uint i, T def) const
+	{
+		T val;
+		return get(i, val) ? val : def;
+	}
+};
+
+/*
+  Parse an XA transaction ID started by Kunlun computing nodes, of format
+  '<comp_nodeid>-<start_ts>-<local_txnid>' including the single quotes,
+  e.g. '1-1598596846-967098'. Nothing is allocated or modified.
+  @retval true if xid is of the format.
+*/
+inline bool parse_kunlun_xid(std::string_view xid, uint32_t &comp_nodeid,
+	time_t &start_ts, uint32_t &local_txnid)
+{
+	if (xid.size() < 2 || xid.front() != '\'' || xid.back() != '\'')
+		return false;
+
+	const char *p = xid.data() + 1;
+	const char *end = xid.data() + xid.size() - 1;
+
+	auto res = std::from_chars(p, end, comp_nodeid);
+	if (res.ec != std::errc() || res.ptr == end || *res.ptr != '-')
+		return false;
+
+	res = std::from_chars(res.ptr + 1, end, start_ts);
+	if (res.ec != std::errc() || res.ptr == end || *res.ptr != '-')
+		return false;
+
+	res = std::from_chars(res.ptr + 1, end, local_txnid);
+	return res.ec == std::errc() && res.ptr == end;
+}
+
+#endif // !MYSQL_ROW_H
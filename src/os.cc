@@ -10,6 +10,26 @@
 #include "os.h"
 #include <signal.h>
 #include <unistd.h>
+#include <time.h>
+
+/*
+  Milli-seconds of a clock not affected by system time changes, to compute
+  intervals and deadlines.
+*/
+int64_t monotonic_ms()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Micro-seconds of the clock of monotonic_ms(), to measure short latencies.
+int64_t monotonic_us()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 /*
   Make sure count bytes have been written, when write() is interrupted
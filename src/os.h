@@ -17,4 +17,15 @@ typedef void (*sigfunc_t) (int signo);
 sigfunc_t handle_signal(int signo, sigfunc_t func);
 
 ssize_t my_write(int fd, const void *buf, size_t count);
+int64_t monotonic_ms();
+int64_t monotonic_us();
+
+/*
+  Milli-seconds left before deadline_ms got from monotonic_ms(), which is
+  0 for no deadline, and INT64_MAX is returned for it.
+*/
+inline int64_t deadline_remaining_ms(int64_t deadline_ms)
+{
+	return deadline_ms == 0 ? INT64_MAX : deadline_ms - monotonic_ms();
+}
 #endif // !OS_H
@@ -15,8 +15,10 @@
 #include "job.h"
 #include "kl_cluster.h"
 #include "thread_manager.h"
+#include "mysql_row.h"
 #include <unistd.h>
 #include <utility>
+#include <algorithm>
 #include <time.h>
 #include <sys/time.h>
 
@@ -30,6 +32,21 @@ int64_t meta_svr_port = 0;
 int64_t check_shard_interval = 3;
 int64_t stmt_retries = 3;
 int64_t stmt_retry_interval_ms = 500;
+int64_t meta_conn_pool_size = 8;
+int64_t shard_conn_keepalive_interval = 10;
+int64_t shard_conn_idle_timeout = 600;
+int64_t max_shard_conns = 0;
+int64_t share_shard_conns = 0;
+int64_t node_breaker_threshold = 3;
+int64_t node_probe_min_backoff_ms = 1000;
+int64_t node_probe_max_backoff_ms = 60000;
+int64_t health_check_timeout_ms = 3000;
+int64_t mgr_progress_refresh_interval = 30;
+int64_t mgr_lag_sample_interval = 10;
+int64_t mgr_lag_history = 60;
+
+// NO. of open MYSQL_CONN connections to shard nodes
+std::atomic<int64_t> num_shard_conns(0);
 
 std::string meta_svr_ip;
 std::string meta_svr_user;
@@ -38,6 +55,126 @@ std::string meta_svr_pwd;
 // not configurable for now
 bool mysql_transmit_compress = false;
 
+/*
+  Storage shards, their nodes and scheduling states are each stored in a
+  Slab, so that objects of a kind are contiguous rather than scattered over
+  the heap. A Shard_node has two MYSQL handles, so fewer fit in a chunk.
+*/
+Slab<Shard_sched> shard_sched_slab;
+static Slab<Shard> shard_slab;
+static Slab<Shard_node, 64, 16384> shard_node_slab;
+
+void *Shard::operator new(size_t sz)
+{
+	// MetadataShard objects are larger
+	if (sz != sizeof(Shard))
+		return ::operator new(sz);
+	return shard_slab.alloc();
+}
+
+void Shard::operator delete(void *p, size_t sz)
+{
+	if (sz != sizeof(Shard))
+		::operator delete(p);
+	else
+		shard_slab.free(p);
+}
+
+Slab_handle Shard::get_handle() const
+{
+	Assert(shard_type == STORAGE);
+	return shard_sched_slab.handle_of(sched);
+}
+
+/*
+  Signaled when a shard no longer schedulable is released, see retire().
+*/
+static pthread_mutex_t retire_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t retire_cond = PTHREAD_COND_INITIALIZER;
+
+static void release_sched(Shard_sched *ss)
+{
+	ss->assigned.store(false);
+	if (!ss->schedulable.load())
+	{
+		Scopped_mutex sm(retire_mtx);
+		pthread_cond_broadcast(&retire_cond);
+	}
+}
+
+/*
+  Claim the storage shard whose scheduling state has handle h. The state is
+  claimed before the shard is touched, so if the handle is still valid once
+  it's claimed, the shard can't be deleted until it's released.
+  @retval the shard if claimed, NULL if it's claimed by another thread, not
+  schedulable or deleted.
+*/
+Shard *Shard::claim(const Slab_handle &h)
+{
+	Shard_sched *ss = shard_sched_slab.get(h);
+	bool assigned = false;
+	if (!ss || !ss->assigned.compare_exchange_strong(assigned, true))
+		return NULL;
+
+	if (shard_sched_slab.get(h) != ss || !ss->schedulable.load())
+	{
+		release_sched(ss);
+		return NULL;
+	}
+	return ss->shard;
+}
+
+void Shard::release()
+{
+	release_sched(sched);
+}
+
+/*
+  Called without System::mtx after a storage shard is detached from its
+  cluster and before it's deleted, see System::delete_detached(). Stop
+  scheduling the shard, wait for the thread working on it to release it,
+  and keep it claimed so that no thread takes it until it's deleted.
+*/
+void Shard::retire()
+{
+	sched->schedulable.store(false);
+	Scopped_mutex sm(retire_mtx);
+	bool assigned = false;
+	while (!sched->assigned.compare_exchange_strong(assigned, true))
+	{
+		assigned = false;
+		pthread_cond_wait(&retire_cond, &retire_mtx);
+	}
+}
+
+void *Shard_node::operator new(size_t sz)
+{
+	Assert(sz == sizeof(Shard_node));
+	return shard_node_slab.alloc();
+}
+
+void Shard_node::operator delete(void *p)
+{
+	shard_node_slab.free(p);
+}
+
+/*
+  Versions of endpoints("ip:port") verified by MYSQL_CONN::verify_version(),
+  so that reconnecting to a verified endpoint skips the extra round trip.
+*/
+static std::map<std::string, std::string> verified_versions;
+static pthread_mutex_t verified_versions_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  Forget the verified version of an endpoint which failed to be connected
+  or is no longer a node's, the server there may be upgraded or replaced.
+*/
+static void forget_verified_version(const std::string &ip, int port)
+{
+	Scopped_mutex sm(verified_versions_mtx);
+	verified_versions.erase(ip + ":" + std::to_string(port));
+}
+
 #define IS_MYSQL_CLIENT_ERROR(err) (((err) >= CR_MIN_ERROR && (err) <= CR_MAX_ERROR) || ((err) >= CER_MIN_ERROR && (err) <= CER_MAX_ERROR))
 
 static void convert_preps2ti(Shard *ps, const Shard::Prep_recvrd_txns_t &preps,
@@ -47,10 +184,22 @@ static void process_prep_txns(const Shard::Txn_decision &txn_dsn,
 	std::map<Shard *, Shard::Txn_end_decisions_t>&shard_txn_decisions);
 
 
-int MYSQL_CONN::connect()
+/*
+  Connect to the node, if deadline_ms isn't 0 the connect timeout is cut
+  to the seconds left before it, but at least 1 second which is the
+  resolution of the client library.
+*/
+int MYSQL_CONN::connect(int64_t deadline_ms)
 {
 	if (connected) return 0;
 
+	unsigned int connect_timeout = mysql_connect_timeout;
+	int64_t remaining = deadline_remaining_ms(deadline_ms);
+	if (remaining <= 0)
+		return -1;
+	if (remaining < connect_timeout * 1000)
+		connect_timeout = std::max<int64_t>((remaining + 999) / 1000, 1);
+
     nrows_affected = 0;
     nwarnings = 0;
     result = NULL;
@@ -58,7 +207,7 @@ int MYSQL_CONN::connect()
 
     mysql_init(&conn);
     //mysql_options(mysql, MYSQL_OPT_NONBLOCK, 0); always do sync send
-    mysql_options(&conn, MYSQL_OPT_CONNECT_TIMEOUT, &mysql_connect_timeout);
+    mysql_options(&conn, MYSQL_OPT_CONNECT_TIMEOUT, &connect_timeout);
     mysql_options(&conn, MYSQL_OPT_READ_TIMEOUT, &mysql_read_timeout);
     mysql_options(&conn, MYSQL_OPT_WRITE_TIMEOUT, &mysql_write_timeout);
     mysql_options(&conn, MYSQL_OPT_MAX_ALLOWED_PACKET, &mysql_max_packet_size);
@@ -79,10 +228,13 @@ int MYSQL_CONN::connect()
     if (!ret)
     {
         handle_mysql_error();
+        forget_verified_version(ip, port);
         return -1;
     }
 
     connected = true; // check_mysql_instance_status() needs this set to true here.
+	last_used = time(NULL);
+	num_shard_conns++;
 
 	int vers;
 	if ((vers = verify_version()))
@@ -103,6 +255,13 @@ int MYSQL_CONN::connect()
 */
 int MYSQL_CONN::verify_version()
 {
+	std::string endpoint = ip + ":" + std::to_string(port);
+	{
+		Scopped_mutex sm(verified_versions_mtx);
+		if (verified_versions.find(endpoint) != verified_versions.end())
+			return 0;
+	}
+
 	if (send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN("select version()")))
 		return -1;
 
@@ -113,7 +272,11 @@ int MYSQL_CONN::verify_version()
     {
 		const char *verstr = row[0];
 		if (strcasestr(verstr, "kunlun-storage"))
+		{
+			Scopped_mutex sm(verified_versions_mtx);
+			verified_versions[endpoint] = verstr;
 			ret = 0;
+		}
 		else
 		{
 			syslog(Logger::ERROR, "Unsupported mysql version %s, must use kunlun-storage-8.0.x", verstr);
@@ -131,6 +294,33 @@ end:
 }
 
 
+/*
+  Connect if not connected, otherwise COM_PING the connection if it has been
+  idle for shard_conn_keepalive_interval seconds, and reconnect if broken.
+  A connect must be done by deadline_ms of monotonic_ms().
+  @retval 0 if the connection is usable.
+*/
+int MYSQL_CONN::keep_alive(int64_t deadline_ms)
+{
+	if (!connected)
+		return connect(deadline_ms);
+
+	// a result not freed yet means the connection is in use
+	if (result != NULL || time(NULL) - last_used < shard_conn_keepalive_interval)
+		return 0;
+
+	if (mysql_ping(&conn) == 0)
+	{
+		last_used = time(NULL);
+		return 0;
+	}
+
+	syslog(Logger::INFO, "Connection to node(%s:%d) broken: %s, reconnecting.",
+		   ip.c_str(), port, mysql_error(&conn));
+	close_conn();
+	return connect(deadline_ms);
+}
+
 void MYSQL_CONN::close_conn()
 {
 	if (!connected) return;
@@ -138,6 +328,7 @@ void MYSQL_CONN::close_conn()
     Assert(!result);
     mysql_close(&conn);
     connected = false;
+	num_shard_conns--;
 }
 
 TLS_VAR char errmsg_buf[512];
@@ -203,6 +394,27 @@ bool Shard_node::update_conn_params(const char * ip_, int port_, const char * us
 		mysql_conn.pwd = pwd_;
 	}
 
+	if (changed)
+	{
+		forget_verified_version(old_ip, old_port);
+		stats_conn.ip = ip_;
+		stats_conn.port = port_;
+		stats_conn.user = user_;
+		stats_conn.pwd = pwd_;
+
+		/*
+		  The failures were of the old address or credentials, the new
+		  ones deserve a try at once rather than after the probe backoff.
+		*/
+		if (breaker_open.exchange(false))
+			syslog(Logger::INFO, "Closed circuit breaker of shard (%s.%s %u) node (%u, %s:%d) whose connection parameters changed.",
+				   owner->get_cluster_name().c_str(), owner->get_name().c_str(),
+				   owner->get_id(), id, old_ip.c_str(), old_port);
+		nconnect_fails = 0;
+		probe_backoff_ms = 0;
+		next_probe_ms = 0;
+	}
+
 	if (changed && mysql_conn.connected)
 	{
 		syslog(Logger::INFO, "Connection parameters for shard (%s.%s %u) node (%u, %s:%d) changed to (%s:%d, %s, ***), reconnected with new params",
@@ -321,6 +533,7 @@ bool MYSQL_CONN::send_stmt(enum_sql_command sqlcom_, const char *stmt, size_t le
     nrows_affected = 0;
     nwarnings = 0;
     sqlcmd = sqlcom_;
+	last_used = time(NULL);
     int ret = mysql_real_query(&conn, stmt, len);
     if (ret != 0)
     {
@@ -405,30 +618,190 @@ bool MYSQL_CONN::send_stmt(enum_sql_command sqlcom_, const std::string &stmt)
 
 /*
   If send stmt fails because connection broken, reconnect and
-  retry sending the stmt. Retry mysql_stmt_conn_retries times.
+  retry sending the stmt. Retry mysql_stmt_conn_retries times, or until
+  deadline_ms if it's not 0, retries not finishable by then are not done.
   @retval true on error, false if successful.
 */
-bool Shard_node::
-send_stmt(enum_sql_command sqlcom_, const char *stmt, size_t len, int nretries)
+bool Shard_node::send_stmt(MYSQL_CONN &conn, enum_sql_command sqlcom_,
+	const char *stmt, size_t len, int nretries, int64_t deadline_ms)
 {
+	// known down, fail fast until the connection keeper finds it back
+	if (breaker_open.load())
+		return true;
+
 	bool ret = true;
 	for (int i = 0; i < nretries; i++)
 	{
-		if (!mysql_conn.connected) connect();
-		if (!mysql_conn.send_stmt(sqlcom_, stmt, len))
+		if (deadline_remaining_ms(deadline_ms) <= 0)
+		{
+			syslog(Logger::WARNING, "Shard(%s.%s, %u) node(%s:%d, %u) stmt not done by deadline after %d tries.",
+				   owner->get_cluster_name().c_str(), owner->get_name().c_str(),
+				   owner->get_id(), conn.ip.c_str(), conn.port, id, i);
+			break;
+		}
+
+		if (!conn.connected)
+		{
+			if (conn.connect(deadline_ms))
+			{
+				connect_failed();
+				if (breaker_open.load())
+					return true;
+			}
+			else
+				nconnect_fails = 0;
+		}
+		if (!conn.send_stmt(sqlcom_, stmt, len))
 		{
 			ret = false;
 			break;
 		}
 
-		if (Thread_manager::do_exit)
+		if (Thread_manager::do_exit || i + 1 == nretries)
 			return ret;
 
+		// no use to wait if the retry can't start before the deadline
+		if (deadline_remaining_ms(deadline_ms) <= stmt_retry_interval_ms)
+			break;
 		usleep(stmt_retry_interval_ms * 1000);
 	}
 	return ret;
 }
 
+/*
+  Count a failure to connect, and open the breaker if there have been
+  node_breaker_threshold consecutive ones.
+*/
+void Shard_node::connect_failed()
+{
+	if (++nconnect_fails < node_breaker_threshold || breaker_open.exchange(true))
+		return;
+
+	probe_backoff_ms = node_probe_min_backoff_ms;
+	next_probe_ms = monotonic_ms() + node_probe_min_backoff_ms;
+	syslog(Logger::WARNING, "Shard(%s.%s, %u) node(%s:%d, %u) failed to connect %d times, it's known down until a probe succeeds.",
+		   owner->get_cluster_name().c_str(), owner->get_name().c_str(),
+		   owner->get_id(), mysql_conn.ip.c_str(), mysql_conn.port, id,
+		   nconnect_fails.load());
+}
+
+/*
+  Probe a known down node if its backoff has passed: close the breaker if it
+  can be connected, otherwise double the backoff up to
+  node_probe_max_backoff_ms, plus a random jitter of up to half of it so that
+  probes to nodes which went down together spread out.
+  Called by the connection keeper with the shard's mtx held, the probe must
+  be done by deadline_ms of monotonic_ms().
+*/
+void Shard_node::probe_down_node(int64_t deadline_ms)
+{
+	int64_t now = monotonic_ms();
+	if (now < next_probe_ms || now >= deadline_ms)
+		return;
+
+	if (mysql_conn.connected)
+		mysql_conn.close_conn();
+
+	if (mysql_conn.connect(deadline_ms) == 0)
+	{
+		nconnect_fails = 0;
+		breaker_open = false;
+		syslog(Logger::INFO, "Shard(%s.%s, %u) node(%s:%d, %u) is connected again.",
+			   owner->get_cluster_name().c_str(), owner->get_name().c_str(),
+			   owner->get_id(), mysql_conn.ip.c_str(), mysql_conn.port, id);
+		return;
+	}
+
+	int64_t backoff = std::min(probe_backoff_ms.load() * 2, node_probe_max_backoff_ms);
+	probe_backoff_ms = backoff;
+	next_probe_ms = monotonic_ms() + backoff + random() % (backoff / 2 + 1);
+}
+
+/*
+  Close connections idle for shard_conn_idle_timeout seconds, keep the
+  others alive. Connect mysql_conn ahead of use if it was broken while in
+  use recently, or if it was never connected and fewer than max_shard_conns
+  connections are open. Called with the shard's mtx held, connects not done
+  by deadline_ms of monotonic_ms() are left to the next call.
+*/
+void Shard_node::keep_conns(int64_t deadline_ms)
+{
+	if (breaker_open.load())
+	{
+		probe_down_node(deadline_ms);
+		return;
+	}
+
+	time_t now = time(NULL);
+	MYSQL_CONN *conns[] = {&mysql_conn, &stats_conn};
+
+	for (auto conn:conns)
+	{
+		if (!conn->connected)
+			continue;
+
+		if (shard_conn_idle_timeout > 0 && conn->result == NULL &&
+			now - conn->last_used >= shard_conn_idle_timeout)
+		{
+			syslog(Logger::LOG, "Closing idle connection to shard(%s.%s, %u) node(%s:%d, %u).",
+				   owner->get_cluster_name().c_str(), owner->get_name().c_str(),
+				   owner->get_id(), conn->ip.c_str(), conn->port, id);
+			conn->close_conn();
+			continue;
+		}
+
+		if (monotonic_ms() >= deadline_ms)
+			break;
+		conn->keep_alive(deadline_ms);
+	}
+
+	if (mysql_conn.connected || monotonic_ms() >= deadline_ms)
+		return;
+
+	if (mysql_conn.last_used == 0 ?
+			(max_shard_conns == 0 || num_shard_conns < max_shard_conns) :
+			(shard_conn_idle_timeout == 0 || now - mysql_conn.last_used < shard_conn_idle_timeout))
+	{
+		if (mysql_conn.connect(deadline_ms))
+			connect_failed();
+		else
+			nconnect_fails = 0;
+	}
+}
+
+/*
+  Append the open connections not in use, called with the shard's mtx held.
+*/
+void Shard_node::get_open_conns(std::vector<Shard_conn_ref> &conns)
+{
+	if (mysql_conn.connected && mysql_conn.result == NULL)
+		conns.emplace_back(Shard_conn_ref{mysql_conn.last_used, owner, this, false});
+	if (stats_conn.connected && stats_conn.result == NULL)
+		conns.emplace_back(Shard_conn_ref{stats_conn.last_used, owner, this, true});
+}
+
+/*
+  Close a connection if it's not used since get_open_conns() returned it,
+  called with the shard's mtx held.
+  @retval true if closed.
+*/
+bool Shard_node::close_idle_conn(bool stats, time_t last_used)
+{
+	MYSQL_CONN &conn = stats ? stats_conn : mysql_conn;
+	if (!conn.connected || conn.result != NULL || conn.last_used != last_used)
+		return false;
+
+	conn.close_conn();
+	return true;
+}
+
+bool Shard_node::
+send_stmt(enum_sql_command sqlcom_, const char *stmt, size_t len,
+	int nretries, int64_t deadline_ms)
+{
+	return send_stmt(mysql_conn, sqlcom_, stmt, len, nretries, deadline_ms);
+}
+
 
 bool Shard_node::
 send_stmt(enum_sql_command sqlcom_, const std::string &stmt, int nretries)
@@ -436,6 +809,23 @@ send_stmt(enum_sql_command sqlcom_, const std::string &stmt, int nretries)
 	return send_stmt(sqlcom_, stmt.c_str(), stmt.length(), nretries);
 }
 
+/*
+  Same as send_stmt() but done via stats_conn, only to be called by the
+  storage sync thread, and the shard's mtx needs not be held unless
+  share_shard_conns is set.
+*/
+bool Shard_node::
+send_stats_stmt(enum_sql_command sqlcom_, const char *stmt, size_t len, int nretries)
+{
+	return send_stmt(get_stats_conn(), sqlcom_, stmt, len, nretries);
+}
+
+bool Shard_node::
+send_stats_stmt(enum_sql_command sqlcom_, const std::string &stmt, int nretries)
+{
+	return send_stats_stmt(sqlcom_, stmt.c_str(), stmt.length(), nretries);
+}
+
 
 int Shard_node::connect()
 {
@@ -553,39 +943,35 @@ int Shard_node::start_mgr(Group_member_status curstat, bool as_master)
 
 
 /*
-  Fetch from the shard node the latest executed gtid of the
-  group_replication_applier channel, to be used to decide which node to start
-  as master node. Only to be called when no nodes of the MGR cluster is in
-  MEMBER_ONLINE state, because:
-  1. otherwise the progress keeps changing and can't be cached in the
-  	 cluster_manager for further decisions
-  2. only in this case do we really need the positions.
-  @retval true on error; false on success
+  Fetch the node's whole set of executed GTIDs, one row to read, it's
+  compared precisely with other nodes' to elect the most advanced one.
+  @retval true on error.
 */
 bool Shard_node::fetch_mgr_progress()
 {
 	bool ret = send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
-        "select interval_end from mysql.gtid_executed where source_uuid=@@group_replication_group_name"), stmt_retries);
+        "select @@global.gtid_executed"),
+		stmt_retries, monotonic_ms() + health_check_timeout_ms);
     if (ret)
         return ret;
 
     MYSQL_RES *result = get_result();
-    MYSQL_ROW row;
-	uint64_t nrows = mysql_num_rows(result);
-	int i = 0;
-	char *endptr = NULL;
+    Mysql_row row;
 
-    while ((row = mysql_fetch_row(result)))
-    {
-		if (i++ < nrows - 1)
-			continue;
-		// Only want the last row which contains the latest executed gtid
-		// of the group_replication_applier channel.
-		latest_mgr_pos = strtoull(row[0], &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');
+    if (row.fetch(result) && gtid_executed.parse(row.str(0)))
+		latest_mgr_pos = gtid_executed.count();
+	else
+	{
+		syslog(Logger::ERROR,
+			   "Invalid gtid_executed returned from shard (%s.%s, %u) node(%u, %s:%d)",
+			   owner->get_cluster_name().c_str(), owner->get_name().c_str(),
+			   owner->get_id(), this->id, mysql_conn.ip.c_str(), mysql_conn.port);
+		ret = true;
 	}
-end:
 	free_mysql_result();
+	if (ret)
+		return ret;
+
 	syslog(Logger::LOG,
 		   "Found shard (%s.%s, %u) node(%u, %s:%d) latest MGR position: %llu",
 		   owner->get_cluster_name().c_str(), owner->get_name().c_str(),
@@ -594,6 +980,88 @@ end:
 	return false;
 }
 
+void Mgr_lag_series::add(const Mgr_lag_sample &sample)
+{
+	Scopped_mutex sm(mtx);
+	if (ring.empty())
+		ring.resize(mgr_lag_history);
+	ring[next] = sample;
+	next = (next + 1) % ring.size();
+	if (count < ring.size())
+		count++;
+}
+
+void Mgr_lag_series::get(std::vector<Mgr_lag_sample> &samples) const
+{
+	Scopped_mutex sm(mtx);
+	samples.clear();
+	samples.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		samples.emplace_back(ring[(next + ring.size() - count + i) % ring.size()]);
+}
+
+double Mgr_lag_series::mean_lag() const
+{
+	Scopped_mutex sm(mtx);
+	if (count == 0)
+		return 0;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < count; i++)
+		sum += ring[(next + ring.size() - count + i) % ring.size()].lag;
+	return (double)sum / count;
+}
+
+/*
+  Sample the node's MGR replication lag: the transactions its
+  group_replication_applier channel received but not yet applied, and
+  its applier queue length, in one round trip.
+  @retval true on error.
+*/
+bool Shard_node::sample_mgr_lag()
+{
+	bool ret = send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
+		"select @@global.gtid_executed, "
+		"(select RECEIVED_TRANSACTION_SET from performance_schema.replication_connection_status where CHANNEL_NAME='group_replication_applier'), "
+		"(select COUNT_TRANSACTIONS_REMOTE_IN_APPLIER_QUEUE from performance_schema.replication_group_member_stats where MEMBER_ID=@@server_uuid)"),
+		stmt_retries, monotonic_ms() + health_check_timeout_ms);
+	if (ret)
+		return ret;
+
+	MYSQL_RES *result = get_result();
+	Mysql_row row;
+	Gtid_set executed, received;
+	Mgr_lag_sample sample;
+
+	if (row.fetch(result) && executed.parse(row.str(0)) &&
+		(row.is_null(1) || received.parse(row.str(1))))
+	{
+		sample.time = time(NULL);
+		sample.applied = executed.count();
+		sample.received = received.count();
+		sample.lag = received.count_not_in(executed);
+		sample.apply_queue = row.get_or<uint64_t>(2, 0);
+	}
+	else
+	{
+		syslog(Logger::ERROR,
+			   "Invalid MGR progress returned from shard (%s.%s, %u) node(%u, %s:%d)",
+			   owner->get_cluster_name().c_str(), owner->get_name().c_str(),
+			   owner->get_id(), this->id, mysql_conn.ip.c_str(), mysql_conn.port);
+		ret = true;
+	}
+	free_mysql_result();
+	if (ret)
+		return ret;
+
+	lag_series.add(sample);
+	syslog(Logger::DEBUG1,
+		   "Shard (%s.%s, %u) node(%u, %s:%d) MGR lag: %llu txns, applier queue: %llu",
+		   owner->get_cluster_name().c_str(), owner->get_name().c_str(),
+		   owner->get_id(), this->id, mysql_conn.ip.c_str(), mysql_conn.port,
+		   (unsigned long long)sample.lag, (unsigned long long)sample.apply_queue);
+	return false;
+}
+
 /*
   @retval -1: connection broken or stmt exec error;
   		-2: multiple or no primary nodes found
@@ -601,13 +1069,13 @@ end:
 int Shard_node::get_mgr_master_ip_port(std::string&ip, int&port)
 {
 	int ret = send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
-		"select MEMBER_HOST, MEMBER_PORT from performance_schema.replication_group_members where MEMBER_ROLE = 'PRIMARY' and MEMBER_STATE = 'ONLINE'"), stmt_retries);
+		"select MEMBER_HOST, MEMBER_PORT from performance_schema.replication_group_members where MEMBER_ROLE = 'PRIMARY' and MEMBER_STATE = 'ONLINE'"),
+		stmt_retries, monotonic_ms() + health_check_timeout_ms);
 	if (ret)
 		return -1;
 
-	char *endptr = NULL;
     MYSQL_RES *result = get_result();
-    MYSQL_ROW row;
+    Mysql_row row;
 	uint64_t nrows = mysql_num_rows(result);
 	if (nrows != 1)
 	{
@@ -622,11 +1090,17 @@ int Shard_node::get_mgr_master_ip_port(std::string&ip, int&port)
 	
 	ret = 0;
 
-    while ((row = mysql_fetch_row(result)))
+    while (row.fetch(result))
     {
-		ip = row[0];
-		port = strtol(row[1], &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');
+		ip = row.str(0);
+		if (!row.get(1, port))
+		{
+			syslog(Logger::ERROR,
+				"Invalid primary node port (%s) found in shard (%s.%s, %u) node(%u, %s:%d).",
+			   row.c_str(1), owner->get_cluster_name().c_str(), owner->get_name().c_str(),
+			   owner->get_id(), this->id, mysql_conn.ip.c_str(), mysql_conn.port);
+			ret = -2;
+		}
 	}
 end:
 	free_mysql_result();
@@ -639,74 +1113,68 @@ end:
   @retval -1: communication error; -2: node not initialized with MGR
   -3: invalid GR status returned from node;
   -4: unrecognized node status returned from node.
-  -5: MGR cluster doesn't have this node itself, it returned a bunch of other nodes.
-  -6: invalid row field values in returned results.
+  -5: MGR cluster doesn't have this node itself, it returned a bunch of other
+  nodes, rows of invalid field values are logged and skipped.
   positive: Group_member_status enums;
 */
 int Shard_node::check_mgr_state()
 {
 	const char *the_stmt = NULL;
 	int ret = send_stmt(SQLCOM_SELECT, the_stmt =
-		CONST_STR_PTR_LEN("select MEMBER_HOST, MEMBER_PORT, MEMBER_STATE, MEMBER_ROLE from performance_schema.replication_group_members"), stmt_retries);
+		CONST_STR_PTR_LEN("select MEMBER_HOST, MEMBER_PORT, MEMBER_STATE, MEMBER_ROLE from performance_schema.replication_group_members"),
+		stmt_retries, monotonic_ms() + health_check_timeout_ms);
     if (ret)
         return -1;
 	ret = 0;
     MYSQL_RES *result = get_result();
-    MYSQL_ROW row;
+    Mysql_row row;
 	uint64_t nrows = mysql_num_rows(result), n_myrows = 0;
 	std::string node_stat;
-	char *endptr = NULL;
 	int port1 = 0;
 
-    while ((row = mysql_fetch_row(result)))
+    while (row.fetch(result))
     {
-		if (row[0][0] == '\0' && row[1] == NULL && row[3][0] == '\0' && nrows == 1)
-		{
-			Assert(strcmp(row[2], "OFFLINE") == 0 || strcmp(row[2], "ERROR") == 0);
+		// a node out of the group returns only itself with empty host&role.
+		if (row.str(0).empty() && row.is_null(1) && row.str(3).empty() && nrows == 1 &&
+			(row.str(2) == "OFFLINE" || row.str(2) == "ERROR"))
 			goto got_my_row;
-		}
-		if (row[1] == NULL)
+
+		// all fields of the row must have valid values, MEMBER_ROLE could be
+		// "" when state is OFFLINE.
+		if (row.str(0).empty() || !row.get(1, port1) || row.str(2).empty())
 		{
 			syslog(Logger::ERROR,
-			"Invalid SQL query (%s) result(%lu rows) returned from shard(%s.%s, %u) node(%s:%d, %u): (%s, NULL, %s, %s)",
+			"Invalid SQL query (%s) result(%lu rows) returned from shard(%s.%s, %u) node(%s:%d, %u) skipped: (%s, %s, %s, %s)",
 				the_stmt, nrows, owner->get_cluster_name().c_str(),
 				owner->get_name().c_str(),
 				owner->get_id(), mysql_conn.ip.c_str(), mysql_conn.port,
-				this->id, row[0], row[2], row[3]);
-			ret = -6;
-			goto end;
+				this->id, std::string(row.str(0)).c_str(), std::string(row.str(1)).c_str(),
+				std::string(row.str(2)).c_str(), std::string(row.str(3)).c_str());
+			continue;
 		}
 
-		// all fields of the row must now have valid values.
-		Assert(row[0][0] && row[1] && row[2][0]); // && row[3][0]); could be "" when state is OFFLINE.
-
-		port1 = strtol(row[1], &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');
-		if (strcmp(mysql_conn.ip.c_str(), row[0]) || mysql_conn.port != port1)
+		if (mysql_conn.ip != row.str(0) || mysql_conn.port != port1)
 			continue;
 got_my_row:
 		n_myrows++;
-		node_stat = row[2];
-		if (strcmp(row[3], "PRIMARY") == 0 && owner->set_master(this))
+		node_stat = std::string(row.str(2));
+		if (row.str(3) == "PRIMARY" && owner->set_master(this))
 		{
 			syslog(Logger::INFO,
 		   		"Found primary node of shard(%s.%s, %u) changed to (%s:%d, %u)",
 		   		owner->get_cluster_name().c_str(), owner->get_name().c_str(),
-		   		owner->get_id(), row[0], port1, get_id());
+		   		owner->get_id(), mysql_conn.ip.c_str(), port1, get_id());
 
 		}
 
 		for (int i = 0; i < sizeof(Group_member_status_strs)/sizeof(char*); i++)
-			if (strcmp(row[2], Group_member_status_strs[i]) == 0)
+			if (node_stat == Group_member_status_strs[i])
 			{
 				ret = i + 1; // ONLINE is set to 1.
 				break;
 			}
 	}
-end:
 	free_mysql_result();
-	if (ret == -6)
-		return ret;
 
 	if (nrows == 0)
 	{
@@ -757,6 +1225,264 @@ end:
 
 const char *Shard_node::Group_member_status_strs[] = {"ONLINE", "OFFLINE", "RECOVERING", "ERROR", "UNREACHABLE", "INVALID"};
 
+/*
+  Set the node being started as primary, 0 if none. It's saved to the
+  metadata shard at once, so that a restarted instance or the one taking
+  over the cluster starts the same node, otherwise a brainsplit could be
+  caused.
+*/
+void Shard::set_pending_master(uint node_id)
+{
+	pending_master_node_id = node_id;
+	if (System::get_instance()->get_MetadataShard()->save_pending_master(get_id(), node_id))
+		syslog(Logger::ERROR, "Failed to save pending primary node %u of shard (%s.%s, %u) to metadata shard.",
+			   node_id, get_cluster_name().c_str(), get_name().c_str(), get_id());
+}
+
+/*
+  Restore the pending primary node saved by the previous cluster_mgr
+  instance working on the shard, when this instance takes it over.
+*/
+void Shard::restore_pending_master(uint node_id)
+{
+	Scopped_mutex sm(mtx);
+	if (node_id != 0 && get_node_by_id(node_id) == NULL)
+		return;
+	pending_master_node_id = node_id;
+	syslog(Logger::INFO, "Restored pending primary node %u of shard (%s.%s, %u).",
+		   node_id, get_cluster_name().c_str(), get_name().c_str(), get_id());
+}
+
+/*
+  Fast path of check_mgr_cluster(): read the MGR group view from one
+  reachable node, the known primary first. Every member's state and role
+  is in any ONLINE member's view, so if it shows all nodes of the shard
+  ONLINE with a single PRIMARY, nothing needs to be done and only one stmt
+  is sent for the shard instead of one per node.
+  @retval true if the group is healthy, and the primary in the view is set
+  as master; false if per-node checks are needed.
+*/
+bool Shard::check_mgr_group_view()
+{
+	std::vector<Shard_node *> probes;
+	if (cur_master)
+		probes.emplace_back(cur_master);
+	for (auto &n:nodes)
+		if (n != cur_master)
+			probes.emplace_back(n);
+
+	for (auto &sn:probes)
+	{
+		if (Thread_manager::do_exit)
+			return false;
+		if (sn->is_known_down())
+			continue;
+
+		if (sn->send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
+				"select MEMBER_HOST, MEMBER_PORT, MEMBER_STATE, MEMBER_ROLE from performance_schema.replication_group_members"),
+				1, monotonic_ms() + health_check_timeout_ms))
+			continue; // try next node
+
+		MYSQL_RES *result = sn->get_result();
+		Mysql_row row;
+		Shard_node *primary = NULL;
+		std::set<Shard_node *> online_nodes;
+		int nprimaries = 0;
+		bool healthy = (mysql_num_rows(result) == nodes.size());
+
+		while (healthy && row.fetch(result))
+		{
+			int port = 0;
+			Shard_node *member = NULL;
+			if (!row.get(1, port) ||
+				(member = get_node_by_ip_port(std::string(row.str(0)), port)) == NULL ||
+				row.str(2) != "ONLINE")
+			{
+				healthy = false;
+				break;
+			}
+
+			online_nodes.insert(member);
+			if (row.str(3) == "PRIMARY")
+			{
+				primary = member;
+				nprimaries++;
+			}
+		}
+		sn->free_mysql_result();
+
+		if (!healthy || nprimaries != 1 || online_nodes.size() != nodes.size())
+		{
+			syslog(Logger::LOG, "MGR group view of shard(%s.%s, %u) from node(%u) isn't fully ONLINE with a single primary, checking every node.",
+				   get_cluster_name().c_str(), get_name().c_str(), get_id(), sn->get_id());
+			return false;
+		}
+
+		if (set_master(primary))
+		{
+			std::string ip;
+			int port = 0;
+			primary->get_ip_port(ip, port);
+			syslog(Logger::INFO,
+		   		"Found primary node of shard(%s.%s, %u) changed to (%s:%d, %u)",
+		   		get_cluster_name().c_str(), get_name().c_str(),
+		   		get_id(), ip.c_str(), port, primary->get_id());
+		}
+		clear_pending_master();
+		return true;
+	}
+
+	return false;
+}
+
+/*
+  Forget the pending primary and the errors its start ignores once the
+  group is found healthy, e.g. it recovered by itself, so that a stale
+  pending primary isn't started in a later outage.
+*/
+void Shard::clear_pending_master()
+{
+	if (pending_master_node_id == 0)
+		return;
+
+	Shard_node *n = get_node_by_id(pending_master_node_id);
+	if (n)
+		n->clear_ignore_errors();
+	syslog(Logger::INFO, "Cleared pending primary node %u of shard (%s.%s, %u) whose MGR group is healthy.",
+		   pending_master_node_id, get_cluster_name().c_str(), get_name().c_str(), get_id());
+	set_pending_master(0);
+}
+
+/*
+  Sort cands by their gtid_executed fetched by fetch_mgr_progress(), most
+  advanced first. A node whose GTID set is a proper superset of another's
+  has more transactions, so sorting by NO. of transactions orders them by
+  the set inclusion; nodes of equal progress are ordered by their mean
+  MGR lag, the one applying its relay log faster first, and then kept in
+  the order of candidate_rank, which is refreshed to the new order.
+  @retval true if the first node has all transactions of the rest;
+  false if the GTID sets diverged and no node has all transactions.
+*/
+bool Shard::rank_candidates(std::vector<Shard_node *> &cands)
+{
+	auto rank_of = [this](Shard_node *n)
+	{
+		auto itr = std::find(candidate_rank.begin(), candidate_rank.end(), n->get_id());
+		return itr - candidate_rank.begin();
+	};
+
+	std::stable_sort(cands.begin(), cands.end(),
+		[&rank_of](Shard_node *a, Shard_node *b)
+		{
+			if (a->get_latest_mgr_pos() != b->get_latest_mgr_pos())
+				return a->get_latest_mgr_pos() > b->get_latest_mgr_pos();
+			double lag_a = a->get_lag_series().mean_lag();
+			double lag_b = b->get_lag_series().mean_lag();
+			if (lag_a != lag_b)
+				return lag_a < lag_b;
+			return rank_of(a) < rank_of(b);
+		});
+
+	candidate_rank.clear();
+	for (auto &n:cands)
+		candidate_rank.emplace_back(n->get_id());
+	candidate_rank_time = time(NULL);
+
+	for (size_t i = 1; i < cands.size(); i++)
+		if (!cands[0]->get_gtid_executed().contains(cands[i]->get_gtid_executed()))
+			return false;
+	return true;
+}
+
+/*
+  While the MGR group is degraded but running, refresh every
+  mgr_progress_refresh_interval seconds the progress of reachable nodes and
+  rank them, so that if the rest go down too the best candidate is known,
+  see pick_ranked_candidate(). A healthy group isn't ranked, its check
+  sends one stmt per shard.
+*/
+void Shard::refresh_candidate_rank()
+{
+	if (time(NULL) - candidate_rank_time < mgr_progress_refresh_interval)
+		return;
+
+	std::vector<Shard_node *> cands;
+	for (auto &n:nodes)
+	{
+		if (Thread_manager::do_exit)
+			return;
+		if (!n->is_known_down() && !n->fetch_mgr_progress())
+			cands.emplace_back(n);
+	}
+
+	if (!rank_candidates(cands))
+		syslog(Logger::WARNING, "Shard (%s.%s, %u) nodes have diverged GTID sets, none of them has all transactions of the rest.",
+			   get_cluster_name().c_str(), get_name().c_str(), get_id());
+	else if (!cands.empty())
+		syslog(Logger::LOG, "Shard (%s.%s, %u) node(%u) is the most advanced of %lu nodes with %lu transactions.",
+			   get_cluster_name().c_str(), get_name().c_str(), get_id(),
+			   cands[0]->get_id(), cands.size(), cands[0]->get_latest_mgr_pos());
+}
+
+/*
+  At an outage of all nodes, pick the node ranked first by candidate_rank
+  among down_reachables and fetch the GTID set of it only. The ranking is
+  used only if it's refreshed in last two mgr_progress_refresh_interval
+  periods and covers all down_reachables, and the candidate's set must have all
+  transactions of the others' sets as of the ranking.
+  @retval the candidate, NULL if the ranking can't be used and all nodes
+  must be fetched and ranked.
+*/
+Shard_node *Shard::pick_ranked_candidate(const std::vector<std::pair<Shard_node *,
+	Shard_node::Group_member_status> > &down_reachables)
+{
+	if (candidate_rank.empty() ||
+		time(NULL) - candidate_rank_time > 2 * mgr_progress_refresh_interval)
+		return NULL;
+
+	Shard_node *cand = NULL;
+	size_t cand_rank = candidate_rank.size();
+	for (auto &n:down_reachables)
+	{
+		auto itr = std::find(candidate_rank.begin(), candidate_rank.end(), n.first->get_id());
+		if (itr == candidate_rank.end())
+			return NULL;
+		if ((size_t)(itr - candidate_rank.begin()) < cand_rank)
+		{
+			cand_rank = itr - candidate_rank.begin();
+			cand = n.first;
+		}
+	}
+
+	if (!cand || cand->fetch_mgr_progress())
+		return NULL;
+
+	for (auto &n:down_reachables)
+		if (!cand->get_gtid_executed().contains(n.first->get_gtid_executed()))
+			return NULL;
+	return cand;
+}
+
+/*
+  While the MGR cluster is healthy, sample every mgr_lag_sample_interval
+  seconds reachable nodes' replication lag into their lag series.
+*/
+void Shard::sample_mgr_lag()
+{
+	if (mgr_lag_sample_interval == 0 ||
+		time(NULL) - lag_sample_time < mgr_lag_sample_interval)
+		return;
+
+	for (auto &n:nodes)
+	{
+		if (Thread_manager::do_exit)
+			return;
+		if (!n->is_known_down())
+			n->sample_mgr_lag();
+	}
+	lag_sample_time = time(NULL);
+}
+
 /*
   If all nodes connect with no other nodes, the cluster is down altogether.
   Choose the one with latest changes as master and start it first, then
@@ -781,6 +1507,12 @@ const char *Shard_node::Group_member_status_strs[] = {"ONLINE", "OFFLINE", "RECO
 int Shard::check_mgr_cluster()
 {
 	Scopped_mutex sm(mtx);
+	if (check_mgr_group_view())
+	{
+		sample_mgr_lag();
+		return 0;
+	}
+
 	std::vector<std::pair<Shard_node*, Shard_node::Group_member_status> >
 		down_reachables;
 
@@ -814,12 +1546,19 @@ int Shard::check_mgr_cluster()
 			unreachables.insert(i);
 	}
 
-	if (likely(nodes_down == 0)) return 0; // most common case, we trust MGR will not brainsplit.
+	if (likely(nodes_down == 0)) // most common case, we trust MGR will not brainsplit.
+	{
+		clear_pending_master();
+		sample_mgr_lag();
+		refresh_candidate_rank();
+		return 0;
+	}
 
 	if (nodes_down < nodes.size())
 	{
 		// Some nodes in the MGR cluster are running, one of them must be a
 		// master node, no need to choose a master for the cluster.
+		refresh_candidate_rank();
 		for (auto i=down_reachables.begin(); i != down_reachables.end(); ++i)
 		{
 			if (Thread_manager::do_exit)
@@ -843,6 +1582,7 @@ int Shard::check_mgr_cluster()
 			uint64_t max_pos = 0;
 			Shard_node*max_sn = NULL;
 			Shard_node::Group_member_status max_stat = Shard_node::MEMBER_END;
+			std::vector<Shard_node *> cands;
 			std::string top_ip;
 			int top_port;
 
@@ -854,39 +1594,39 @@ int Shard::check_mgr_cluster()
 
 			// find the node with most binlogs and start it as master first, then
 			// start up the rest down&reachable nodes, i.e. those in down_reachables.
-			for (auto itr = down_reachables.begin();
-				 itr != down_reachables.end(); ++itr)
+			if ((max_sn = pick_ranked_candidate(down_reachables)) != NULL)
+			{
+				cands.emplace_back(max_sn);
+				syslog(Logger::INFO, "Shard (%s.%s, %u) node(%u) ranked first while the group was degraded is chosen as primary candidate.",
+					   get_cluster_name().c_str(), get_name().c_str(), get_id(), max_sn->get_id());
+			}
+			for (auto itr = down_reachables.begin(); !max_sn && itr != down_reachables.end(); )
 			{
 				if (Thread_manager::do_exit)
 					break;
 				if (itr->first->fetch_mgr_progress())
 				{
-					auto jtr = itr;
-					down_reachables.erase(jtr);
+					itr = down_reachables.erase(itr);
 					reachables--;
 				}
+				else
+					cands.emplace_back((itr++)->first);
 			}
 
-			if (reachables <= nodes.size() / 2)
+			if (reachables <= nodes.size() / 2 || cands.empty())
 				goto out1;
 
-			if(down_reachables.size()>0)	//maybe first node is primary
-			{
-				max_sn = down_reachables[0].first;
-				max_stat = down_reachables[0].second;
-			}
-
+			if (cands.size() > 1 && !rank_candidates(cands))
+				syslog(Logger::ERROR, "Shard (%s.%s, %u) node(%u) chosen as primary doesn't have all transactions of other nodes, they will be lost.",
+					   get_cluster_name().c_str(), get_name().c_str(),
+					   get_id(), cands[0]->get_id());
+			max_sn = cands[0];
+			max_pos = max_sn->get_latest_mgr_pos();
 			for (auto &n:down_reachables)
-				if (n.first->get_latest_mgr_pos() > max_pos)
-				{
-					max_pos = n.first->get_latest_mgr_pos();
-					max_sn = n.first;
+				if (n.first == max_sn)
 					max_stat = n.second;
-				}
 
-			Assert((max_sn != NULL && max_pos > 0 && max_stat != Shard_node::MEMBER_END) ||
-				   (max_sn == NULL && max_pos == 0 && max_stat == Shard_node::MEMBER_END));
-			if (!max_sn) goto out1; // it's likely that MGR isn't activated in the cluster.
+			Assert(max_stat != Shard_node::MEMBER_END);
 
 			max_sn->get_ip_port(top_ip, top_port);
 			// max_sn found, start it as master, start the rest as slaves.
@@ -911,13 +1651,13 @@ got_new_master:
 				// this error code isn't in mariadb's client header, so no macro for it.
 				max_sn->add_ignore_error(3093);
 
-				this->pending_master_node_id = max_sn->get_id();
+				set_pending_master(max_sn->get_id());
 				return -6;
 			}
 
 			if (this->pending_master_node_id != 0)
 			{
-				this->pending_master_node_id = 0;
+				set_pending_master(0);
 				max_sn->clear_ignore_errors();
 			}
 
@@ -1145,18 +1885,20 @@ compute_txn_decisions(std::map<uint, cluster_txninfo> &cluster_txns)
 
 		time_t now = time(NULL);
 		MYSQL_RES *result = cur_master->get_result();
-		MYSQL_ROW row;
-		char *endptr = NULL;
+		Mysql_row row;
 		auto tk_itr = clstr.second.tkis.begin();
-		while ((row = mysql_fetch_row(result)))
+		while (row.fetch(result))
 		{
-			uint64_t trxid = strtoull(row[0], &endptr, 10);
-			Assert(endptr == NULL || *endptr == '\0');
+			uint64_t trxid = 0;
 			Txn_key ti;
+			if (!row.get(0, trxid) || !row.get(1, ti.comp_nodeid))
+			{
+				syslog(Logger::ERROR, "Invalid commit log row (%s, %s) of cluster %s skipped.",
+					   row.c_str(0), row.c_str(1), clstr.second.cname.c_str());
+				continue;
+			}
 			ti.start_ts = (trxid >> 32);
 			ti.local_txnid = (trxid & 0xffffffff);
-			ti.comp_nodeid = strtoul(row[1], &endptr, 10);
-			Assert(endptr == NULL || *endptr == '\0');
 
 			/*
 			  The SQL query result is in Txn_key increasing order (for free),
@@ -1180,19 +1922,18 @@ compute_txn_decisions(std::map<uint, cluster_txninfo> &cluster_txns)
 			Assert(tk_itr->first == ti);
 
 			Txn_decision_enum txndcs = TXN_DECISION_NONE;
-			if (strcasecmp(row[2], "commit") == 0)
+			if (strcasecmp(row.c_str(2), "commit") == 0)
 			{
 				txndcs = COMMIT;
 			}
-			else if (strcasecmp(row[2], "abort") == 0)
+			else if (strcasecmp(row.c_str(2), "abort") == 0)
 			{
 				txndcs = ABORT;
 			}
 			else
 				Assert(false);
 
-			time_t prepts = strtol(row[3], &endptr, 10);
-			Assert(endptr == NULL || *endptr == '\0');
+			time_t prepts = row.get_or(3, (time_t)0);
 
 			Txn_decision txn_dsn(ti, txndcs, prepts);
 			process_prep_txns(txn_dsn, tk_itr->second, shard_txn_decisions);
@@ -1334,45 +2075,21 @@ int Shard::get_xa_prepared()
 	if (ret)
 		return ret;
 	MYSQL_RES *result = cur_master->get_result();
-	MYSQL_ROW row;
-	char *endptr = NULL;
+	Mysql_row row;
 	
-	while ((row = mysql_fetch_row(result)))
+	while (row.fetch(result))
 	{
-		unsigned long *lengths = mysql_fetch_lengths(result);
-		Assert(row[0][0] == '\'' && row[0][lengths[0] - 1] == '\'');
-		char *xaks = row[0] + 1; // format e.g.: '1-1598596846-967098'
-		char *sp1 = strchr(xaks, '-');
-		char *sp2 = NULL;
-		char *sp3 = NULL;
-		if (sp1) sp2 = strchr(sp1 + 1, '-');
-		if (sp2) sp3 = strchr(sp2 + 1, '-'); // sp3 should be NULL
-
-		if (!(row[0][0] == '\'' && row[0][lengths[0] - 1] == '\'') ||
-			sp1 == NULL || sp2 == NULL || sp3)
+		Txn_key tk;
+		uint32_t comp_nodeid = 0;
+		if (!parse_kunlun_xid(row.str(0), comp_nodeid, tk.start_ts, tk.local_txnid))
 		{
 			syslog(Logger::WARNING, "Got XA transaction ID %s from shard (%s.%s, %u) primary node(%u, %s:%d), not under Kunlun DRDBMS control, and it's skipped.",
-		   		row[0], this->cluster_name.c_str(), this->name.c_str(), this->id,
+		   		row.c_str(0), this->cluster_name.c_str(), this->name.c_str(), this->id,
 				cur_master->get_id(), mip.c_str(), mport);
 			continue;
 		}
-		Assert(sp1 && sp2 && !sp3);
-		*sp1 = '\0';
-		*sp2 = '\0';
-		uint comp_nodeid = strtoul(xaks, &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');
-		time_t start_ts = strtoul(sp1 + 1, &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');
-		uint32_t local_txnid = strtoul(sp2 + 1, &endptr, 10);
-		Assert(*endptr == '\'');// the trailing ', ie. the last char.
-		Txn_key tk;
 		tk.comp_nodeid = comp_nodeid;
-		tk.start_ts = start_ts;
-		tk.local_txnid = local_txnid;
 		txns.emplace_back(tk);
-		// restore content in case it's used elsewhere.
-		*sp1 = '-';
-		*sp2 = '-';
 	}
 
 	cur_master->free_mysql_result();
@@ -1403,31 +2120,26 @@ Shard_node *Shard::get_node_by_id(uint id)
 	return NULL;
 }
 
-uint Shard::get_innodb_page_size()
+/*
+  Query master_sn for innodb_page_size via its stats connection, the result
+  is cached since it never changes for a shard.
+*/
+uint Shard::get_innodb_page_size(Shard_node *master_sn)
 {
 	if(innodb_page_size == 0)
 	{
-		Scopped_mutex sm(mtx);
-
-		if(cur_master == NULL)
-			return 0;
-
-		int ret = cur_master->send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
+		int ret = master_sn->send_stats_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
 						"show variables like 'innodb_page_size'"), stmt_retries);
 		
 		if (ret)
 		   return 0;
-		MYSQL_RES *result = cur_master->get_result();
-		MYSQL_ROW row;
-		char *endptr = NULL;
+		MYSQL_RES *result = master_sn->get_stats_result();
+		Mysql_row row;
 		
-		if ((row = mysql_fetch_row(result)))
-		{
-			innodb_page_size = strtol(row[1], &endptr, 10);
-			Assert(endptr == NULL || *endptr == '\0');
-		}
+		if (row.fetch(result))
+			innodb_page_size = row.get_or(1, 0U);
 		
-		cur_master->free_mysql_result();
+		master_sn->free_stats_result();
 	}
 	
 	return innodb_page_size;
@@ -1452,8 +2164,7 @@ shards t1, shard_nodes t2, db_clusters t3 where t2.shard_id = t1.id and t3.id=t1
 	if (ret)
 		return ret;
 	MYSQL_RES *result = cur_master->get_result();
-	MYSQL_ROW row;
-	char *endptr = NULL;
+	Mysql_row row;
 	std::map<std::tuple<uint, uint, uint>, Shard_node*> sdns;
 	
 	for (auto &i:kl_clusters)
@@ -1463,17 +2174,17 @@ shards t1, shard_nodes t2, db_clusters t3 where t2.shard_id = t1.id and t3.id=t1
 
 	std::set<std::string> alterant_node_ip; //for notify node_mgr
 
-	while ((row = mysql_fetch_row(result)))
+	while (row.fetch(result))
 	{
-		uint shardid = strtol(row[0], &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');
-		uint cluster_id = strtol(row[8], &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');
-
-		uint nodeid = strtol(row[2], &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');
-		int port = strtol(row[4], &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');\
+		uint shardid = 0, cluster_id = 0, nodeid = 0;
+		int port = 0;
+		if (!row.get(0, shardid) || !row.get(8, cluster_id) ||
+			!row.get(2, nodeid) || !row.get(4, port))
+		{
+			syslog(Logger::ERROR, "Invalid shard node row (shard %s, cluster %s, node %s, port %s) skipped.",
+				   row.c_str(0), row.c_str(8), row.c_str(2), row.c_str(4));
+			continue;
+		}
 
 		KunlunCluster *pcluster = NULL;
 		for (auto &cluster:kl_clusters)
@@ -1486,9 +2197,9 @@ shards t1, shard_nodes t2, db_clusters t3 where t2.shard_id = t1.id and t3.id=t1
 		}
 		if (!pcluster)
 		{
-			pcluster = new KunlunCluster(cluster_id, row[7]);
+			pcluster = new KunlunCluster(cluster_id, row.c_str(7));
 			kl_clusters.emplace_back(pcluster);
-			syslog(Logger::INFO, "Added KunlunCluster(%s.%u) into protection.", row[7], cluster_id);
+			syslog(Logger::INFO, "Added KunlunCluster(%s.%u) into protection.", row.c_str(7), cluster_id);
 		}
 
 		Shard *pshard = NULL;
@@ -1505,25 +2216,26 @@ shards t1, shard_nodes t2, db_clusters t3 where t2.shard_id = t1.id and t3.id=t1
 		{
 			//set ha_mode for maintenance
 			HAVL_mode ha_mode = HA_mgr;
-			if(row[9]!=NULL)
+			if(!row.is_null(9))
 			{
-				if(strcmp("no_rep", row[9]) == 0)
+				if(row.str(9) == "no_rep")
 					ha_mode = HA_no_rep;
-				else if(strcmp("mgr", row[9]) == 0)
+				else if(row.str(9) == "mgr")
 					ha_mode = HA_mgr;
-				else if(strcmp("rbr", row[9]) == 0)
+				else if(row.str(9) == "rbr")
 					ha_mode = HA_rbr;
 			}
 			
-			pshard = new Shard(shardid, row[1], STORAGE, ha_mode);
-			pshard->set_cluster_info(row[7], cluster_id);
+			pshard = new Shard(shardid, row.c_str(1), STORAGE, ha_mode);
+			pshard->set_cluster_info(row.c_str(7), cluster_id);
+			pshard->set_cluster(pcluster);
 			pcluster->storage_shards.emplace_back(pshard);
 			syslog(Logger::INFO, "Added shard(%s.%s, %u) into protection.",
 				pshard->get_cluster_name().c_str(), pshard->get_name().c_str(),
 				pshard->get_id());
 		}
-		else if (pshard->get_cluster_name() != std::string(row[7]))
-			pshard->update_cluster_name(row[7], cluster_id);
+		else if (pshard->get_cluster_name() != row.str(7))
+			pshard->update_cluster_name(row.c_str(7), cluster_id);
 
 		/*
 		  Iterating a storage shard's rows and a metashard's result, so every
@@ -1531,11 +2243,12 @@ shards t1, shard_nodes t2, db_clusters t3 where t2.shard_id = t1.id and t3.id=t1
 		*/
 		bool changed = false;
 		Shard_node *n = pshard->get_node_by_id(nodeid);
-		pshard->refresh_node_configs(nodeid, row[3], port, row[5], row[6], changed);
+		pshard->refresh_node_configs(nodeid, row.c_str(3), port, row.c_str(5), row.c_str(6), changed);
 		if (changed) pshard->get_node_by_id(nodeid)->close_conn();
 
-		if(n == NULL || changed)
-			alterant_node_ip.insert(row[3]);
+		// node_mgr is notified by the instance working on the cluster only.
+		if((n == NULL || changed) && System::get_instance()->owns_cluster(cluster_id))
+			alterant_node_ip.insert(row.c_str(3));
 		
 		if(pshard->get_mode() == Shard::HA_no_rep)
 		{
@@ -1557,7 +2270,8 @@ shards t1, shard_nodes t2, db_clusters t3 where t2.shard_id = t1.id and t3.id=t1
 		int rport;
 		i.second->get_ip_port(rip, rport);
 
-		alterant_node_ip.insert(rip);
+		if (System::get_instance()->owns_cluster(pshard->get_cluster_id()))
+			alterant_node_ip.insert(rip);
 
 		syslog(Logger::INFO, "Removed shard(%s.%s, %u) node (%s:%d, %u) from protection since it's not in cluster registration anymore.",
 			pshard->get_cluster_name().c_str(), pshard->get_name().c_str(),
@@ -1586,14 +2300,16 @@ int MetadataShard::refresh_computers(std::vector<KunlunCluster *> &kl_clusters)
 
 	int ret;
 	MYSQL_RES *result;
-	MYSQL_ROW row;
-	char *endptr = NULL;
+	Mysql_row row;
 	
 	std::string str_sql;
 
 	for (auto &cluster:kl_clusters)
 	{
-		str_sql = "select id,name,hostaddr,port,user_name,passwd from comp_nodes where status!='inactive' and db_cluster_id=" 
+		str_sql = std::string("select id,name,hostaddr,port,user_name,passwd from comp_nodes where ") +
+			(states_tables_created.load() ? "(status!='inactive' or id in "
+			 "(select comp_id from cluster_mgr_comp_deactivated))" : "status!='inactive'") +
+			" and db_cluster_id=" 
 					+ std::to_string(cluster->get_id());
 
 		//syslog(Logger::INFO, "refresh_computers str_sql = %s", str_sql.c_str());
@@ -1605,13 +2321,20 @@ int MetadataShard::refresh_computers(std::vector<KunlunCluster *> &kl_clusters)
 		std::map<uint, Computer_node*> sdns;
 		for (auto &i:cluster->computer_nodes)
 			sdns[i->id] = i;
+
+		// node_mgr is notified by the instance working on the cluster only.
+		bool notify = System::get_instance()->owns_cluster(cluster->get_id());
 		
-		while ((row = mysql_fetch_row(result)))
+		while (row.fetch(result))
 		{
-			uint compid = strtol(row[0], &endptr, 10);
-			Assert(endptr == NULL || *endptr == '\0');
-			int port = strtol(row[3], &endptr, 10);
-			Assert(endptr == NULL || *endptr == '\0');
+			uint compid = 0;
+			int port = 0;
+			if (!row.get(0, compid) || !row.get(3, port))
+			{
+				syslog(Logger::ERROR, "Invalid computer node row (id %s, port %s) of cluster %s skipped.",
+					   row.c_str(0), row.c_str(3), cluster->get_name().c_str());
+				continue;
+			}
 
 			Computer_node *pcomputer = NULL;
 
@@ -1625,17 +2348,19 @@ int MetadataShard::refresh_computers(std::vector<KunlunCluster *> &kl_clusters)
 			}
 			if (!pcomputer)
 			{
-				pcomputer = new Computer_node(compid, cluster->get_id(), port, row[1], row[2], row[4], row[5]);
+				pcomputer = new Computer_node(compid, cluster->get_id(), port, row.c_str(1), row.c_str(2), row.c_str(4), row.c_str(5));
 				cluster->computer_nodes.emplace_back(pcomputer);
 				syslog(Logger::INFO, "Added Computer(%s, %u, %s) into protection.",
 							cluster->get_name().c_str(), pcomputer->id, pcomputer->name.c_str());
 
-				alterant_node_ip.insert(row[2]);
+				if (notify)
+					alterant_node_ip.insert(row.c_str(2));
 			}
 			else
 			{
-				if(pcomputer->refresh_node_configs(port, row[1], row[2], row[4], row[5]))
-					alterant_node_ip.insert(row[2]);
+				if(pcomputer->refresh_node_configs(port, row.c_str(1), row.c_str(2), row.c_str(4), row.c_str(5)) &&
+				   notify)
+					alterant_node_ip.insert(row.c_str(2));
 			}
 
 			// remove nodes that still exist.
@@ -1651,7 +2376,8 @@ int MetadataShard::refresh_computers(std::vector<KunlunCluster *> &kl_clusters)
 			int port;
 
 			i.second->get_ip_port(ip, port);
-			alterant_node_ip.insert(ip);
+			if (notify)
+				alterant_node_ip.insert(ip);
 			
 			for(auto it=cluster->computer_nodes.begin(); it!=cluster->computer_nodes.end(); )
 			{
@@ -1665,6 +2391,8 @@ int MetadataShard::refresh_computers(std::vector<KunlunCluster *> &kl_clusters)
 					it++;
 			}
 		}
+
+		cluster->refresh_master_push_conns();
 	}
 
 	if(alterant_node_ip.size() != 0)
@@ -1754,24 +2482,195 @@ int MetadataShard::check_port_used(std::string &ip, int port)
 */
 int MetadataShard::get_comp_nodes_id_seq(int &comps_id)
 {
-	Scopped_mutex sm(mtx);
-
-	if(cur_master == NULL)
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
 		return 1;
 
-	int ret = cur_master->send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN("select max(id) from comp_nodes_id_seq"), stmt_retries);	
+	int ret = conn.send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN("select max(id) from comp_nodes_id_seq"), stmt_retries);	
 	if (ret==0)
 	{
-		MYSQL_RES *result = cur_master->get_result();
+		MYSQL_RES *result = conn.get_result();
 		MYSQL_ROW row;
 		if ((row = mysql_fetch_row(result)))
 		{
 			if(row[0] != NULL)
 				comps_id = atoi(row[0]);
 		}
-		cur_master->free_mysql_result();
+		conn.free_mysql_result();
+	}
+
+	return ret;
+}
+
+MetadataShard::~MetadataShard()
+{
+	for (auto &conn:pool_idle)
+		delete conn;
+	pool_idle.clear();
+	pthread_mutex_destroy(&pool_mtx);
+	pthread_cond_destroy(&pool_cond);
+}
+
+/*
+  Take an idle connection to the master from the pool, or make a new one if
+  fewer than meta_conn_pool_size are in use, otherwise wait for one to be
+  returned. If the master changed since the pool was built, the idle
+  connections are closed and those in use are freed when returned.
+  @retval NULL if there is no master.
+*/
+MYSQL_CONN *MetadataShard::checkout_conn(Shard_node *&master, uint &gen)
+{
+	MYSQL_CONN *conn = NULL;
+
+	while (true)
+	{
+		/*
+		  Sync the pool with cur_master holding mtx, so that the node can't be
+		  removed meanwhile. A node to be removed has its pooled connections
+		  released first, which changes pool_gen, so pool_master is live as
+		  long as pool_gen is unchanged. mtx is never waited for while
+		  holding pool_mtx.
+		*/
+		pthread_mutex_lock(&mtx);
+		pthread_mutex_lock(&pool_mtx);
+		if (pool_master != cur_master)
+		{
+			for (auto &c:pool_idle)
+				delete c;
+			pool_idle.clear();
+			pool_nconns = 0;
+			pool_gen++;
+			pool_master = cur_master;
+			pthread_cond_broadcast(&pool_cond);
+		}
+		pthread_mutex_unlock(&mtx);
+
+		uint synced_gen = pool_gen;
+		while (pool_gen == synced_gen && pool_master != NULL &&
+			   pool_idle.empty() && pool_nconns >= (uint)meta_conn_pool_size &&
+			   !Thread_manager::do_exit)
+			pthread_cond_wait(&pool_cond, &pool_mtx);
+
+		if (pool_gen != synced_gen)
+		{
+			pthread_mutex_unlock(&pool_mtx);
+			continue;
+		}
+
+		if (pool_master == NULL || Thread_manager::do_exit)
+		{
+			pthread_mutex_unlock(&pool_mtx);
+			return NULL;
+		}
+
+		if (pool_idle.size() > 0)
+		{
+			conn = pool_idle.back();
+			pool_idle.pop_back();
+		}
+		else
+		{
+			std::string ip, user, pwd;
+			int port;
+			pool_master->get_ip_port(ip, port);
+			pool_master->get_user_pwd(user, pwd);
+			conn = new MYSQL_CONN(ip.c_str(), port, user.c_str(), pwd.c_str(), pool_master);
+			pool_nconns++;
+		}
+		break;
+	}
+
+	master = pool_master;
+	gen = pool_gen;
+	pool_inuse[master]++;
+	pthread_mutex_unlock(&pool_mtx);
+	return conn;
+}
+
+/*
+  Put a connection checked out by checkout_conn() back to the pool, or
+  free it if it's broken or the pool was rebuilt since it was checked out.
+*/
+void MetadataShard::return_conn(MYSQL_CONN *conn, Shard_node *master, uint gen, bool broken)
+{
+	Scopped_mutex sm(pool_mtx);
+
+	if (--pool_inuse[master] == 0)
+		pool_inuse.erase(master);
+
+	if (gen != pool_gen)
+	{
+		delete conn;
+		pthread_cond_broadcast(&pool_cond);
+		return;
+	}
+
+	if (broken)
+	{
+		delete conn;
+		pool_nconns--;
+	}
+	else
+		pool_idle.emplace_back(conn);
+
+	pthread_cond_broadcast(&pool_cond);
+}
+
+/*
+  Close the pooled connections to sn, called with mtx held before sn is
+  removed, so that no more connections to it are checked out.
+*/
+void MetadataShard::release_pooled_conns(Shard_node *sn)
+{
+	Scopped_mutex sm(pool_mtx);
+
+	if (pool_master == sn)
+	{
+		for (auto &c:pool_idle)
+			delete c;
+		pool_idle.clear();
+		pool_nconns = 0;
+		pool_gen++;
+		pool_master = NULL;
+		pthread_cond_broadcast(&pool_cond);
+	}
+}
+
+/*
+  Wait for the connections to sn in use to be returned, so that sn can be
+  deleted. Called without mtx, so that other metadata operations aren't
+  stalled meanwhile.
+*/
+void MetadataShard::wait_pooled_conns(Shard_node *sn)
+{
+	Scopped_mutex sm(pool_mtx);
+	while (pool_inuse.find(sn) != pool_inuse.end())
+		pthread_cond_wait(&pool_cond, &pool_mtx);
+}
+
+Pooled_meta_conn::Pooled_meta_conn(MetadataShard &meta_shard_) :
+	meta_shard(meta_shard_), master(NULL), conn(NULL), gen(0), broken(false)
+{
+	conn = meta_shard.checkout_conn(master, gen);
+}
+
+Pooled_meta_conn::~Pooled_meta_conn()
+{
+	if (conn)
+	{
+		conn->free_mysql_result();
+		meta_shard.return_conn(conn, master, gen, broken);
 	}
+}
 
+/*
+  Same as Shard_node::send_stmt() but done via the pooled connection.
+*/
+bool Pooled_meta_conn::
+send_stmt(enum_sql_command sqlcom_, const char *stmt, size_t len, int nretries)
+{
+	bool ret = master->send_stmt(*conn, sqlcom_, stmt, len, nretries);
+	broken = !conn->connected;
 	return ret;
 }
 
@@ -1782,22 +2681,21 @@ int MetadataShard::get_comp_nodes_id_seq(int &comps_id)
 */
 int MetadataShard::get_max_cluster_id(int &cluster_id)
 {
-	Scopped_mutex sm(mtx);
-
-	if(cur_master == NULL)
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
 		return 1;
 
-	int ret = cur_master->send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN("select max(id) from db_clusters"), stmt_retries);	
+	int ret = conn.send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN("select max(id) from db_clusters"), stmt_retries);	
 	if (ret==0)
 	{
-		MYSQL_RES *result = cur_master->get_result();
+		MYSQL_RES *result = conn.get_result();
 		MYSQL_ROW row;
 		if ((row = mysql_fetch_row(result)))
 		{
 			if(row[0] != NULL)
 				cluster_id = atoi(row[0]);
 		}
-		cur_master->free_mysql_result();
+		conn.free_mysql_result();
 	}
 
 	return ret;
@@ -1810,12 +2708,11 @@ int MetadataShard::get_max_cluster_id(int &cluster_id)
 */
 int MetadataShard::execute_metadate_opertation(enum_sql_command command, const std::string & str_sql)
 {
-	Scopped_mutex sm(mtx);
-
-	if(cur_master == NULL)
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
 		return 1;
 
-	int ret = cur_master->send_stmt(command, str_sql.c_str(), str_sql.length(), stmt_retries);
+	int ret = conn.send_stmt(command, str_sql.c_str(), str_sql.length(), stmt_retries);
 
 	return ret;
 }
@@ -2108,16 +3005,15 @@ int MetadataShard::delete_cluster_comp_from_metadata(std::string &cluster_name,
 */
 int MetadataShard::get_server_nodes_from_metadata(std::vector<Machine*> &vec_machines)
 {
-	Scopped_mutex sm(mtx);
-
-	if(cur_master == NULL)
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
 		return 1;
 
 	std::string str_sql = "select hostaddr,rack_id,datadir,logdir,wal_log_dir,comp_datadir,total_mem,total_cpu_cores from server_nodes";
-	int ret = cur_master->send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
+	int ret = conn.send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
 	if (ret==0)
 	{
-		MYSQL_RES *result = cur_master->get_result();
+		MYSQL_RES *result = conn.get_result();
 		MYSQL_ROW row;
 		while ((row = mysql_fetch_row(result)))
 		{
@@ -2144,12 +3040,37 @@ int MetadataShard::get_server_nodes_from_metadata(std::vector<Machine*> &vec_mac
 				vec_machines.emplace_back(machine);
 			}
 		}
-		cur_master->free_mysql_result();
+		conn.free_mysql_result();
 	}
 
 	return ret;
 }
 
+/*
+  Get rack_id of each machine by hostaddr, from server_nodes.
+  @retval 0 succeed;
+  		  1 fail;
+*/
+int MetadataShard::get_machine_racks(std::map<std::string, std::string> &racks)
+{
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
+		return 1;
+
+	int ret = conn.send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
+		"select hostaddr, rack_id from server_nodes"), stmt_retries);
+	if (ret)
+		return ret;
+
+	MYSQL_RES *result = conn.get_result();
+	Mysql_row row;
+	while (row.fetch(result))
+		if (!row.is_null(0) && !row.is_null(1))
+			racks[row.c_str(0)] = row.c_str(1);
+	conn.free_mysql_result();
+	return 0;
+}
+
 /*
   get_meta_instance from metadata table
   @retval 0 succeed;
@@ -2157,18 +3078,17 @@ int MetadataShard::get_server_nodes_from_metadata(std::vector<Machine*> &vec_mac
 */
 int MetadataShard::get_meta_instance(Machine* machine)
 {
-	Scopped_mutex sm(mtx);
-
-	if(cur_master == NULL)
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
 		return 1;
 
 	std::string str_sql = "select port from meta_db_nodes where hostaddr='" + machine->ip + "'";
-	int ret = cur_master->send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
+	int ret = conn.send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
 	if (ret==0)
 	{
-		MYSQL_RES *result = cur_master->get_result();
+		MYSQL_RES *result = conn.get_result();
 		machine->instance_storage += (int)mysql_num_rows(result);
-		cur_master->free_mysql_result();
+		conn.free_mysql_result();
 	}
 
 	return ret;
@@ -2181,16 +3101,15 @@ int MetadataShard::get_meta_instance(Machine* machine)
 */
 int MetadataShard::get_storage_instance_port(Machine* machine)
 {
-	Scopped_mutex sm(mtx);
-
-	if(cur_master == NULL)
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
 		return 1;
 
 	std::string str_sql = "select port from shard_nodes where hostaddr='" + machine->ip + "'";
-	int ret = cur_master->send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
+	int ret = conn.send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
 	if (ret==0)
 	{
-		MYSQL_RES *result = cur_master->get_result();
+		MYSQL_RES *result = conn.get_result();
 		machine->instance_storage += (int)mysql_num_rows(result);
 		MYSQL_ROW row;
 		while ((row = mysql_fetch_row(result)))
@@ -2199,7 +3118,7 @@ int MetadataShard::get_storage_instance_port(Machine* machine)
 			if(port > machine->port_storage)
 				machine->port_storage = port;
 		}
-		cur_master->free_mysql_result();
+		conn.free_mysql_result();
 	}
 
 	return ret;
@@ -2212,16 +3131,15 @@ int MetadataShard::get_storage_instance_port(Machine* machine)
 */
 int MetadataShard::get_computer_instance_port(Machine* machine)
 {
-	Scopped_mutex sm(mtx);
-
-	if(cur_master == NULL)
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
 		return 1;
 
 	std::string str_sql = "select port from comp_nodes where hostaddr='" + machine->ip + "'";
-	int ret = cur_master->send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
+	int ret = conn.send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
 	if (ret==0)
 	{
-		MYSQL_RES *result = cur_master->get_result();
+		MYSQL_RES *result = conn.get_result();
 		machine->instance_computer += (int)mysql_num_rows(result);
 		MYSQL_ROW row;
 		while ((row = mysql_fetch_row(result)))
@@ -2230,7 +3148,7 @@ int MetadataShard::get_computer_instance_port(Machine* machine)
 			if(port > machine->port_computer)
 				machine->port_computer = port;
 		}
-		cur_master->free_mysql_result();
+		conn.free_mysql_result();
 	}
 
 	return ret;
@@ -2243,51 +3161,81 @@ int MetadataShard::get_computer_instance_port(Machine* machine)
 */
 int MetadataShard::update_instance_status(Tpye_Ip_Port &ip_port, std::string &status, int &type)
 {
-	Scopped_mutex sm(mtx);
-
-	if(cur_master == NULL)
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
 		return 1;
 
 	std::string str_sql;
 	int ret;
 
 	str_sql = "select status from shard_nodes where hostaddr='" + ip_port.first + "' and port=" + std::to_string(ip_port.second);
-	ret = cur_master->send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
+	ret = conn.send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
 	if (ret==0)
 	{
-		MYSQL_RES *result = cur_master->get_result();
+		MYSQL_RES *result = conn.get_result();
 		int num_rows = (int)mysql_num_rows(result);
-		cur_master->free_mysql_result();
+		conn.free_mysql_result();
 
 		if(num_rows==1)
 		{
 			type = 1;
 
 			str_sql = "update shard_nodes set status='" + status + "' where hostaddr='" + ip_port.first + "' and port=" + std::to_string(ip_port.second);
-			return cur_master->send_stmt(SQLCOM_UPDATE, str_sql.c_str(), str_sql.length(), stmt_retries);
+			return conn.send_stmt(SQLCOM_UPDATE, str_sql.c_str(), str_sql.length(), stmt_retries);
 		}
 	}
 
 	str_sql = "select status from comp_nodes where hostaddr='" + ip_port.first + "' and port=" + std::to_string(ip_port.second);
-	ret = cur_master->send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
+	ret = conn.send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
 	if (ret==0)
 	{
-		MYSQL_RES *result = cur_master->get_result();
+		MYSQL_RES *result = conn.get_result();
 		int num_rows = (int)mysql_num_rows(result);
-		cur_master->free_mysql_result();
+		conn.free_mysql_result();
 
 		if(num_rows==1)
 		{
 			type = 2;
 
 			str_sql = "update comp_nodes set status='" + status + "' where hostaddr='" + ip_port.first + "' and port=" + std::to_string(ip_port.second);
-			return cur_master->send_stmt(SQLCOM_UPDATE, str_sql.c_str(), str_sql.length(), stmt_retries);
+			return conn.send_stmt(SQLCOM_UPDATE, str_sql.c_str(), str_sql.length(), stmt_retries);
 		}
 	}
 
 	return ret;
 }
 
+/*
+  Mark a computer node 'inactive' in comp_nodes if it's found dead by
+  probes, and 'active' again once it's alive, so that load balancers
+  polling comp_nodes drop and add it back. comp_nodes.status has no other
+  value for a dead node, so the node is recorded in
+  cluster_mgr_comp_deactivated first, and such a node is still protected
+  and probed, see refresh_computers(). A node of any other status, or set
+  'inactive' by others, is left alone.
+  @retval 0 succeed;
+  		  1 fail;
+*/
+int MetadataShard::update_comp_node_status(uint comp_id, bool alive)
+{
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid() || create_states_tables(conn))
+		return 1;
+
+	std::string id = std::to_string(comp_id);
+	if (alive)
+		return (conn.send_stmt(SQLCOM_UPDATE, "update comp_nodes set status='active' "
+					"where status='inactive' and id=" + id + " and id in "
+					"(select comp_id from cluster_mgr_comp_deactivated)", stmt_retries) ||
+				conn.send_stmt(SQLCOM_DELETE, "delete from cluster_mgr_comp_deactivated "
+					"where comp_id=" + id, stmt_retries)) ? 1 : 0;
+
+	return (conn.send_stmt(SQLCOM_INSERT, "insert ignore into cluster_mgr_comp_deactivated "
+				"select id from comp_nodes where status='active' and id=" + id, stmt_retries) ||
+			conn.send_stmt(SQLCOM_UPDATE, "update comp_nodes set status='inactive' "
+				"where status='active' and id=" + id, stmt_retries)) ? 1 : 0;
+}
+
 /*
   add shard nodes to metadata table
   @retval 0 succeed;
@@ -2368,17 +3316,16 @@ int MetadataShard::add_shard_nodes(std::string &cluster_name, std::string &shard
 */
 int MetadataShard::get_backup_info_from_metadata(std::string &cluster_name, std::string &timestamp, Tpye_cluster_info &cluster_info)
 {
-	Scopped_mutex sm(mtx);
-
-	if(cur_master == NULL)
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
 		return 1;
 
 	std::string str_sql  = "select ha_mode,shards,nodes,comps,max_storage_size,max_connections,cpu_cores,innodb_size from cluster_backups";
 	str_sql += " where cluster_name='" + cluster_name + "' and when_created<='" + timestamp + "' order by when_created desc";
-	int ret = cur_master->send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
+	int ret = conn.send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
 	if (ret==0)
 	{
-		MYSQL_RES *result = cur_master->get_result();
+		MYSQL_RES *result = conn.get_result();
 		MYSQL_ROW row;
 
 		ret = 1;
@@ -2394,7 +3341,7 @@ int MetadataShard::get_backup_info_from_metadata(std::string &cluster_name, std:
 			std::get<7>(cluster_info) = atoi(row[7]);
 			ret = 0;
 		}
-		cur_master->free_mysql_result();
+		conn.free_mysql_result();
 	}
 
 	return ret;
@@ -2407,16 +3354,15 @@ int MetadataShard::get_backup_info_from_metadata(std::string &cluster_name, std:
 */
 bool MetadataShard::check_machine_hostaddr(std::string &hostaddr)
 {
-	Scopped_mutex sm(mtx);
-
-	if(cur_master == NULL)
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
 		return false;
 
 	std::string str_sql  = "select hostaddr from server_nodes where hostaddr='" + hostaddr + "'";
-	int ret = cur_master->send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
+	int ret = conn.send_stmt(SQLCOM_SELECT, str_sql.c_str(), str_sql.length(), stmt_retries);
 	if (ret==0)
 	{
-		MYSQL_RES *result = cur_master->get_result();
+		MYSQL_RES *result = conn.get_result();
 		MYSQL_ROW row;
 
 		if ((row = mysql_fetch_row(result)))
@@ -2424,12 +3370,198 @@ bool MetadataShard::check_machine_hostaddr(std::string &hostaddr)
 			if(hostaddr == row[0])
 				ret = 1;
 		}
-		cur_master->free_mysql_result();
+		conn.free_mysql_result();
 	}
 
 	return (ret == 1);
 }
 
+/*
+  Renew the lease of cluster_mgr instance 'instance' for cluster_lease_timeout
+  seconds, and get the instances whose leases haven't expired, including
+  this one. The lease tables are created if not yet. Lease times are of the
+  metadata server's clock, so instances' clocks needn't be in sync.
+  @retval 0 succeed;
+  		  1 fail;
+*/
+int MetadataShard::renew_instance_lease(const std::string &instance,
+	std::vector<std::string> &live_instances)
+{
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
+		return 1;
+
+	if(!lease_tables_created)
+	{
+		if(conn.send_stmt(SQLCOM_CREATE_TABLE, CONST_STR_PTR_LEN(
+				"create table if not exists cluster_mgr_instances("
+				"name varchar(128) primary key, lease_expire_at datetime(3) not null)"), stmt_retries) ||
+			conn.send_stmt(SQLCOM_CREATE_TABLE, CONST_STR_PTR_LEN(
+				"create table if not exists cluster_mgr_leases("
+				"db_cluster_id int unsigned primary key, owner varchar(128) not null, "
+				"lease_expire_at datetime(3) not null)"), stmt_retries))
+			return 1;
+		lease_tables_created = true;
+	}
+
+	std::string str_sql = "insert into cluster_mgr_instances values('" + instance +
+		"', now(3) + interval " + std::to_string(cluster_lease_timeout) +
+		" second) on duplicate key update lease_expire_at=values(lease_expire_at)";
+	if(conn.send_stmt(SQLCOM_INSERT, str_sql, stmt_retries))
+		return 1;
+
+	if(conn.send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
+			"select name from cluster_mgr_instances where lease_expire_at > now(3)"), stmt_retries))
+		return 1;
+
+	MYSQL_RES *result = conn.get_result();
+	Mysql_row row;
+	live_instances.clear();
+	while (row.fetch(result))
+		live_instances.emplace_back(row.str(0));
+	conn.free_mysql_result();
+
+	return 0;
+}
+
+/*
+  Take or renew leases of clusters in 'wanted' for instance 'instance',
+  a cluster is taken only if its lease expired or is already ours; and give
+  up ours of clusters in 'released'. Then get in 'owned' the clusters whose
+  unexpired leases are ours.
+  @retval 0 succeed;
+  		  1 fail;
+*/
+int MetadataShard::renew_cluster_leases(const std::string &instance,
+	const std::vector<uint> &wanted, const std::vector<uint> &released,
+	std::set<uint> &owned)
+{
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid())
+		return 1;
+
+	std::string str_sql;
+	if(wanted.size() > 0)
+	{
+		str_sql = "insert into cluster_mgr_leases values";
+		for(size_t i=0; i<wanted.size(); i++)
+		{
+			if(i > 0)
+				str_sql += ",";
+			str_sql += "(" + std::to_string(wanted[i]) + ",'" + instance + "',now(3) + interval " +
+				std::to_string(cluster_lease_timeout) + " second)";
+		}
+		// owner is assigned first, so lease_expire_at is renewed iff the lease is ours now
+		str_sql += " on duplicate key update"
+			" owner=if(owner=values(owner) or lease_expire_at < now(3), values(owner), owner),"
+			" lease_expire_at=if(owner=values(owner), values(lease_expire_at), lease_expire_at)";
+		if(conn.send_stmt(SQLCOM_INSERT, str_sql, stmt_retries))
+			return 1;
+	}
+
+	if(released.size() > 0)
+	{
+		str_sql = "delete from cluster_mgr_leases where owner='" + instance + "' and db_cluster_id in (";
+		for(size_t i=0; i<released.size(); i++)
+		{
+			if(i > 0)
+				str_sql += ",";
+			str_sql += std::to_string(released[i]);
+		}
+		str_sql += ")";
+		if(conn.send_stmt(SQLCOM_DELETE, str_sql, stmt_retries))
+			return 1;
+	}
+
+	str_sql = "select db_cluster_id from cluster_mgr_leases where owner='" + instance +
+		"' and lease_expire_at > now(3)";
+	if(conn.send_stmt(SQLCOM_SELECT, str_sql, stmt_retries))
+		return 1;
+
+	MYSQL_RES *result = conn.get_result();
+	Mysql_row row;
+	owned.clear();
+	while (row.fetch(result))
+	{
+		uint cluster_id = 0;
+		if(row.get(0, cluster_id))
+			owned.insert(cluster_id);
+	}
+	conn.free_mysql_result();
+
+	return 0;
+}
+
+/*
+  Create the tables of states kept by cluster_mgr if not yet, they're used
+  whether or not clusters can be taken over. cluster_mgr_comp_deactivated
+  has the computer nodes set 'inactive' by probes, see
+  update_comp_node_status().
+  @retval 0 succeed;
+  		  1 fail;
+*/
+int MetadataShard::create_states_tables(Pooled_meta_conn &conn)
+{
+	if (states_tables_created.load())
+		return 0;
+	if(conn.send_stmt(SQLCOM_CREATE_TABLE, CONST_STR_PTR_LEN(
+			"create table if not exists cluster_mgr_shard_states("
+			"shard_id int unsigned primary key, pending_master_node_id int unsigned not null)"), stmt_retries) ||
+		conn.send_stmt(SQLCOM_CREATE_TABLE, CONST_STR_PTR_LEN(
+			"create table if not exists cluster_mgr_comp_deactivated("
+			"comp_id int unsigned primary key)"), stmt_retries))
+		return 1;
+	states_tables_created.store(true);
+	return 0;
+}
+
+/*
+  Save the pending primary node of a shard for the instance restarted or
+  taking it over.
+  @retval 0 succeed;
+  		  1 fail;
+*/
+int MetadataShard::save_pending_master(uint shard_id, uint node_id)
+{
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid() || create_states_tables(conn))
+		return 1;
+
+	std::string str_sql = "insert into cluster_mgr_shard_states values(" +
+		std::to_string(shard_id) + "," + std::to_string(node_id) +
+		") on duplicate key update pending_master_node_id=values(pending_master_node_id)";
+	return conn.send_stmt(SQLCOM_INSERT, str_sql, stmt_retries);
+}
+
+/*
+  Get pending primary nodes of shards saved by save_pending_master().
+  @retval 0 succeed;
+  		  1 fail;
+*/
+int MetadataShard::load_pending_masters(std::map<uint, uint> &pending_masters)
+{
+	Pooled_meta_conn conn(*this);
+	if(!conn.valid() || create_states_tables(conn))
+		return 1;
+
+	if(conn.send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
+			"select shard_id, pending_master_node_id from cluster_mgr_shard_states"), stmt_retries))
+		return 1;
+
+	MYSQL_RES *result = conn.get_result();
+	Mysql_row row;
+	pending_masters.clear();
+	while (row.fetch(result))
+	{
+		uint shard_id = 0, node_id = 0;
+		if(row.get(0, shard_id) && row.get(1, node_id))
+			pending_masters[shard_id] = node_id;
+	}
+	conn.free_mysql_result();
+
+	return 0;
+}
+
 /*
   Query meta shard node sn to fetch all meta shard nodes from its
   meta_db_nodes table, and refresh the shard nodes contained in this object.
@@ -2440,6 +3572,25 @@ bool MetadataShard::check_machine_hostaddr(std::string &hostaddr)
 */
 int MetadataShard::fetch_meta_shard_nodes(Shard_node *sn, bool is_master,
 	const char *master_ip, int master_port)
+{
+	std::vector<Shard_node *> removed;
+	int ret = refresh_meta_shard_nodes(sn, is_master, master_ip, master_port, removed);
+
+	// removed nodes are deleted without mtx once their pooled connections are back.
+	for (auto &pn:removed)
+	{
+		wait_pooled_conns(pn);
+		delete pn;
+	}
+	return ret;
+}
+
+/*
+  Does the work of fetch_meta_shard_nodes() holding mtx, the nodes no longer
+  registered are detached from the shard into 'removed'.
+*/
+int MetadataShard::refresh_meta_shard_nodes(Shard_node *sn, bool is_master,
+	const char *master_ip, int master_port, std::vector<Shard_node *> &removed)
 {
 	Scopped_mutex sm(mtx);
 	Assert(nodes.size() > 0); // sn should have been added already.
@@ -2453,9 +3604,8 @@ int MetadataShard::fetch_meta_shard_nodes(Shard_node *sn, bool is_master,
 
 	std::string master_usr, master_pwd;
 	MYSQL_RES *result = sn->get_result();
-	MYSQL_ROW row;
-	char *endptr = NULL;
-	bool close_snconn = false;
+	Mysql_row row;
+	bool close_snconn = false, skipped_rows = false;
 
 	std::map<uint, Shard_node*>snodes;
 	for (auto &i:nodes)
@@ -2463,17 +3613,29 @@ int MetadataShard::fetch_meta_shard_nodes(Shard_node *sn, bool is_master,
 		snodes.insert(std::make_pair(i->get_id(), i));
 	}
 
-	while ((row = mysql_fetch_row(result)))
+	while (row.fetch(result))
 	{
-		int port = strtol(row[2], &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');
-		uint nodeid = strtol(row[0], &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');
+		int port = 0;
+		uint nodeid = 0;
+		bool id_ok = row.get(0, nodeid);
+		if (!id_ok || !row.get(2, port) ||
+			row.is_null(1) || row.is_null(3) || row.is_null(4))
+		{
+			syslog(Logger::ERROR, "Invalid meta_db_nodes row (id %s, host %s, port %s) skipped.",
+				   std::string(row.str(0)).c_str(), std::string(row.str(1)).c_str(),
+				   std::string(row.str(2)).c_str());
+			// a node whose row isn't usable is kept as it is.
+			if (id_ok)
+				snodes.erase(nodeid);
+			else
+				skipped_rows = true;
+			continue;
+		}
 		/*
 		  config file has no meta svr node id, need to set it before below
 		  erase.
 		*/
-		if (meta_svr_ip == row[1] && meta_svr_port == port &&
+		if (meta_svr_ip == row.str(1) && meta_svr_port == port &&
 			sn->matches_ip_port(meta_svr_ip, meta_svr_port))
 		{
 			snodes.erase(sn->get_id());
@@ -2485,7 +3647,7 @@ int MetadataShard::fetch_meta_shard_nodes(Shard_node *sn, bool is_master,
 		bool changed = false;
 		Shard_node *n = get_node_by_id(nodeid);
 		Shard_node *node =
-			refresh_node_configs(nodeid, row[1], port, row[3], row[4], changed);
+			refresh_node_configs(nodeid, row.c_str(1), port, row.c_str(3), row.c_str(4), changed);
 		// need to close sn's conn, but not now for sn since we are iterating them.
 		if (node == sn && changed)
 			close_snconn = true;
@@ -2493,9 +3655,9 @@ int MetadataShard::fetch_meta_shard_nodes(Shard_node *sn, bool is_master,
 			node->close_conn();
 
 		if(n == NULL || changed)
-			alterant_node_ip.insert(row[1]);
+			alterant_node_ip.insert(row.c_str(1));
 
-		if (!is_master && master_ip && strcmp(master_ip, row[1]) == 0 &&
+		if (!is_master && master_ip && row.str(1) == master_ip &&
 			master_port == port && set_master(node))
 		{
 			/*
@@ -2513,10 +3675,13 @@ int MetadataShard::fetch_meta_shard_nodes(Shard_node *sn, bool is_master,
 	if (close_snconn) sn->close_conn();
 
 	/*
-	  Remove nodes that are no longer registered in the metadata shard.
+	  Remove nodes that are no longer registered in the metadata shard, none
+	  if a row's node id is unknown.
 	*/
 	for (auto &i:snodes)
 	{
+		if (skipped_rows)
+			break;
 		Shard *ps = i.second->get_owner();
 		Shard_node *pn = i.second;
 
@@ -2531,10 +3696,11 @@ int MetadataShard::fetch_meta_shard_nodes(Shard_node *sn, bool is_master,
 			   ps->get_cluster_name().c_str(), ps->get_name().c_str(),
 			   ps->get_id(), snip.c_str(), snport, pn->get_id());
 
-		remove_node(pn->get_id());
+		release_pooled_conns(pn);
+		removed.emplace_back(detach_node(pn->get_id()));
 	}
 
-	if(alterant_node_ip.size() != 0)
+	if(alterant_node_ip.size() != 0 && System::get_instance()->owns_cluster(get_cluster_id()))
 		Job::get_instance()->notify_node_update(alterant_node_ip, 0);
 
 	return 0;
@@ -2550,22 +3716,189 @@ void Shard::maintenance()
 	// if ret not 0, master node isn't uniquely resolved or running.
 	if (ret == 0)
 	{
+		push_master();
 		end_recovered_prepared_txns();
 		get_xa_prepared();
 	}
 	else
 		syslog(Logger::WARNING, "Got error %d from check_mgr_cluster() in shard (%s.%s, %u), skipping prepared txns.",
 			   ret, get_cluster_name().c_str(), get_name().c_str(), get_id());
+}
+
+/*
+  Push the primary node confirmed by check_mgr_cluster() to the computer
+  nodes which don't have it yet, e.g. those failed last time or added
+  since, see KunlunCluster::push_shard_master().
+*/
+void Shard::push_master()
+{
+	uint master_id = 0;
+	KunlunCluster *pcluster = NULL;
+	{
+		Scopped_mutex sm(mtx);
+		if (cur_master)
+			master_id = cur_master->get_id();
+		pcluster = cluster;
+	}
+
+	if (pcluster == NULL || master_id == 0)
+		return;
+
+	if (pcluster->push_shard_master(get_id(), master_id) == 0 &&
+		master_id != pushed_master_id)
+	{
+		syslog(Logger::INFO, "Pushed primary node %u of shard (%s.%s, %u) to computer nodes.",
+			   master_id, get_cluster_name().c_str(), get_name().c_str(), get_id());
+		pushed_master_id = master_id;
+	}
+}
+
+/*
+  Get the ip of the primary node, and the ids and ips of the other nodes
+  not known down, as candidates to move the primary role to.
+  @retval false if the primary isn't known.
+*/
+bool Shard::get_primary_layout(std::string &master_ip,
+	std::vector<std::pair<uint, std::string> > &secondaries)
+{
+	Scopped_mutex sm(mtx);
+	if (!cur_master)
+		return false;
+
+	std::string ip;
+	int port = 0;
+	cur_master->get_ip_port(master_ip, port);
+	secondaries.clear();
+	for (auto &n:nodes)
+	{
+		if (n == cur_master || n->is_known_down())
+			continue;
+		n->get_ip_port(ip, port);
+		secondaries.emplace_back(n->get_id(), ip);
+	}
+	return true;
+}
+
+/*
+  Whether the shard has prepared txns whose decisions are not carried out,
+  either known here or recovered on the primary. Such txns are in doubt
+  until ended, the primary must not be moved meanwhile.
+  @retval true if there are such txns or it's unknown.
+*/
+bool Shard::has_in_doubt_txns()
+{
+	{
+	Scopped_mutex sm(mtx_txninfo);
+	if (!txn_end_decisions.empty() || !prep_recvrd_txns.empty())
+		return true;
+	}
+
+	Scopped_mutex sm(mtx);
+	if (!cur_master || cur_master->send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN(
+		"select count(*) from information_schema.innodb_trx where trx_xa_type='external_recvrd'"),
+		1, monotonic_ms() + health_check_timeout_ms))
+		return true;
+
+	Mysql_row row;
+	uint64_t ntxns = 1;
+	if (row.fetch(cur_master->get_result()))
+		row.get(0, ntxns);
+	cur_master->free_mysql_result();
+	return ntxns > 0;
+}
+
+/*
+  Move the MGR primary role to node target_id, a secondary, by
+  group_replication_set_as_primary() on the current primary, which waits
+  for the primary's running txns to finish, until deadline_ms. Called by a
+  thread holding the shard, see set_thread_handler(). The new primary is
+  confirmed by the group view, the worker threads check it otherwise.
+  @retval 0 if moved, -1 otherwise, and the shard is left as it was.
+*/
+int Shard::move_primary(uint target_id, int64_t deadline_ms)
+{
+	Scopped_mutex sm(mtx);
+	Shard_node *target = get_node_by_id(target_id);
+	if (!cur_master || !target || target == cur_master)
+		return -1;
+
+	std::string mip, tip;
+	int mport = 0, tport = 0;
+	cur_master->get_ip_port(mip, mport);
+	target->get_ip_port(tip, tport);
+
+	if (target->send_stmt(SQLCOM_SELECT, CONST_STR_PTR_LEN("select @@server_uuid"),
+			1, monotonic_ms() + health_check_timeout_ms))
+		return -1;
+	Mysql_row row;
+	std::string uuid;
+	if (row.fetch(target->get_result()) && !row.is_null(0))
+		uuid = row.str(0);
+	target->free_mysql_result();
+	if (uuid.empty())
+		return -1;
+
+	std::string stmt = "select group_replication_set_as_primary('" + uuid + "')";
+	if (cur_master->send_stmt(SQLCOM_SELECT, stmt.c_str(), stmt.length(), 1, deadline_ms))
+	{
+		syslog(Logger::WARNING, "Failed to move primary of shard (%s.%s, %u) from node (%s:%d, %u) to node (%s:%d, %u).",
+			   cluster_name.c_str(), name.c_str(), id, mip.c_str(), mport,
+			   cur_master->get_id(), tip.c_str(), tport, target_id);
+		return -1;
+	}
+	cur_master->free_mysql_result();
+
+	syslog(Logger::INFO, "Moved primary of shard (%s.%s, %u) from node (%s:%d, %u) to node (%s:%d, %u) to balance primaries.",
+		   cluster_name.c_str(), name.c_str(), id, mip.c_str(), mport,
+		   cur_master->get_id(), tip.c_str(), tport, target_id);
+	set_master(target);
+	check_mgr_group_view();
+	return 0;
+}
+
+/*
+  Connect the nodes ahead of the shard's maintenance and keep the connections
+  alive, replacing broken ones. Skipped if the shard is busy, e.g. being
+  maintained by a worker thread. Connects are done within
+  health_check_timeout_ms altogether, the rest are left to the next call,
+  so that unreachable nodes don't hold the shard's mtx for NO. of nodes
+  times mysql_connect_timeout.
+*/
+void Shard::keep_conns()
+{
+	if (pthread_mutex_trylock(&mtx))
+		return;
+
+	// start from a different node each time so that a node slow to connect
+	// doesn't always use up the time of those after it.
+	int64_t deadline_ms = monotonic_ms() + health_check_timeout_ms;
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (Thread_manager::do_exit)
+			break;
+		nodes[(keep_conns_start + i) % nodes.size()]->keep_conns(deadline_ms);
+	}
+	keep_conns_start++;
 
-	set_thread_handler(NULL);
+	pthread_mutex_unlock(&mtx);
+}
+
+/*
+  Append the nodes' open connections not in use, skipped if the shard is busy.
+*/
+void Shard::get_open_conns(std::vector<Shard_conn_ref> &conns)
+{
+	if (pthread_mutex_trylock(&mtx))
+		return;
+
+	for (auto &node:nodes)
+		node->get_open_conns(conns);
+
+	pthread_mutex_unlock(&mtx);
 }
 
 bool Shard::set_thread_handler(Thread *h, bool force)
 {
-	bool hdlr_assigned = false;
-	if (!h ||
-		(thrd_hdlr_assigned.compare_exchange_strong(hdlr_assigned, true) &&
-		 !hdlr_assigned))
 	{
 		Scopped_mutex sm(mtx);
 		if ((h && !m_thrd_hdlr && (
@@ -2576,22 +3909,22 @@ bool Shard::set_thread_handler(Thread *h, bool force)
 */
 				force ||
 #endif
-			 (time(NULL) - last_time_check >= check_shard_interval))) ||
+			 (time(NULL) - sched->last_check.load() >= check_shard_interval))) ||
 			(!h && m_thrd_hdlr))
 		{
 			m_thrd_hdlr = h;
-			if (!h) // released after handled
+			if (h)
 			{
-				last_time_check = time(NULL);
-				thrd_hdlr_assigned.store(false);
-			}
-			else
 				m_thrd_hdlr->set_shard(this);
-			return true;
+				return true;
+			}
+			sched->last_check.store(time(NULL)); // released after handled
 		}
-
-		if (!m_thrd_hdlr)
-			thrd_hdlr_assigned.store(false);
+		else if (!h)
+			return false;
 	}
-	return false;
+
+	// released after mtx, the shard may be deleted once released.
+	release();
+	return !h;
 }
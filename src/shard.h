@@ -12,6 +12,8 @@
 #include "shard.h"
 #include "log.h"
 #include "machine_info.h"
+#include "gtid_set.h"
+#include "slab.h"
 
 #include <atomic>
 #include <set>
@@ -33,6 +35,20 @@ extern int64_t meta_svr_port;
 extern int64_t stmt_retries;
 extern int64_t stmt_retry_interval_ms;
 extern int64_t commit_log_retention_hours;
+extern int64_t meta_conn_pool_size;
+extern int64_t shard_conn_keepalive_interval;
+extern int64_t shard_conn_idle_timeout;
+extern int64_t max_shard_conns;
+extern int64_t share_shard_conns;
+extern std::atomic<int64_t> num_shard_conns;
+extern int64_t node_breaker_threshold;
+extern int64_t node_probe_min_backoff_ms;
+extern int64_t node_probe_max_backoff_ms;
+extern int64_t health_check_timeout_ms;
+extern int64_t mgr_progress_refresh_interval;
+extern int64_t mgr_lag_sample_interval;
+extern int64_t mgr_lag_history;
+extern int64_t cluster_lease_timeout;
 
 extern std::string meta_svr_ip;
 extern std::string meta_svr_user;
@@ -43,6 +59,76 @@ class Shard;
 class Shard_node;
 class Computer_node;
 class KunlunCluster;
+class MetadataShard;
+class Pooled_meta_conn;
+
+/*
+  Scheduling state of a shard, read by worker threads to find a shard due
+  for maintenance. Kept apart from the Shard object in a Slab of its own, so
+  that a scan of all shards reads only these small records which are
+  contiguous, and only touches the Shard objects due.
+*/
+struct Shard_sched
+{
+	std::atomic<bool> assigned; // a worker thread is (being) assigned to the shard
+	std::atomic<bool> schedulable; // a storage shard added into its cluster
+	std::atomic<uint> cluster_id;
+	std::atomic<time_t> last_check; // time() the shard was last handled
+	Shard *shard;
+
+	explicit Shard_sched(Shard *s) :
+		assigned(false), schedulable(false), cluster_id(0), last_check(0), shard(s)
+	{}
+};
+
+extern Slab<Shard_sched> shard_sched_slab;
+
+/*
+  MGR replication lag of a shard node at a time, as the transactions its
+  group_replication_applier channel received but not yet applied.
+*/
+struct Mgr_lag_sample
+{
+	time_t time;
+	uint64_t applied; // NO. of txns in gtid_executed
+	uint64_t received; // NO. of txns in the channel's RECEIVED_TRANSACTION_SET
+	uint64_t lag; // NO. of received txns not applied
+	uint64_t apply_queue; // COUNT_TRANSACTIONS_REMOTE_IN_APPLIER_QUEUE
+};
+
+/*
+  Ring buffer of a shard node's latest mgr_lag_history lag samples. Written
+  by the worker thread maintaining the shard and read by API threads, so
+  it's guarded by its own mutex rather than the shard's, held for long.
+*/
+class Mgr_lag_series
+{
+	std::vector<Mgr_lag_sample> ring;
+	size_t next; // slot of the next sample
+	size_t count;
+	mutable pthread_mutex_t mtx;
+public:
+	Mgr_lag_series() : next(0), count(0) { pthread_mutex_init(&mtx, NULL); }
+	~Mgr_lag_series() { pthread_mutex_destroy(&mtx); }
+
+	void add(const Mgr_lag_sample &sample);
+	// copy the samples, oldest first.
+	void get(std::vector<Mgr_lag_sample> &samples) const;
+	// mean lag of the samples, 0 if none.
+	double mean_lag() const;
+};
+
+/*
+  An open connection of a shard node, as a candidate to be closed when
+  more than max_shard_conns connections are open.
+*/
+struct Shard_conn_ref
+{
+	time_t last_used;
+	Shard *shard;
+	Shard_node *node;
+	bool stats; // stats_conn or mysql_conn
+};
 
 class MYSQL_CONN
 {
@@ -56,19 +142,22 @@ private:
     int nwarnings;
 	MYSQL conn;
 	Shard_node *owner;
+	time_t last_used; // when the last stmt was sent or connected
 	std::set<int> ignore_errs;
 	bool mysql_get_next_result();
 	int handle_mysql_error(const char *stmt_ptr = NULL, size_t stmt_len = 0);
 	bool handle_mysql_result();
 	void close_conn();
 	friend class Shard_node;
+	friend class Pooled_meta_conn;
 	void free_mysql_result();
 	int verify_version();
+	int keep_alive(int64_t deadline_ms);
 public:
 	MYSQL_CONN(const char * ip_, int port_, const char * user_,
 		const char * pwd_, Shard_node *owner_):
 		connected(false),sqlcmd(SQLCOM_END),
-		port(port_), ip(ip_), user(user_), pwd(pwd_), owner(owner_)
+		port(port_), ip(ip_), user(user_), pwd(pwd_), owner(owner_), last_used(0)
 	{
 		result = NULL;
 		nrows_affected = 0;
@@ -82,7 +171,7 @@ public:
 
 	Shard_node *get_owner() { return owner; }
 
-	int connect();
+	int connect(int64_t deadline_ms = 0);
 };
 
 class Shard_node
@@ -105,10 +194,38 @@ private:
 	Group_member_status mgr_status;
 	friend class MYSQL_CONN;
 	uint id;
-	uint64_t latest_mgr_pos;
+	uint64_t latest_mgr_pos; // NO. of txns in gtid_executed
+	Gtid_set gtid_executed; // as of last fetch_mgr_progress()
+	Mgr_lag_series lag_series;
 	Shard *owner;
 	MYSQL_CONN mysql_conn;
+	/*
+	  Used only by the storage sync thread to collect table stats, so that
+	  stats queries never wait for or block shard maintenance on mysql_conn.
+	  If share_shard_conns is set, mysql_conn is used instead and the
+	  storage sync thread must hold the shard's mtx.
+	*/
+	MYSQL_CONN stats_conn;
+
+	MYSQL_CONN &get_stats_conn() { return share_shard_conns ? mysql_conn : stats_conn; }
+
+	/*
+	  Circuit breaker of the node. It's opened after node_breaker_threshold
+	  consecutive failures to connect, then send_stmt() fails fast without
+	  touching the node. The connection keeper probes the node with
+	  exponential backoff and jitter, and closes the breaker once connected.
+	*/
+	std::atomic<bool> breaker_open;
+	std::atomic<int> nconnect_fails; // consecutive failures to connect
+	std::atomic<int64_t> probe_backoff_ms;
+	std::atomic<int64_t> next_probe_ms; // monotonic ms of next probe
+
+	void connect_failed();
+	void probe_down_node(int64_t deadline_ms);
 
+	bool send_stmt(MYSQL_CONN &conn, enum_sql_command sqlcom_,
+		const char *stmt, size_t len, int nretries, int64_t deadline_ms = 0);
+	friend class Pooled_meta_conn;
 public:
 	void get_ip_port(std::string&ip, int&port) const
 	{
@@ -132,10 +249,16 @@ public:
 	uint get_id() const { return id; }
 	void set_id(uint id) { this->id = id; }
 
+	// Shard_node objects are stored in a Slab, see shard_node_slab.
+	static void *operator new(size_t sz);
+	static void operator delete(void *p);
+
 	Shard_node(uint id_, Shard *owner_, const char * ip_, int port_,
 		const char * user_, const char * pwd_):
 		_is_master(false), id(id_), latest_mgr_pos(0), owner(owner_),
-		mysql_conn(ip_, port_, user_, pwd_, this)
+		mysql_conn(ip_, port_, user_, pwd_, this),
+		stats_conn(ip_, port_, user_, pwd_, this),
+		breaker_open(false), nconnect_fails(0), probe_backoff_ms(0), next_probe_ms(0)
 	{
 		Assert(owner && ip_ && user_ && pwd_);
 		Assert(port_ > 0);
@@ -144,12 +267,26 @@ public:
 	bool update_conn_params(const char * ip_, int port_, const char * user_,
 		const char * pwd_);
 	int check_mgr_state();
-	bool send_stmt(enum_sql_command sqlcom_, const char *stmt, size_t len, int nretries = 1);
+	/*
+	  deadline_ms is the monotonic_ms() by which the stmt must be done,
+	  including all connects and retries, 0 for no deadline.
+	*/
+	bool send_stmt(enum_sql_command sqlcom_, const char *stmt, size_t len,
+		int nretries = 1, int64_t deadline_ms = 0);
 	bool send_stmt(enum_sql_command sqlcom_, const std::string &stmt, int nretries = 1);
 	int connect();
+	void keep_conns(int64_t deadline_ms);
+	bool is_known_down() const { return breaker_open.load(); }
+	void get_open_conns(std::vector<Shard_conn_ref> &conns);
+	bool close_idle_conn(bool stats, time_t last_used);
 
 	void free_mysql_result() { mysql_conn.free_mysql_result(); }
 
+	bool send_stats_stmt(enum_sql_command sqlcom_, const char *stmt, size_t len, int nretries = 1);
+	bool send_stats_stmt(enum_sql_command sqlcom_, const std::string &stmt, int nretries = 1);
+	MYSQL_RES *get_stats_result() { return get_stats_conn().result; }
+	void free_stats_result() { get_stats_conn().free_mysql_result(); }
+
 	bool matches_ip_port(const std::string &ip, int port) const
 	{
 		return mysql_conn.ip == ip && mysql_conn.port == port;
@@ -164,10 +301,17 @@ public:
 	MYSQL_RES *get_result() { return mysql_conn.result; }
 	
 	bool fetch_mgr_progress();
+	bool sample_mgr_lag();
+	const Mgr_lag_series &get_lag_series() const { return lag_series; }
 	int get_mgr_master_ip_port(std::string&ip, int&port);
 	
 	uint64_t get_latest_mgr_pos() const { return latest_mgr_pos; }
-	void close_conn() { mysql_conn.close_conn(); }
+	const Gtid_set &get_gtid_executed() const { return gtid_executed; }
+	void close_conn()
+	{
+		mysql_conn.close_conn();
+		stats_conn.close_conn();
+	}
 };
 
 
@@ -183,19 +327,29 @@ public:
 	enum Shard_type {NONE, STORAGE, METADATA};
 	enum HAVL_mode {HA_no_rep, HA_mgr, HA_rbr};
 protected:
-	std::atomic<bool> thrd_hdlr_assigned;
+	Shard_sched *sched;
 	Shard_node *cur_master;
 	Shard_type shard_type;
 	HAVL_mode ha_mode;
 	uint id;
 	uint cluster_id; // cluster identifier
+	KunlunCluster *cluster; // NULL for the meta shard
+	// primary node last pushed to all the cluster's computer nodes, 0 if none
+	uint pushed_master_id;
 	/*
 	  Starting a node as master may not succeed in one shot, and we must start
 	  exactly the same one if we have to do it again after a failure attempt
 	  otherwise we could cause a brainsplit.
 	*/
 	uint pending_master_node_id;
-	time_t last_time_check;
+	/*
+	  IDs of nodes ranked by their MGR progress as of candidate_rank_time,
+	  most advanced first, to elect a primary when all nodes are down.
+	*/
+	std::vector<uint> candidate_rank;
+	time_t candidate_rank_time;
+	time_t lag_sample_time; // last time nodes' lag was sampled
+	size_t keep_conns_start; // node keep_conns() starts from, rotated per call
 	std::string name;
 	std::string cluster_name;
 	friend class System;
@@ -220,6 +374,13 @@ public:
 	}
 
 	Shard_node *get_node_by_id(uint id);
+	void restore_pending_master(uint node_id);
+
+	uint get_pending_master() const
+	{
+		Scopped_mutex sm(mtx);
+		return pending_master_node_id;
+	}
 protected:
 	/*
 	  A shard's all nodes are always handled in the same thread.
@@ -282,10 +443,29 @@ protected:
 	Prep_recvrd_txns_t prep_recvrd_txns;
 
 public:
+	/*
+	  Storage shards are stored in a Slab, see shard_slab. The metadata shard
+	  is a member of System and isn't.
+	*/
+	static void *operator new(size_t sz);
+	static void operator delete(void *p, size_t sz);
+
+	/*
+	  A thread claims a storage shard via the handle of its scheduling state
+	  before touching it, without System::mtx, and a shard is deleted only
+	  after its deleter claims it, see retire().
+	*/
+	Slab_handle get_handle() const;
+	static Shard *claim(const Slab_handle &h);
+	void release();
+	void retire();
+
 	Shard(uint id_, const std::string &name_, Shard_type type, HAVL_mode mode) :
-		thrd_hdlr_assigned(false), cur_master(NULL), shard_type(type), ha_mode(mode),
-		id(id_), cluster_id(0), pending_master_node_id(0), last_time_check(0),
-		name(name_), m_thrd_hdlr(NULL), innodb_page_size(0)
+		sched(shard_sched_slab.create(this)), cur_master(NULL), shard_type(type), ha_mode(mode),
+		id(id_), cluster_id(0), cluster(NULL), pushed_master_id(0),
+		pending_master_node_id(0),
+		candidate_rank_time(0), lag_sample_time(0), keep_conns_start(0), name(name_), m_thrd_hdlr(NULL),
+		innodb_page_size(0)
 	{
 		pthread_mutexattr_init(&mtx_attr);
 		pthread_mutexattr_settype(&mtx_attr, PTHREAD_MUTEX_RECURSIVE);
@@ -295,6 +475,7 @@ public:
 
 	~Shard()
 	{
+		shard_sched_slab.destroy(sched);
 		for (auto &i:nodes)
 			delete i;
 		pthread_mutex_destroy(&mtx);
@@ -324,6 +505,13 @@ public:
 		txn_end_decisions.insert(txn_end_decisions.end(), ted.begin(), ted.end());
 	}
 
+	// copy decisions not yet carried out, without taking them.
+	void get_txn_end_decisions(Txn_end_decisions_t&ted) const
+	{
+		Scopped_mutex sm(mtx_txninfo);
+		ted = txn_end_decisions;
+	}
+
 	Thread *get_thread_handler()
 	{
 		Scopped_mutex sm(mtx);
@@ -332,19 +520,21 @@ public:
 
 	// called by worker threads to maintain shard working state.
 	void maintenance();
+	void keep_conns();
+	void get_open_conns(std::vector<Shard_conn_ref> &conns);
 
 	/*
-	  Set h to be the thread handler, or remove current thread handler(h is 0).
+	  Set h to be the thread handler of the shard claimed by claim(), or
+	  remove current thread handler(h is 0) and release the shard.
 	  if force is true, ignore shard's last_time_check and always assign it
-	  to the thread.
+	  to the thread. The shard is released if h isn't set.
 	  @retval true if set OK; false if not set.
 	*/
 	bool set_thread_handler(Thread *h, bool force = false);
 
 	time_t get_last_time_check() const
 	{
-		Scopped_mutex sm(mtx);
-		return last_time_check;
+		return sched->last_check.load();
 	}
 
 	std::vector<Shard_node*>&get_nodes()
@@ -377,6 +567,15 @@ public:
 		Scopped_mutex sm(mtx);
 		cluster_name = name;
 		cluster_id = cid;
+		sched->cluster_id.store(cid);
+	}
+
+	// a storage shard is scheduled for maintenance once it's in a cluster.
+	void set_cluster(KunlunCluster *c)
+	{
+		Scopped_mutex sm(mtx);
+		cluster = c;
+		sched->schedulable.store(c != NULL && shard_type == STORAGE);
 	}
 
 	bool contains_node(const std::string&ip, int port) const
@@ -455,18 +654,25 @@ public:
 	}
 
 	void remove_node(uint id)
+	{
+		delete detach_node(id);
+	}
+
+	// Remove node id from the shard without deleting it, NULL if not found.
+	Shard_node *detach_node(uint id)
 	{
 		Scopped_mutex sm(mtx);
 		for (auto i = nodes.begin(); i != nodes.end(); ++i)
 		{
 			if ((*i)->get_id() == id)
 			{
-				if (*i == cur_master) cur_master = NULL;
-				delete *i;
+				Shard_node *node = *i;
+				if (node == cur_master) cur_master = NULL;
 				nodes.erase(i);
-				break;
+				return node;
 			}
 		}
+		return NULL;
 	}
 
 	/*
@@ -511,9 +717,22 @@ public:
 	}
 
 	int check_mgr_cluster();
+	void set_pending_master(uint node_id);
+	bool check_mgr_group_view();
+	void push_master();
+	bool get_primary_layout(std::string &master_ip,
+		std::vector<std::pair<uint, std::string> > &secondaries);
+	bool has_in_doubt_txns();
+	int move_primary(uint target_id, int64_t deadline_ms);
+	void refresh_candidate_rank();
+	void sample_mgr_lag();
+	bool rank_candidates(std::vector<Shard_node *> &cands);
+	void clear_pending_master();
+	Shard_node *pick_ranked_candidate(const std::vector<std::pair<Shard_node *,
+		Shard_node::Group_member_status> > &down_reachables);
 	int end_recovered_prepared_txns();
 	int get_xa_prepared();
-	uint get_innodb_page_size();
+	uint get_innodb_page_size(Shard_node *master_sn);
 };
 
 
@@ -542,13 +761,46 @@ public:
 	// Keep this same as in computing node impl(METADATA_SHARDID).
 	const static uint32_t METADATA_SHARD_ID = 0xFFFFFFFF;
 
-	MetadataShard() : Shard(METADATA_SHARD_ID, "MetadataShard", METADATA, HA_mgr)
+	MetadataShard() : Shard(METADATA_SHARD_ID, "MetadataShard", METADATA, HA_mgr),
+		pool_master(NULL), pool_nconns(0), pool_gen(0), lease_tables_created(false),
+		states_tables_created(false)
 	{
 		// Need to assign the pair for consistent generic processing.
 		cluster_id = 0xffffffff;
 		cluster_name = "MetadataShardVirtualCluster";
+		pthread_mutex_init(&pool_mtx, NULL);
+		pthread_cond_init(&pool_cond, NULL);
 	}
 
+	~MetadataShard();
+private:
+	/*
+	  Pool of connections to cur_master, used via Pooled_meta_conn by the
+	  metadata operations which don't touch this shard's topology, so that
+	  they run concurrently without holding mtx. At most meta_conn_pool_size
+	  connections are in use, and the pool is rebuilt when the master changes.
+	*/
+	pthread_mutex_t pool_mtx;
+	pthread_cond_t pool_cond;
+	Shard_node *pool_master; // the master pooled connections connect to
+	std::vector<MYSQL_CONN *> pool_idle;
+	uint pool_nconns; // NO. of connections to pool_master, idle or in use
+	uint pool_gen; // incremented when the pool is rebuilt
+	std::map<Shard_node *, uint> pool_inuse; // NO. of connections in use by node
+	friend class Pooled_meta_conn;
+
+	bool lease_tables_created; // only accessed by the main thread
+	std::atomic<bool> states_tables_created;
+
+	MYSQL_CONN *checkout_conn(Shard_node *&master, uint &gen);
+	void return_conn(MYSQL_CONN *conn, Shard_node *master, uint gen, bool broken);
+	void release_pooled_conns(Shard_node *sn);
+	void wait_pooled_conns(Shard_node *sn);
+	int refresh_meta_shard_nodes(Shard_node *sn, bool is_master,
+		const char *master_ip, int master_port, std::vector<Shard_node *> &removed);
+public:
+
+	int create_states_tables(Pooled_meta_conn &conn);
 	int compute_txn_decisions(std::map<uint, cluster_txninfo> &cluster_txns);
 
 	int fetch_meta_shard_nodes(Shard_node *sn, bool is_master,
@@ -569,9 +821,43 @@ public:
 	int get_storage_instance_port(Machine* machine);
 	int get_computer_instance_port(Machine* machine);
 	int update_instance_status(Tpye_Ip_Port &ip_port, std::string &status, int &type);
+	int update_comp_node_status(uint comp_id, bool alive);
 	int add_shard_nodes(std::string &cluster_name, std::string &shard_name, std::vector<Tpye_Ip_Port_User_Pwd> vec_ip_port_user_pwd);
 	int get_backup_info_from_metadata(std::string &cluster_name, std::string &timestamp, Tpye_cluster_info &cluster_info);
 	bool check_machine_hostaddr(std::string &hostaddr);
+	int renew_instance_lease(const std::string &instance, std::vector<std::string> &live_instances);
+	int renew_cluster_leases(const std::string &instance, const std::vector<uint> &wanted,
+		const std::vector<uint> &released, std::set<uint> &owned);
+	int save_pending_master(uint shard_id, uint node_id);
+	int load_pending_masters(std::map<uint, uint> &pending_masters);
+	int get_machine_racks(std::map<std::string, std::string> &racks);
+};
+
+/*
+  A connection checked out from the metadata shard's connection pool,
+  returned to the pool when this object is destructed. Use it like
+  Shard_node's mysql_conn, without holding the metadata shard's mtx.
+*/
+class Pooled_meta_conn
+{
+private:
+	MetadataShard &meta_shard;
+	Shard_node *master;
+	MYSQL_CONN *conn;
+	uint gen;
+	bool broken;
+public:
+	Pooled_meta_conn(MetadataShard &meta_shard_);
+	~Pooled_meta_conn();
+
+	bool valid() const { return conn != NULL; }
+	bool send_stmt(enum_sql_command sqlcom_, const char *stmt, size_t len, int nretries = 1);
+	bool send_stmt(enum_sql_command sqlcom_, const std::string &stmt, int nretries = 1)
+	{
+		return send_stmt(sqlcom_, stmt.c_str(), stmt.length(), nretries);
+	}
+	MYSQL_RES *get_result() { return conn->result; }
+	void free_mysql_result() { conn->free_mysql_result(); }
 };
 
 #endif // !SHARD_H
@@ -0,0 +1,227 @@
+/*
+   Copyright (c) 2019-2021 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef SLAB_H
+#define SLAB_H
+#include "sys_config.h"
+#include "global.h"
+
+#include <atomic>
+#include <new>
+#include <utility>
+#include <stddef.h>
+
+/*
+  Handle of an object in a Slab: its slot index and the slot's generation
+  when the object was allocated. The slot may be reused by another object
+  after the object is freed, and then the handle is stale because the
+  generation differs.
+*/
+struct Slab_handle
+{
+	uint32_t index;
+	uint32_t gen; // odd for a live object, 0 for a null handle
+
+	Slab_handle() : index(0), gen(0) {}
+	Slab_handle(uint32_t i, uint32_t g) : index(i), gen(g) {}
+	bool is_null() const { return gen == 0; }
+	bool operator==(const Slab_handle &h) const { return index == h.index && gen == h.gen; }
+	bool operator!=(const Slab_handle &h) const { return !(*this == h); }
+};
+
+/*
+  Storage of objects of type T in chunks of CHUNK_SLOTS contiguous slots, so
+  that objects of one type are close to each other rather than scattered
+  over the heap, and a scan of all of them is sequential. Chunks are never
+  moved or freed while the Slab lives, so an object's address is stable
+  and a slot may be read even after its object is freed, and a scan needs
+  no lock. Freed slots are reused, most recently freed first.
+
+  A slot's generation is odd while it holds an object and even while it's
+  free, it's bumped on every allocation and free.
+*/
+template <typename T, size_t CHUNK_SLOTS = 256, size_t MAX_CHUNKS = 4096>
+class Slab
+{
+	struct Slot
+	{
+		std::atomic<uint32_t> gen;
+		uint32_t index;
+		uint32_t next_free; // index+1 of next free slot, 0 for none
+		alignas(T) unsigned char obj[sizeof(T)];
+	};
+
+	std::atomic<Slot *> chunks[MAX_CHUNKS];
+	std::atomic<uint32_t> nslots; // NO. of slots ever used
+	uint32_t free_head; // index+1 of first free slot, 0 for none
+	pthread_mutex_t mtx; // serializes alloc&free
+
+	Slot *slot_at(uint32_t idx) const
+	{
+		Slot *chunk = chunks[idx / CHUNK_SLOTS].load(std::memory_order_acquire);
+		return chunk + idx % CHUNK_SLOTS;
+	}
+
+	static Slot *slot_of(const void *p)
+	{
+		return (Slot *)((char *)p - offsetof(Slot, obj));
+	}
+
+	/*
+	  Take a free slot, its generation is still even.
+	*/
+	Slot *take_slot()
+	{
+		Scopped_mutex sm(mtx);
+		uint32_t idx;
+		Slot *slot;
+
+		if (free_head != 0)
+		{
+			idx = free_head - 1;
+			slot = slot_at(idx);
+			free_head = slot->next_free;
+		}
+		else
+		{
+			idx = nslots.load(std::memory_order_relaxed);
+			if (idx / CHUNK_SLOTS >= MAX_CHUNKS)
+				throw std::bad_alloc();
+			if (idx % CHUNK_SLOTS == 0)
+			{
+				Slot *chunk = new Slot[CHUNK_SLOTS];
+				for (size_t i = 0; i < CHUNK_SLOTS; i++)
+				{
+					chunk[i].gen.store(0, std::memory_order_relaxed);
+					chunk[i].index = idx + i;
+				}
+				chunks[idx / CHUNK_SLOTS].store(chunk, std::memory_order_release);
+			}
+			slot = slot_at(idx);
+			nslots.store(idx + 1, std::memory_order_release);
+		}
+
+		slot->next_free = 0;
+		return slot;
+	}
+
+	void return_slot(Slot *slot)
+	{
+		Scopped_mutex sm(mtx);
+		slot->next_free = free_head;
+		free_head = slot->index + 1;
+	}
+
+	Slab(const Slab &);
+	Slab &operator=(const Slab &);
+public:
+	Slab() : nslots(0), free_head(0)
+	{
+		for (auto &c:chunks)
+			c.store(NULL, std::memory_order_relaxed);
+		pthread_mutex_init(&mtx, NULL);
+	}
+
+	~Slab()
+	{
+		for (auto &c:chunks)
+			delete[] c.load(std::memory_order_relaxed);
+		pthread_mutex_destroy(&mtx);
+	}
+
+	/*
+	  Get raw memory of a free slot for a T object to be constructed by the
+	  caller, as T's operator new does. The object is live once allocated.
+	*/
+	void *alloc()
+	{
+		Slot *slot = take_slot();
+		slot->gen.fetch_add(1, std::memory_order_acq_rel);
+		return slot->obj;
+	}
+
+	// Free the slot of an object destructed by the caller, as T's operator delete does.
+	void free(void *p)
+	{
+		if (!p)
+			return;
+		Slot *slot = slot_of(p);
+		Assert(slot->gen.load(std::memory_order_relaxed) % 2 == 1);
+		slot->gen.fetch_add(1, std::memory_order_acq_rel);
+		return_slot(slot);
+	}
+
+	/*
+	  Construct a T object in a free slot, it's live only after it's
+	  constructed, so for_each() never sees it half constructed.
+	*/
+	template <typename... Args>
+	T *create(Args&&... args)
+	{
+		Slot *slot = take_slot();
+		T *obj = new (slot->obj) T(std::forward<Args>(args)...);
+		slot->gen.fetch_add(1, std::memory_order_acq_rel);
+		return obj;
+	}
+
+	// Destruct an object made by create(), it's no longer live before that.
+	void destroy(T *obj)
+	{
+		if (!obj)
+			return;
+		Slot *slot = slot_of(obj);
+		Assert(slot->gen.load(std::memory_order_relaxed) % 2 == 1);
+		slot->gen.fetch_add(1, std::memory_order_acq_rel);
+		obj->~T();
+		return_slot(slot);
+	}
+
+	Slab_handle handle_of(const T *p) const
+	{
+		Slot *slot = slot_of(p);
+		return Slab_handle(slot->index, slot->gen.load(std::memory_order_acquire));
+	}
+
+	/*
+	  @retval the object of handle h, NULL if it's freed. The caller must
+	  make sure the object is not freed while it's used.
+	*/
+	T *get(const Slab_handle &h) const
+	{
+		if (h.is_null() || h.index >= nslots.load(std::memory_order_acquire))
+			return NULL;
+		Slot *slot = slot_at(h.index);
+		if (slot->gen.load(std::memory_order_acquire) != h.gen)
+			return NULL;
+		return (T *)slot->obj;
+	}
+
+	// NO. of slots ever used, objects' indexes are less than it.
+	uint32_t capacity() const { return nslots.load(std::memory_order_acquire); }
+
+	/*
+	  Visit each live object in slot order, fn(T*, Slab_handle) returns
+	  false to stop. Objects may be created or destroyed concurrently, fn
+	  must check the handle again if it needs the object live. Objects of
+	  alloc() are live while being constructed and destructed, so only
+	  objects of create() can be visited concurrently.
+	*/
+	template <typename Fn>
+	void for_each(Fn fn) const
+	{
+		uint32_t n = nslots.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < n; i++)
+		{
+			Slot *slot = slot_at(i);
+			uint32_t gen = slot->gen.load(std::memory_order_acquire);
+			if (gen % 2 == 1 && !fn((T *)slot->obj, Slab_handle(i, gen)))
+				break;
+		}
+	}
+};
+
+#endif // !SLAB_H
@@ -16,12 +16,38 @@
 #include "http_server.h"
 #include "http_client.h"
 #include "hdfs_client.h"
+#include "mysql_row.h"
+#include "os.h"
+#include "topo_snapshot.h"
 #include <utility>
+#include <algorithm>
+#include <unistd.h>
+#include <ctype.h>
 
 System *System::m_global_instance = NULL;
 extern std::string log_file_path;
 extern int64_t storage_instance_port_start;
 extern int64_t computer_instance_port_start;
+extern int64_t cluster_mgr_http_port;
+
+int64_t enable_cluster_partition = 0;
+int64_t enable_warm_standby = 0;
+std::string cluster_mgr_instance_name;
+int64_t cluster_lease_timeout = 30;
+std::string topology_snapshot_path;
+int64_t topology_snapshot_interval = 60;
+int64_t enable_primary_balance = 0;
+int64_t primary_balance_interval = 300;
+int64_t primary_balance_max_moves = 1;
+int64_t primary_move_timeout_ms = 60000;
+int64_t comp_node_probe_interval_ms = 0;
+int64_t comp_node_probe_timeout_ms = 1000;
+int64_t comp_node_down_probes = 2;
+
+// points of each cluster_mgr instance on the consistent hash ring
+static const int CLUSTER_RING_VNODES = 64;
+// lease id of the leader in warm standby mode, no cluster has this id
+static const uint LEADER_LEASE_ID = 0;
 
 System::~System()
 {
@@ -97,22 +123,17 @@ int System::setup_metadata_shard()
 		return ret;
 
 	MYSQL_RES *result = sn->get_result();
-	MYSQL_ROW row;
-	char *endptr = NULL;
+	Mysql_row row;
 	Shard_node *master_sn = NULL;
 
-	while ((row = mysql_fetch_row(result)))
+	while (row.fetch(result))
 	{
-		unsigned long *lengths = mysql_fetch_lengths(result);
-		int port = strtol(row[1], &endptr, 10);
-		Assert(endptr == NULL || *endptr == '\0');
+		int port = row.get_or(1, 0);
 
 		/*
 		  meta_svr_ip:meta_svr_port is the current master node,
 		*/
-		if (strncmp(row[0], meta_svr_ip.c_str(),
-			std::min(meta_svr_ip.length(), lengths[0])) == 0 &&
-			port == meta_svr_port)
+		if (row.str(0) == meta_svr_ip && port == meta_svr_port)
 		{
 			is_master = true;
 			master_sn = sn;
@@ -122,16 +143,15 @@ int System::setup_metadata_shard()
 		}
 		else
 		{
-			master_ip = row[0];
-			master_port = strtol(row[1], &endptr, 10);
-			Assert(endptr == NULL || *endptr == '\0');
+			master_ip = row.str(0);
+			master_port = port;
 		}
 
 		nrows++;
 		if (nrows > 1)
 		{
 			syslog(Logger::ERROR, "Multiple(%d) primary nodes found: %s:%d.",
-				   row[0], port);
+				   nrows, row.c_str(0), port);
 		}
 	}
 	sn->free_mysql_result();
@@ -157,9 +177,9 @@ int System::setup_metadata_shard()
 				return ret;
 
 			result = sn->get_result();
-			if ((row = mysql_fetch_row(result)))
+			if (row.fetch(result))
 			{
-				if(row[0] != NULL && strcmp(row[0],"1") == 0)
+				if(row.str(0) == "1")
 				{
 					meta_shard.set_mode(Shard::HAVL_mode::HA_no_rep);
 					syslog(Logger::INFO, "set meta shard as HA_no_rep");
@@ -199,8 +219,142 @@ int System::setup_metadata_shard()
 */
 int System::refresh_shards_from_metadata_server()
 {
+	std::vector<Shard *> shards;
+	std::vector<KunlunCluster *> clusters;
+	int ret = 0;
+	{
+		Scopped_mutex sm(mtx);
+		ret = meta_shard.refresh_shards(kl_clusters);
+		if (ret == 0 && !unverified_shards.empty())
+			verify_snapshot_shards(shards, clusters);
+
+		// restored on taking clusters over otherwise, see refresh_cluster_ownership().
+		if (ret == 0 && !shard_states_restored &&
+			!enable_cluster_partition && !enable_warm_standby)
+			shard_states_restored = (restore_shard_states(std::set<uint>()) == 0);
+	}
+
+	delete_detached(shards, clusters);
+	return ret;
+}
+
+/*
+  Delete the shards and clusters detached from kl_clusters, and the shards
+  of the clusters. Called without mtx, so that waiting for the threads
+  working on the shards doesn't block others, see Shard::retire().
+*/
+void System::delete_detached(std::vector<Shard *> &shards,
+	std::vector<KunlunCluster *> &clusters)
+{
+	for (auto &shard:shards)
+	{
+		shard->retire();
+		delete shard;
+	}
+	for (auto &cluster:clusters)
+	{
+		for (auto &shard:cluster->storage_shards)
+			shard->retire();
+		delete cluster;
+	}
+	shards.clear();
+	clusters.clear();
+}
+
+/*
+  Called with mtx held after shards are refreshed from the metadata shard,
+  which removed the nodes not registered any more, so a shard loaded from
+  the topology snapshot and left without nodes is no longer registered.
+  Such shards, and the clusters they leave empty, are detached into shards
+  and clusters, to be deleted by delete_detached() after mtx is released.
+*/
+void System::verify_snapshot_shards(std::vector<Shard *> &shards,
+	std::vector<KunlunCluster *> &clusters)
+{
+	for (auto cluster_it = kl_clusters.begin(); cluster_it != kl_clusters.end(); )
+	{
+		KunlunCluster *cluster = *cluster_it;
+		bool removed = false;
+
+		for (auto shard_it = cluster->storage_shards.begin();
+			 shard_it != cluster->storage_shards.end(); )
+		{
+			Shard *shard = *shard_it;
+			uint shard_id = shard->get_id();
+			if (unverified_shards.find(shard_id) == unverified_shards.end())
+			{
+				++shard_it;
+				continue;
+			}
+			if (shard->get_nodes().size() > 0)
+			{
+				unverified_shards.erase(shard_id);
+				++shard_it;
+				continue;
+			}
+
+			syslog(Logger::INFO, "Removed shard(%s.%s, %u) loaded from topology snapshot from protection since it's not in cluster registration anymore.",
+				shard->get_cluster_name().c_str(), shard->get_name().c_str(), shard_id);
+			unverified_shards.erase(shard_id);
+			shards.emplace_back(shard);
+			shard_it = cluster->storage_shards.erase(shard_it);
+			removed = true;
+		}
+
+		if (removed && cluster->storage_shards.empty())
+		{
+			syslog(Logger::INFO, "Removed KunlunCluster(%s.%u) loaded from topology snapshot from protection since it has no shards registered anymore.",
+				cluster->get_name().c_str(), cluster->get_id());
+			clusters.emplace_back(cluster);
+			cluster_it = kl_clusters.erase(cluster_it);
+		}
+		else
+			++cluster_it;
+	}
+
+	if (unverified_shards.empty())
+		syslog(Logger::INFO, "Topology loaded from snapshot is verified against metadata shard.");
+}
+
+/*
+  Load clusters' topology and recovery states from the topology snapshot
+  saved by a previous run, so that shards are worked on before the metadata
+  shard is reachable. Must be called before worker threads are started.
+  @retval 0 if loaded or disabled, 1 if there is no snapshot, -1 if it's invalid.
+*/
+int System::load_topology_snapshot()
+{
+	if (topology_snapshot_path.empty())
+		return 0;
+
 	Scopped_mutex sm(mtx);
-	return meta_shard.refresh_shards(kl_clusters);
+	int ret = Topo_snapshot::load(topology_snapshot_path, kl_clusters);
+	if (ret == 0)
+		for (auto &cluster:kl_clusters)
+			for (auto &shard:cluster->storage_shards)
+				unverified_shards.insert(shard->get_id());
+	return ret;
+}
+
+/*
+  Save clusters' topology and recovery states to the topology snapshot file
+  every topology_snapshot_interval seconds, once the topology is verified
+  against the metadata shard.
+*/
+int System::save_topology_snapshot()
+{
+	if (topology_snapshot_path.empty())
+		return 0;
+
+	time_t now = time(NULL);
+	if (now - last_snapshot_time < topology_snapshot_interval)
+		return 0;
+
+	Scopped_mutex sm(mtx);
+	if (!unverified_shards.empty())
+		return 0;
+	last_snapshot_time = now;
+	return Topo_snapshot::save(topology_snapshot_path, kl_clusters);
 }
 
 /*
@@ -210,6 +364,16 @@ int System::refresh_shards_from_metadata_server()
 */
 int System::refresh_computers_from_metadata_server()
 {
+	/*
+	  Nodes deactivated by probes are still refreshed, see
+	  update_comp_node_status(), only if the states tables are created.
+	*/
+	{
+		Pooled_meta_conn conn(meta_shard);
+		if (!conn.valid() || meta_shard.create_states_tables(conn))
+			syslog(Logger::WARNING, "Failed to create cluster_mgr states tables in metadata shard, computer node status isn't updated by probes.");
+	}
+
 	Scopped_mutex sm(mtx);
 	return meta_shard.refresh_computers(kl_clusters);
 }
@@ -221,18 +385,25 @@ int System::refresh_storages_info_to_computers()
 {
 	Scopped_mutex sm(mtx);
 	for (auto &cluster:kl_clusters)
+	{
+		if(!owns_cluster(cluster->get_id()) || cluster->refresh_catalog_cache(meta_shard))
+			continue;
+		cluster->collect_storage_stats();
 		cluster->refresh_storages_to_computers();
+	}
 	return 0;
 }
 
 /*
-  Connect to storage node, get num_tablets & space_volumn, and update to computer nodes and meta shard.
+  Get num_tablets & space_volumn from the storage stats collected by
+  refresh_storages_info_to_computers(), and update to computer nodes and meta shard.
 */
 int System::refresh_storages_info_to_computers_metashard()
 {
 	Scopped_mutex sm(mtx);
 	for (auto &cluster:kl_clusters)
-		cluster->refresh_storages_to_computers_metashard(meta_shard);
+		if (owns_cluster(cluster->get_id()))
+			cluster->refresh_storages_to_computers_metashard(meta_shard);
 	return 0;
 }
 
@@ -242,10 +413,82 @@ int System::refresh_storages_info_to_computers_metashard()
 int System::truncate_commit_log_from_metadata_server()
 {
 	Scopped_mutex sm(mtx);
-	kl_clusters[0]->truncate_commit_log_from_metadata_server(kl_clusters, meta_shard);
+	if (kl_clusters.size() > 0 && owns_cluster(meta_shard.get_cluster_id()))
+		kl_clusters[0]->truncate_commit_log_from_metadata_server(kl_clusters, meta_shard);
 	return 0;
 }
 
+/*
+  Connect shard nodes ahead of shard maintenance and keep the connections
+  alive. mtx is held only to list the shards, so that connecting to
+  unreachable nodes doesn't block other threads. A shard being worked on
+  by another thread is skipped. A standby instance keeps connections to
+  all shards to take over at once.
+*/
+void System::keep_shard_conns()
+{
+	meta_shard.keep_conns();
+
+	std::vector<Slab_handle> handles;
+	{
+		Scopped_mutex sm(mtx);
+		for (auto &cluster:kl_clusters)
+			if (owns_cluster(cluster->get_id()) || is_standby())
+				for (auto &shard:cluster->storage_shards)
+					handles.emplace_back(shard->get_handle());
+	}
+
+	// without mtx, a shard is claimed so that it's not deleted meanwhile.
+	for (auto &h:handles)
+	{
+		if (Thread_manager::do_exit)
+			break;
+		Shard *shard = Shard::claim(h);
+		if (!shard)
+			continue;
+		shard->keep_conns();
+		shard->release();
+	}
+
+	if (max_shard_conns > 0 && num_shard_conns > max_shard_conns)
+		close_lru_shard_conns();
+}
+
+/*
+  Close the least recently used shard node connections not in use until no
+  more than max_shard_conns are open. Connections needed by maintenance are
+  still made beyond the budget, it is enforced here periodically.
+*/
+void System::close_lru_shard_conns()
+{
+	Scopped_mutex sm(mtx);
+	std::vector<Shard_conn_ref> conns;
+
+	meta_shard.get_open_conns(conns);
+	for (auto &cluster:kl_clusters)
+		for (auto &shard:cluster->storage_shards)
+			shard->get_open_conns(conns);
+
+	std::sort(conns.begin(), conns.end(),
+		[](const Shard_conn_ref &a, const Shard_conn_ref &b) { return a.last_used < b.last_used; });
+
+	int nclosed = 0;
+	for (auto &c:conns)
+	{
+		if (num_shard_conns <= max_shard_conns)
+			break;
+
+		if (pthread_mutex_trylock(&c.shard->mtx))
+			continue;
+		if (c.node->close_idle_conn(c.stats, c.last_used))
+			nclosed++;
+		pthread_mutex_unlock(&c.shard->mtx);
+	}
+
+	syslog(Logger::INFO, "Closed %d least recently used shard node connections, %ld open, budget %ld.",
+		   nclosed, (long)num_shard_conns.load(), (long)max_shard_conns);
+}
+
 /*
   Read config file and initialize config settings;
   Connect to metadata shard and get the storage shards to work on, set up
@@ -261,8 +504,17 @@ int System::create_instance(const std::string&cfg_path)
 		goto end;
 	if ((ret = cfg->process_config_file(cfg_path)))
 		goto end;
+	if (cluster_mgr_instance_name.empty())
+	{
+		char hostname[256] = {0};
+		gethostname(hostname, sizeof(hostname) - 1);
+		cluster_mgr_instance_name = std::string(hostname) + ":" +
+			std::to_string(cluster_mgr_http_port);
+	}
 	if ((ret = Logger::get_instance()->init(log_file_path)) != 0)
 		goto end;
+	// worker threads read kl_clusters without mtx, load it before they start.
+	m_global_instance->load_topology_snapshot();
 	if ((ret = (Thread_manager::get_instance()==NULL)) != 0)
 		goto end;
 	if ((ret = (Machine_info::get_instance()==NULL)) != 0)
@@ -285,44 +537,494 @@ end:
 	return ret;
 }
 
+/*
+  Move MGR shard primaries off the machines holding more of them than
+  others, so that write load spreads over machines again after failovers.
+  A primary is moved to a secondary on the machine holding fewest
+  primaries, on a rack holding no more primaries than the primary's rack,
+  and a move must lessen the skew of machines or racks without worsening
+  the other. At most primary_balance_max_moves primaries are moved per call,
+  called every primary_balance_interval seconds.
+
+  Only shards of clusters this instance works on are counted and moved. A
+  shard is skipped if it's being maintained by a worker thread, or it has
+  in-doubt txns, which must be ended on the primary they're prepared on.
+  @retval NO. of primaries moved.
+*/
+int System::balance_primaries(Thread *thd)
+{
+	std::vector<Slab_handle> handles;
+	{
+		Scopped_mutex sm(mtx);
+		for (auto &cluster:kl_clusters)
+		{
+			if (!owns_cluster(cluster->get_id()))
+				continue;
+			for (auto &shard:cluster->storage_shards)
+				if (shard->get_mode() == Shard::HA_mgr)
+					handles.emplace_back(shard->get_handle());
+		}
+	}
+
+	std::map<std::string, std::string> racks; // hostaddr -> rack_id
+	if (meta_shard.get_machine_racks(racks))
+		syslog(Logger::WARNING, "Failed to get machines' racks, primaries are balanced over machines only.");
+	auto rack_of = [&racks](const std::string &ip) -> const std::string &
+	{
+		static const std::string no_rack;
+		auto itr = racks.find(ip);
+		return itr == racks.end() ? no_rack : itr->second;
+	};
+
+	struct Shard_layout
+	{
+		Slab_handle handle;
+		std::string master_ip;
+		std::vector<std::pair<uint, std::string> > secondaries;
+	};
+	std::vector<Shard_layout> layouts;
+	std::map<std::string, int> machine_load, rack_load; // NO. of primaries
+
+	for (auto &h:handles)
+	{
+		Shard *shard = Shard::claim(h);
+		Shard_layout sl;
+		if (!shard)
+			continue;
+		bool got = shard->get_primary_layout(sl.master_ip, sl.secondaries);
+		shard->release();
+		if (!got)
+			continue;
+		machine_load[sl.master_ip]++;
+		rack_load[rack_of(sl.master_ip)]++;
+		for (auto &sec:sl.secondaries)
+		{
+			machine_load.emplace(sec.second, 0);
+			rack_load.emplace(rack_of(sec.second), 0);
+		}
+		sl.handle = h;
+		layouts.emplace_back(sl);
+	}
+
+	int nmoves = 0;
+	while (nmoves < primary_balance_max_moves && !Thread_manager::do_exit)
+	{
+		// find the move lessening the skew most, racks first.
+		int best = -1, best_rack_gain = 0, best_machine_gain = 0;
+		uint best_target = 0;
+		std::string best_ip;
+
+		for (size_t i = 0; i < layouts.size(); i++)
+		{
+			const std::string &src = layouts[i].master_ip;
+			const std::string &src_rack = rack_of(src);
+			for (auto &sec:layouts[i].secondaries)
+			{
+				const std::string &dst_rack = rack_of(sec.second);
+				int machine_gain = machine_load[src] - machine_load[sec.second] - 1;
+				int rack_gain = (src_rack == dst_rack) ? 0 :
+					rack_load[src_rack] - rack_load[dst_rack] - 1;
+				if (machine_gain < 0 || rack_gain < 0 || machine_gain + rack_gain == 0)
+					continue;
+				if (best < 0 || rack_gain > best_rack_gain ||
+					(rack_gain == best_rack_gain && machine_gain > best_machine_gain))
+				{
+					best = i;
+					best_rack_gain = rack_gain;
+					best_machine_gain = machine_gain;
+					best_target = sec.first;
+					best_ip = sec.second;
+				}
+			}
+		}
+
+		if (best < 0)
+			break;
+
+		Shard_layout sl = layouts[best];
+		layouts.erase(layouts.begin() + best); // tried at most once per call
+		Shard *shard = Shard::claim(sl.handle);
+		if (!shard || !shard->set_thread_handler(thd))
+			continue;
+
+		bool moved = false;
+		if (shard->has_in_doubt_txns())
+			syslog(Logger::INFO, "Primary of shard (%s.%s, %u) is not moved for balance because it has in-doubt txns.",
+				   shard->get_cluster_name().c_str(), shard->get_name().c_str(), shard->get_id());
+		else if (shard->move_primary(best_target, monotonic_ms() + primary_move_timeout_ms) == 0)
+		{
+			moved = true;
+			shard->push_master();
+		}
+		shard->set_thread_handler(NULL);
+
+		if (moved)
+		{
+			machine_load[sl.master_ip]--;
+			rack_load[rack_of(sl.master_ip)]--;
+			machine_load[best_ip]++;
+			rack_load[rack_of(best_ip)]++;
+			nmoves++;
+		}
+	}
+
+	return nmoves;
+}
+
 /*
   Find a proper shard for worker thread 'thd' to work on.
   return true if one is found and associated with 'thd', false otherwise.
 
-  This method should be called in the main thread, only by which the storage_shards
-  is modified, so no need for a mtx lock.
+  Called by worker threads without mtx. Only the shards' scheduling states
+  are scanned, which are contiguous, and only a shard due for maintenance
+  is claimed, see Shard::claim(), before it's touched.
 */
 bool System::acquire_shard(Thread *thd, bool force)
 {
+	time_t now = time(NULL);
+	bool found = false;
+
+	shard_sched_slab.for_each([&](Shard_sched *ss, const Slab_handle &h)
+	{
+		if (!ss->schedulable.load() || ss->assigned.load())
+			return true;
+		if (!force && now - ss->last_check.load() < check_shard_interval)
+			return true;
+		if (!owns_cluster(ss->cluster_id.load()))
+			return true;
+
+		Shard *shard = Shard::claim(h);
+		found = shard && shard->set_thread_handler(thd, force);
+		return !found;
+	});
+
+	return found;
+}
+
+/*
+  Whether this instance works on cluster cluster_id, always true unless
+  enable_cluster_partition is set.
+*/
+bool System::owns_cluster(uint cluster_id) const
+{
+	if (!enable_cluster_partition && !enable_warm_standby)
+		return true;
+
+	Scopped_mutex sm(owned_mtx);
+	if (!enable_cluster_partition)
+		cluster_id = LEADER_LEASE_ID;
+	return monotonic_ms() < owned_until_ms &&
+		owned_clusters.find(cluster_id) != owned_clusters.end();
+}
+
+/*
+  Whether this instance is a warm standby, which follows the topology and
+  keeps shard connections but works on no cluster until it's the leader.
+*/
+bool System::is_standby() const
+{
+	return enable_warm_standby && !enable_cluster_partition &&
+		!owns_cluster(LEADER_LEASE_ID);
+}
+
+/*
+  Refresh the computer nodes to probe, of clusters this instance works on,
+  and drop the liveness of removed ones. Done only if mtx is free, so that
+  probes keep going with the last targets while the storage sync thread
+  holds it. Called by the prober thread only.
+*/
+void System::refresh_comp_probe_targets()
+{
+	if (pthread_mutex_trylock(&mtx) != 0)
+		return;
+
+	std::vector<Comp_node_health> nodes;
+	comp_probe_targets.clear();
 	for (auto &cluster:kl_clusters)
-		for (auto &sd:cluster->storage_shards)
+	{
+		if (!owns_cluster(cluster->get_id()))
+			continue;
+		for (auto &comp:cluster->computer_nodes)
 		{
-			if (sd->set_thread_handler(thd, force))
-				return true;
+			Comp_node_health h{};
+			std::string user, pwd;
+			h.id = comp->id;
+			h.cluster_id = cluster->get_id();
+			h.cluster_name = cluster->get_name();
+			h.name = comp->get_name();
+			comp->get_ip_port(h.ip, h.port);
+			comp->get_user_pwd(user, pwd);
+			comp_probe_targets.emplace_back(h.id, h.ip, h.port, user, pwd);
+			nodes.emplace_back(h);
 		}
+	}
+	pthread_mutex_unlock(&mtx);
 
-	return false;
+	Scopped_mutex sm(comp_health_mtx);
+	std::map<uint, Comp_node_health> health;
+	for (auto &n:nodes)
+	{
+		auto itr = comp_health.find(n.id);
+		if (itr != comp_health.end())
+		{
+			n.state = itr->second.state;
+			n.latency_us = itr->second.latency_us;
+			n.fails = itr->second.fails;
+			n.last_probe = itr->second.last_probe;
+			n.last_change = itr->second.last_change;
+			n.error = itr->second.error;
+			n.status_synced = itr->second.status_synced;
+		}
+		health.emplace(n.id, n);
+	}
+	comp_health.swap(health);
 }
 
-// the next several function for auto cluster operation 
-int System::execute_metadate_opertation(enum_sql_command command, const std::string & str_sql)
+/*
+  Probe all computer nodes once, within comp_node_probe_timeout_ms. A node
+  is down after comp_node_down_probes consecutive failed probes, and up
+  after one successful probe. Its comp_nodes.status is updated on a state
+  change, and retried in later calls until done, so that load balancers
+  drop a dead node in seconds. Called every comp_node_probe_interval_ms.
+*/
+void System::probe_computers()
+{
+	refresh_comp_probe_targets();
+
+	std::vector<Comp_probe> probes(comp_probe_targets);
+	if (probes.empty())
+		return;
+	probe_computer_nodes(probes, monotonic_ms() + comp_node_probe_timeout_ms);
+
+	time_t now = time(NULL);
+	std::vector<std::pair<uint, bool> > status_updates;
+	{
+		Scopped_mutex sm(comp_health_mtx);
+		for (auto &probe:probes)
+		{
+			auto itr = comp_health.find(probe.comp_id);
+			if (itr == comp_health.end())
+				continue;
+
+			Comp_node_health &h = itr->second;
+			Comp_node_health::State st = h.state;
+			h.last_probe = now;
+			if (probe.alive)
+			{
+				h.latency_us = probe.latency_us;
+				h.fails = 0;
+				h.error.clear();
+				st = Comp_node_health::UP;
+			}
+			else
+			{
+				h.fails++;
+				h.error = probe.error;
+				while (!h.error.empty() && isspace((unsigned char)h.error.back()))
+					h.error.pop_back();
+				if (h.fails >= (uint)comp_node_down_probes)
+					st = Comp_node_health::DOWN;
+			}
+
+			if (st != h.state)
+			{
+				syslog(st == Comp_node_health::DOWN ? Logger::WARNING : Logger::INFO,
+					   "Computer node (%s.%s, %u, %s:%d) is %s, was %s%s%s",
+					   h.cluster_name.c_str(), h.name.c_str(), h.id, h.ip.c_str(), h.port,
+					   Comp_node_health::state_name(st), Comp_node_health::state_name(h.state),
+					   h.error.empty() ? "." : ": ", h.error.c_str());
+				comp_health_events.emplace_back(
+					Comp_node_event{now, h.id, h.state, st});
+				if (comp_health_events.size() > MAX_COMP_HEALTH_EVENTS)
+					comp_health_events.pop_front();
+				h.state = st;
+				h.last_change = now;
+				h.status_synced = false;
+			}
+
+			// written by the instance working on the cluster only.
+			if (!h.status_synced && h.state != Comp_node_health::UNKNOWN &&
+				owns_cluster(h.cluster_id))
+				status_updates.emplace_back(h.id, h.state == Comp_node_health::UP);
+		}
+	}
+
+	for (auto &upd:status_updates)
+	{
+		if (meta_shard.update_comp_node_status(upd.first, upd.second))
+		{
+			syslog(Logger::WARNING, "Failed to update computer node (%u) status in metadata, to retry later.",
+				   upd.first);
+			continue;
+		}
+
+		Scopped_mutex sm(comp_health_mtx);
+		auto itr = comp_health.find(upd.first);
+		if (itr != comp_health.end() &&
+			(itr->second.state == Comp_node_health::UP) == upd.second)
+			itr->second.status_synced = true;
+	}
+}
+
+/*
+  Restore the states saved by the previous instance working on the shards
+  of clusters newly owned by this instance, all clusters if it becomes the
+  leader in warm standby mode or if clusters aren't taken over at all.
+  @retval 0 if restored, -1 otherwise.
+*/
+int System::restore_shard_states(const std::set<uint> &gained)
 {
+	std::map<uint, uint> pending_masters;
+	if (meta_shard.load_pending_masters(pending_masters))
+	{
+		syslog(Logger::ERROR, "Failed to load shard states saved in metadata shard.");
+		return -1;
+	}
+
+	bool all = !enable_cluster_partition;
+	auto restore = [&pending_masters](Shard *shard)
+	{
+		auto itr = pending_masters.find(shard->get_id());
+		if (itr != pending_masters.end() && itr->second != 0)
+			shard->restore_pending_master(itr->second);
+	};
+
 	Scopped_mutex sm(mtx);
+	if (all || gained.find(meta_shard.get_cluster_id()) != gained.end())
+		restore(&meta_shard);
+	for (auto &cluster:kl_clusters)
+		if (all || gained.find(cluster->get_id()) != gained.end())
+			for (auto &shard:cluster->storage_shards)
+				restore(shard);
+	return 0;
+}
 
+// FNV-1a hash with a final mix, so that similar keys spread on the ring.
+static uint64_t ring_hash(const std::string &key)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (unsigned char c:key)
+	{
+		h ^= c;
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+  If enable_cluster_partition is set, renew this instance's lease in the
+  metadata shard, and split all clusters among the live instances by
+  consistent hashing, so that a cluster moves only when the instance it
+  hashes to joins or dies. Leases of clusters hashed to this instance are
+  taken or renewed, those no longer hashed to it are given up, and the
+  clusters whose leases are held are worked on until the leases could have
+  expired. A cluster given up by another instance is taken once its lease
+  is released or expired, so no two instances work on one cluster.
+
+  If enable_warm_standby is set instead, every instance wants the leader
+  lease, the leader renews it and a standby takes it once it expires.
+*/
+int System::refresh_cluster_ownership()
+{
+	if (!enable_cluster_partition && !enable_warm_standby)
+		return 0;
+
+	std::vector<uint> cluster_ids;
+	{
+		Scopped_mutex sm(mtx);
+		cluster_ids.emplace_back(meta_shard.get_cluster_id());
+		for (auto &cluster:kl_clusters)
+			cluster_ids.emplace_back(cluster->get_id());
+	}
+
+	// lease_expire_at is set after this, so leases last at least till start + timeout
+	int64_t start_ms = monotonic_ms();
+	std::vector<std::string> live_instances;
+	if (meta_shard.renew_instance_lease(cluster_mgr_instance_name, live_instances))
+	{
+		syslog(Logger::ERROR, "Failed to renew lease of cluster_mgr instance %s.",
+			   cluster_mgr_instance_name.c_str());
+		return -1;
+	}
+
+	if (std::find(live_instances.begin(), live_instances.end(),
+			cluster_mgr_instance_name) == live_instances.end())
+		live_instances.emplace_back(cluster_mgr_instance_name);
+
+	std::map<uint64_t, const std::string *> ring;
+	for (auto &inst:live_instances)
+		for (int i = 0; i < CLUSTER_RING_VNODES; i++)
+			ring[ring_hash(inst + "#" + std::to_string(i))] = &inst;
+
+	std::vector<uint> wanted, released;
+	std::set<uint> owned;
+	if (!enable_cluster_partition)
+		wanted.emplace_back(LEADER_LEASE_ID);
+	else for (auto &cid:cluster_ids)
+	{
+		auto itr = ring.lower_bound(ring_hash("cluster#" + std::to_string(cid)));
+		if (itr == ring.end())
+			itr = ring.begin();
+		if (*itr->second == cluster_mgr_instance_name)
+			wanted.emplace_back(cid);
+		else if (owns_cluster(cid))
+			released.emplace_back(cid);
+	}
+
+	if (meta_shard.renew_cluster_leases(cluster_mgr_instance_name, wanted, released, owned))
+	{
+		syslog(Logger::ERROR, "Failed to renew cluster leases of cluster_mgr instance %s.",
+			   cluster_mgr_instance_name.c_str());
+		return -1;
+	}
+
+	std::set<uint> gained;
+	{
+		Scopped_mutex sm(owned_mtx);
+		if (monotonic_ms() >= owned_until_ms)
+			owned_clusters.clear();
+		for (auto &cid:owned)
+			if (owned_clusters.find(cid) == owned_clusters.end())
+				gained.insert(cid);
+
+		if (owned != owned_clusters && enable_cluster_partition)
+			syslog(Logger::INFO, "cluster_mgr instance %s of %lu live ones now works on %lu of %lu clusters.",
+				   cluster_mgr_instance_name.c_str(), live_instances.size(),
+				   owned.size(), cluster_ids.size());
+		else if (owned != owned_clusters)
+			syslog(Logger::INFO, "cluster_mgr instance %s of %lu live ones is now the %s.",
+				   cluster_mgr_instance_name.c_str(), live_instances.size(),
+				   owned.empty() ? "standby" : "leader");
+		owned_clusters.swap(owned);
+		// half the lease timeout is left as margin for clock rate differences
+		owned_until_ms = start_ms + cluster_lease_timeout * 1000 / 2;
+	}
+
+	// the topology and connections are ready, start working at once
+	if (gained.size() > 0)
+	{
+		restore_shard_states(gained);
+		Thread_manager::get_instance()->wakeup_all();
+	}
+	return 0;
+}
+
+// the next several function for auto cluster operation 
+int System::execute_metadate_opertation(enum_sql_command command, const std::string & str_sql)
+{
 	return meta_shard.execute_metadate_opertation(SQLCOM_INSERT, str_sql);
 }
 
 int System::get_comp_nodes_id_seq(int &comps_id)
 {
-	Scopped_mutex sm(mtx);
-
 	return meta_shard.get_comp_nodes_id_seq(comps_id);
 }
 
 int System::get_max_cluster_id(int &cluster_id)
 {
-	Scopped_mutex sm(mtx);
-
 	return meta_shard.get_max_cluster_id(cluster_id);
 }
 
@@ -392,22 +1094,16 @@ int System::get_max_comp_name_id(std::string &cluster_name, int &comp_id)
 
 int System::get_server_nodes_from_metadata(std::vector<Machine*> &vec_machines)
 {
-	Scopped_mutex sm(mtx);
-
 	return meta_shard.get_server_nodes_from_metadata(vec_machines);
 }
 
 int System::get_backup_info_from_metadata(std::string &cluster_name, std::string &timestamp, Tpye_cluster_info &cluster_info)
 {
-	Scopped_mutex sm(mtx);
-
 	return meta_shard.get_backup_info_from_metadata(cluster_name, timestamp, cluster_info);
 }
 
 bool System::check_machine_hostaddr(std::string &hostaddr)
 {
-	Scopped_mutex sm(mtx);
-
 	return meta_shard.check_machine_hostaddr(hostaddr);
 }
 
@@ -594,8 +1290,6 @@ bool System::get_machine_instance_port(Machine* machine)
 
 bool System::update_instance_status(Tpye_Ip_Port &ip_port, std::string &status, int &type)
 {
-	Scopped_mutex sm(mtx);
-
 	if(meta_shard.update_instance_status(ip_port, status, type))
 	{
 		//syslog(Logger::ERROR, "update_instance_status error");
@@ -1116,6 +1810,266 @@ bool System::get_computer(cJSON *root, std::string &str_ret)
 	return true;
 }
 
+/*
+  Workload of a cluster's storage shards sampled by storage stats sync, and
+  whether each is hot, i.e. its load is far above the cluster's median.
+*/
+bool System::get_shard_load(cJSON *root, std::string &str_ret)
+{
+	Scopped_mutex sm(mtx);
+
+	cJSON *ret_root;
+	cJSON *ret_item;
+	cJSON *item;
+	char *ret_cjson;
+	int shard_count=0;
+	char buf[64];
+
+	std::string cluster_name;
+	item = cJSON_GetObjectItem(root, "cluster_name");
+	if(item == NULL || item->valuestring == NULL)
+	{
+		syslog(Logger::ERROR, "get cluster_name error");
+		return false;
+	}
+	cluster_name = item->valuestring;
+
+	ret_root = cJSON_CreateObject();
+
+	for (auto &cluster:kl_clusters)
+	{
+		if(cluster_name != cluster->get_name())
+			continue;
+
+		snprintf(buf, sizeof(buf), "%.1f", cluster->get_median_shard_load());
+		cJSON_AddStringToObject(ret_root, "median_load", buf);
+
+		const std::map<uint, Shard_workload> &workloads = cluster->get_shard_workloads();
+		for(auto &shard:cluster->storage_shards)
+		{
+			auto itr = workloads.find(shard->get_id());
+			if(itr == workloads.end())
+				continue;
+			const Shard_workload &wl = itr->second;
+
+			std::string str;
+			ret_item = cJSON_CreateObject();
+			str = "shard" + std::to_string(shard_count++);
+			cJSON_AddItemToObject(ret_root, str.c_str(), ret_item);
+
+			cJSON_AddStringToObject(ret_item, "id", std::to_string(shard->get_id()).c_str());
+			cJSON_AddStringToObject(ret_item, "name", shard->get_name().c_str());
+			snprintf(buf, sizeof(buf), "%.1f", wl.load());
+			cJSON_AddStringToObject(ret_item, "load", buf);
+			snprintf(buf, sizeof(buf), "%.1f", wl.qps);
+			cJSON_AddStringToObject(ret_item, "queries_per_sec", buf);
+			snprintf(buf, sizeof(buf), "%.1f", wl.commits_ps);
+			cJSON_AddStringToObject(ret_item, "commits_per_sec", buf);
+			snprintf(buf, sizeof(buf), "%.1f", wl.row_reads_ps);
+			cJSON_AddStringToObject(ret_item, "row_reads_per_sec", buf);
+			snprintf(buf, sizeof(buf), "%.1f", wl.row_writes_ps);
+			cJSON_AddStringToObject(ret_item, "row_writes_per_sec", buf);
+			cJSON_AddStringToObject(ret_item, "apply_queue", std::to_string(wl.apply_queue).c_str());
+			cJSON_AddStringToObject(ret_item, "samples", std::to_string(wl.samples.size()).c_str());
+			cJSON_AddStringToObject(ret_item, "hot", wl.hot ? "true" : "false");
+		}
+
+		break;
+	}
+
+	ret_cjson = cJSON_Print(ret_root);
+	str_ret = ret_cjson;
+
+	if(ret_root != NULL)
+		cJSON_Delete(ret_root);
+	if(ret_cjson != NULL)
+		free(ret_cjson);
+
+	return true;
+}
+
+/*
+  MGR replication lag series of a cluster's storage shard nodes, sampled
+  by the shards' worker threads, oldest sample first.
+*/
+bool System::get_shard_lag(cJSON *root, std::string &str_ret)
+{
+	Scopped_mutex sm(mtx);
+
+	cJSON *ret_root;
+	cJSON *ret_item;
+	cJSON *samples_item;
+	cJSON *item;
+	char *ret_cjson;
+	int node_count=0;
+	char buf[64];
+
+	std::string cluster_name;
+	item = cJSON_GetObjectItem(root, "cluster_name");
+	if(item == NULL || item->valuestring == NULL)
+	{
+		syslog(Logger::ERROR, "get cluster_name error");
+		return false;
+	}
+	cluster_name = item->valuestring;
+
+	ret_root = cJSON_CreateObject();
+	std::vector<Mgr_lag_sample> samples;
+
+	for (auto &cluster:kl_clusters)
+	{
+		if(cluster_name != cluster->get_name())
+			continue;
+
+		for(auto &shard:cluster->storage_shards)
+		{
+			Shard_node *master = shard->get_master();
+			for(auto &node:shard->get_nodes())
+			{
+				std::string ip, str;
+				int port;
+				node->get_ip_port(ip, port);
+				node->get_lag_series().get(samples);
+
+				ret_item = cJSON_CreateObject();
+				str = "node" + std::to_string(node_count++);
+				cJSON_AddItemToObject(ret_root, str.c_str(), ret_item);
+
+				cJSON_AddStringToObject(ret_item, "shard_id", std::to_string(shard->get_id()).c_str());
+				cJSON_AddStringToObject(ret_item, "shard_name", shard->get_name().c_str());
+				cJSON_AddStringToObject(ret_item, "node_id", std::to_string(node->get_id()).c_str());
+				cJSON_AddStringToObject(ret_item, "ip", ip.c_str());
+				cJSON_AddStringToObject(ret_item, "port", std::to_string(port).c_str());
+				cJSON_AddStringToObject(ret_item, "master", node == master ? "true" : "false");
+				if(!samples.empty())
+				{
+					cJSON_AddStringToObject(ret_item, "lag", std::to_string(samples.back().lag).c_str());
+					cJSON_AddStringToObject(ret_item, "apply_queue", std::to_string(samples.back().apply_queue).c_str());
+				}
+				snprintf(buf, sizeof(buf), "%.1f", node->get_lag_series().mean_lag());
+				cJSON_AddStringToObject(ret_item, "mean_lag", buf);
+
+				samples_item = cJSON_CreateArray();
+				cJSON_AddItemToObject(ret_item, "samples", samples_item);
+				for(auto &sample:samples)
+				{
+					item = cJSON_CreateObject();
+					cJSON_AddItemToArray(samples_item, item);
+					cJSON_AddStringToObject(item, "time", std::to_string(sample.time).c_str());
+					cJSON_AddStringToObject(item, "applied", std::to_string(sample.applied).c_str());
+					cJSON_AddStringToObject(item, "received", std::to_string(sample.received).c_str());
+					cJSON_AddStringToObject(item, "lag", std::to_string(sample.lag).c_str());
+					cJSON_AddStringToObject(item, "apply_queue", std::to_string(sample.apply_queue).c_str());
+				}
+			}
+		}
+
+		break;
+	}
+
+	ret_cjson = cJSON_Print(ret_root);
+	str_ret = ret_cjson;
+
+	if(ret_root != NULL)
+		cJSON_Delete(ret_root);
+	if(ret_cjson != NULL)
+		free(ret_cjson);
+
+	return true;
+}
+
+/*
+  Liveness of computer nodes found by probes, of the cluster named
+  cluster_name or all clusters if it's absent, and their state changes
+  since the unix time 'since' if it's given, oldest first.
+*/
+bool System::get_computer_health(cJSON *root, std::string &str_ret)
+{
+	cJSON *ret_root;
+	cJSON *ret_item;
+	cJSON *events_item;
+	cJSON *item;
+	char *ret_cjson;
+	int comp_count=0;
+	char buf[64];
+
+	std::string cluster_name;
+	item = cJSON_GetObjectItem(root, "cluster_name");
+	if(item != NULL && item->valuestring != NULL)
+		cluster_name = item->valuestring;
+
+	time_t since = -1;
+	item = cJSON_GetObjectItem(root, "since");
+	if(item != NULL && item->valuestring != NULL)
+		since = atol(item->valuestring);
+
+	ret_root = cJSON_CreateObject();
+
+	Scopped_mutex sm(comp_health_mtx);
+	std::map<uint, const Comp_node_health *> nodes;
+	for (auto &i:comp_health)
+	{
+		const Comp_node_health &h = i.second;
+		if(!cluster_name.empty() && cluster_name != h.cluster_name)
+			continue;
+		nodes.emplace(h.id, &h);
+
+		std::string str;
+		ret_item = cJSON_CreateObject();
+		str = "computer" + std::to_string(comp_count++);
+		cJSON_AddItemToObject(ret_root, str.c_str(), ret_item);
+
+		cJSON_AddStringToObject(ret_item, "id", std::to_string(h.id).c_str());
+		cJSON_AddStringToObject(ret_item, "name", h.name.c_str());
+		cJSON_AddStringToObject(ret_item, "cluster_name", h.cluster_name.c_str());
+		cJSON_AddStringToObject(ret_item, "ip", h.ip.c_str());
+		cJSON_AddStringToObject(ret_item, "port", std::to_string(h.port).c_str());
+		cJSON_AddStringToObject(ret_item, "state", Comp_node_health::state_name(h.state));
+		snprintf(buf, sizeof(buf), "%.3f", h.latency_us / 1000.0);
+		cJSON_AddStringToObject(ret_item, "latency_ms", buf);
+		cJSON_AddStringToObject(ret_item, "fails", std::to_string(h.fails).c_str());
+		cJSON_AddStringToObject(ret_item, "last_probe", std::to_string(h.last_probe).c_str());
+		cJSON_AddStringToObject(ret_item, "last_change", std::to_string(h.last_change).c_str());
+		cJSON_AddStringToObject(ret_item, "status_synced", h.status_synced ? "true" : "false");
+		if(!h.error.empty())
+			cJSON_AddStringToObject(ret_item, "error", h.error.c_str());
+	}
+
+	if(since >= 0)
+	{
+		events_item = cJSON_CreateArray();
+		cJSON_AddItemToObject(ret_root, "events", events_item);
+		for (auto &ev:comp_health_events)
+		{
+			auto itr = nodes.find(ev.id);
+			if(ev.time < since || (!cluster_name.empty() && itr == nodes.end()))
+				continue;
+
+			item = cJSON_CreateObject();
+			cJSON_AddItemToArray(events_item, item);
+			cJSON_AddStringToObject(item, "time", std::to_string(ev.time).c_str());
+			cJSON_AddStringToObject(item, "id", std::to_string(ev.id).c_str());
+			if(itr != nodes.end())
+			{
+				cJSON_AddStringToObject(item, "ip", itr->second->ip.c_str());
+				cJSON_AddStringToObject(item, "port", std::to_string(itr->second->port).c_str());
+			}
+			cJSON_AddStringToObject(item, "from", Comp_node_health::state_name(ev.from));
+			cJSON_AddStringToObject(item, "to", Comp_node_health::state_name(ev.to));
+		}
+	}
+
+	ret_cjson = cJSON_Print(ret_root);
+	str_ret = ret_cjson;
+
+	if(ret_root != NULL)
+		cJSON_Delete(ret_root);
+	if(ret_cjson != NULL)
+		free(ret_cjson);
+
+	return true;
+}
+
 bool System::get_variable(cJSON *root, std::string &str_ret)
 {
 	Scopped_mutex sm(mtx);
@@ -1492,42 +2446,22 @@ bool System::add_shard_nodes(std::string &cluster_name, std::string &shard_name,
 
 bool System::stop_cluster(std::string &cluster_name)
 {
-	Scopped_mutex sm(mtx);
-
-	for (auto cluster_it=kl_clusters.begin(); cluster_it!=kl_clusters.end(); )
+	std::vector<Shard *> shards;
+	std::vector<KunlunCluster *> clusters;
 	{
-		if(cluster_name != (*cluster_it)->get_name())
-		{
-			cluster_it++;
-			continue;
-		}
-
-		//remove storage and shard
-		for(auto shard_it=(*cluster_it)->storage_shards.begin(); shard_it!=(*cluster_it)->storage_shards.end(); )
+		Scopped_mutex sm(mtx);
+		for (auto cluster_it=kl_clusters.begin(); cluster_it!=kl_clusters.end(); cluster_it++)
 		{
-			for(auto node_it=(*shard_it)->get_nodes().begin(); node_it!=(*shard_it)->get_nodes().end(); )
+			if(cluster_name == (*cluster_it)->get_name())
 			{
-				delete *node_it;
-				node_it = (*shard_it)->get_nodes().erase(node_it);
+				// its shards and computers are deleted with it.
+				clusters.emplace_back(*cluster_it);
+				kl_clusters.erase(cluster_it);
+				break;
 			}
-			
-			delete *shard_it;
-			shard_it = (*cluster_it)->storage_shards.erase(shard_it);
-		}
-
-		//then remove computer
-		for(auto comp_it=(*cluster_it)->computer_nodes.begin(); comp_it!=(*cluster_it)->computer_nodes.end(); )
-		{
-			delete *comp_it;
-			comp_it = (*cluster_it)->computer_nodes.erase(comp_it);
 		}
-
-		//remove cluster
-		delete *cluster_it;
-		System::get_instance()->kl_clusters.erase(cluster_it);
-		
-		break;
 	}
+	delete_detached(shards, clusters);
 
 	if(meta_shard.delete_cluster_from_metadata(cluster_name))
 	{
@@ -1540,39 +2474,29 @@ bool System::stop_cluster(std::string &cluster_name)
 
 bool System::stop_cluster_shard(std::string &cluster_name, std::string &shard_name)
 {
-	Scopped_mutex sm(mtx);
-
-	for (auto cluster_it=kl_clusters.begin(); cluster_it!=kl_clusters.end(); )
+	std::vector<Shard *> shards;
+	std::vector<KunlunCluster *> clusters;
 	{
-		if(cluster_name != (*cluster_it)->get_name())
-		{
-			cluster_it++;
-			continue;
-		}
-
-		//remove storage and shard by shard_name
-		for(auto shard_it=(*cluster_it)->storage_shards.begin(); shard_it!=(*cluster_it)->storage_shards.end(); )
+		Scopped_mutex sm(mtx);
+		for (auto &cluster:kl_clusters)
 		{
-			if(shard_name != (*shard_it)->get_name())
-			{
-				shard_it++;
+			if(cluster_name != cluster->get_name())
 				continue;
-			}
 
-			for(auto node_it=(*shard_it)->get_nodes().begin(); node_it!=(*shard_it)->get_nodes().end(); )
+			for(auto shard_it=cluster->storage_shards.begin(); shard_it!=cluster->storage_shards.end(); shard_it++)
 			{
-				delete *node_it;
-				node_it = (*shard_it)->get_nodes().erase(node_it);
+				if(shard_name == (*shard_it)->get_name())
+				{
+					// its nodes are deleted with it.
+					shards.emplace_back(*shard_it);
+					cluster->storage_shards.erase(shard_it);
+					break;
+				}
 			}
-			
-			delete *shard_it;
-			shard_it = (*cluster_it)->storage_shards.erase(shard_it);
-
 			break;
 		}
-		
-		break;
 	}
+	delete_detached(shards, clusters);
 
 	if(meta_shard.delete_cluster_shard_from_metadata(cluster_name, shard_name))
 	{
@@ -15,9 +15,59 @@
 #include "cjson.h"
 #include <vector>
 #include <map>
+#include <deque>
 
 class Thread;
 
+extern int64_t enable_cluster_partition;
+extern int64_t enable_warm_standby;
+extern std::string cluster_mgr_instance_name;
+extern std::string topology_snapshot_path;
+extern int64_t topology_snapshot_interval;
+extern int64_t enable_primary_balance;
+extern int64_t primary_balance_interval;
+extern int64_t primary_balance_max_moves;
+extern int64_t primary_move_timeout_ms;
+extern int64_t comp_node_probe_interval_ms;
+extern int64_t comp_node_probe_timeout_ms;
+extern int64_t comp_node_down_probes;
+
+/*
+  Liveness of a computer node found by the computer node prober, kept by
+  computer node id.
+*/
+struct Comp_node_health
+{
+	enum State { UNKNOWN, UP, DOWN };
+	static const char *state_name(State st)
+	{
+		return st == UP ? "up" : (st == DOWN ? "down" : "unknown");
+	}
+
+	uint id;
+	uint cluster_id;
+	std::string cluster_name;
+	std::string name;
+	std::string ip;
+	int port;
+	State state;
+	int64_t latency_us; // to connect, of the last successful probe
+	uint fails; // NO. of consecutive failed probes
+	time_t last_probe;
+	time_t last_change; // when state last changed
+	std::string error; // of the last failed probe
+	bool status_synced; // whether comp_nodes.status matches state
+};
+
+// A computer node's liveness state change, see System::comp_health_events.
+struct Comp_node_event
+{
+	time_t time;
+	uint id;
+	Comp_node_health::State from;
+	Comp_node_health::State to;
+};
+
 /*
   Singleton class for global settings and functionality.
 */
@@ -35,13 +85,60 @@ private:
 	mutable pthread_mutex_t mtx;
 	mutable pthread_mutexattr_t mtx_attr;
 
+	/*
+	  If enable_cluster_partition is set, clusters are split among the
+	  cluster_mgr instances sharing the metadata shard, and this one only
+	  works on the clusters whose leases it holds, by cluster id, the
+	  metadata shard's included. If enable_warm_standby is set instead, only
+	  the instance holding the leader lease works on all clusters.
+	  The leases are known to be held until owned_until_ms of monotonic_ms().
+	  Guarded by owned_mtx rather than mtx which is held by the storage sync
+	  thread for long.
+	*/
+	std::set<uint> owned_clusters;
+	int64_t owned_until_ms;
+	mutable pthread_mutex_t owned_mtx;
+
+	/*
+	  IDs of shards loaded from the topology snapshot at startup and not yet
+	  verified against the metadata shard. A snapshot is saved only after
+	  they are verified, so a stale snapshot never overwrites itself.
+	*/
+	std::set<uint> unverified_shards;
+	time_t last_snapshot_time;
+	bool shard_states_restored; // see refresh_shards_from_metadata_server()
+
+	/*
+	  Liveness of computer nodes by probes, and their latest state changes,
+	  at most MAX_COMP_HEALTH_EVENTS. Guarded by comp_health_mtx rather than mtx which is held
+	  by the storage sync thread for long. comp_probe_targets is the last
+	  list of computer nodes to probe, reused while mtx is held by others,
+	  and accessed by the prober thread only.
+	*/
+	std::map<uint, Comp_node_health> comp_health;
+	std::deque<Comp_node_event> comp_health_events;
+	static const size_t MAX_COMP_HEALTH_EVENTS = 1024;
+	mutable pthread_mutex_t comp_health_mtx;
+	std::vector<Comp_probe> comp_probe_targets;
+
+	void verify_snapshot_shards(std::vector<Shard *> &shards,
+		std::vector<KunlunCluster *> &clusters);
+	void delete_detached(std::vector<Shard *> &shards,
+		std::vector<KunlunCluster *> &clusters);
+	void refresh_comp_probe_targets();
+
 	System(const std::string&cfg_path) :
 		cluster_mgr_working(true),
-		config_path(cfg_path)
+		config_path(cfg_path),
+		owned_until_ms(0),
+		last_snapshot_time(0),
+		shard_states_restored(false)
 	{
 		pthread_mutexattr_init(&mtx_attr);
 		pthread_mutexattr_settype(&mtx_attr, PTHREAD_MUTEX_RECURSIVE);
 		pthread_mutex_init(&mtx, &mtx_attr);
+		pthread_mutex_init(&owned_mtx, NULL);
+		pthread_mutex_init(&comp_health_mtx, NULL);
 	}
 
 	static System *m_global_instance;
@@ -50,7 +147,8 @@ private:
 public:
 	void meta_shard_maintenance()
 	{
-		meta_shard.maintenance();
+		if (owns_cluster(meta_shard.get_cluster_id()))
+			meta_shard.maintenance();
 	}
 	MetadataShard* get_MetadataShard()
 	{
@@ -69,12 +167,22 @@ public:
 
 	int process_recovered_prepared();
 	bool acquire_shard(Thread *thd, bool force);
+	bool owns_cluster(uint cluster_id) const;
+	bool is_standby() const;
+	int refresh_cluster_ownership();
+	int restore_shard_states(const std::set<uint> &gained);
 	int setup_metadata_shard();
+	int load_topology_snapshot();
+	int save_topology_snapshot();
 	int refresh_shards_from_metadata_server();
 	int refresh_computers_from_metadata_server();
 	int refresh_storages_info_to_computers();
 	int refresh_storages_info_to_computers_metashard();
 	int truncate_commit_log_from_metadata_server();
+	void keep_shard_conns();
+	int balance_primaries(Thread *thd);
+	void probe_computers();
+	void close_lru_shard_conns();
 	~System();
 	static int create_instance(const std::string&cfg_path);
 	static System* get_instance()
@@ -112,6 +220,9 @@ public:
 	bool get_cluster(cJSON *root, std::string &str_ret);
 	bool get_storage(cJSON *root, std::string &str_ret);
 	bool get_computer(cJSON *root, std::string &str_ret);
+	bool get_shard_load(cJSON *root, std::string &str_ret);
+	bool get_shard_lag(cJSON *root, std::string &str_ret);
+	bool get_computer_health(cJSON *root, std::string &str_ret);
 	bool get_variable(cJSON *root, std::string &str_ret);
 	bool set_variable(cJSON *root, std::string &str_ret);
 	bool get_shards_ip_port(std::string &cluster_name, std::vector <std::vector<Tpye_Ip_Port>> &vec_vec_shard);
@@ -11,6 +11,7 @@
 #include "log.h"
 #include "config.h"
 #include "machine_info.h"
+#include "os.h"
 #include "thread_manager.h"
 #include <signal.h>
 #include <pthread.h>
@@ -22,6 +23,9 @@
 extern "C" void *signal_hander(void *arg);
 extern "C" void *thread_func(void*thrdarg);
 extern "C" void *thread_func_storage_sync(void*thrdarg);
+extern "C" void *thread_func_conn_keeper(void*thrdarg);
+extern "C" void *thread_func_primary_balancer(void*thrdarg);
+extern "C" void *thread_func_comp_prober(void*thrdarg);
 
 int64_t num_worker_threads = 3;
 int Thread_manager::do_exit = 0;
@@ -170,6 +174,65 @@ void Thread_manager::start_worker_thread()
 		thd->set_pthread_hdl(hdl);
 		thrds.emplace_back(thd);
 	}
+
+	//start shard connection keeper thread
+	{
+		pthread_t hdl;
+		Thread *thd = new Thread;
+		if ((error = pthread_create(&hdl,
+			 &Thread_manager::get_instance()->thr_attr, thread_func_conn_keeper, thd)))
+		{
+			char errmsg_buf[256];
+			syslog(Logger::ERROR, "Can not create connection keeper thread, error: %d, %s",
+			error, errno, strerror_r(errno, errmsg_buf, sizeof(errmsg_buf)));
+			delete thd;
+			do_exit = 1;
+			return;
+		}
+
+		thd->set_pthread_hdl(hdl);
+		thrds.emplace_back(thd);
+	}
+
+	//start shard primary balancer thread
+	if (enable_primary_balance)
+	{
+		pthread_t hdl;
+		Thread *thd = new Thread;
+		if ((error = pthread_create(&hdl,
+			 &Thread_manager::get_instance()->thr_attr, thread_func_primary_balancer, thd)))
+		{
+			char errmsg_buf[256];
+			syslog(Logger::ERROR, "Can not create primary balancer thread, error: %d, %s",
+			error, errno, strerror_r(errno, errmsg_buf, sizeof(errmsg_buf)));
+			delete thd;
+			do_exit = 1;
+			return;
+		}
+
+		thd->set_pthread_hdl(hdl);
+		thrds.emplace_back(thd);
+	}
+
+	//start computer node prober thread
+	if (comp_node_probe_interval_ms)
+	{
+		pthread_t hdl;
+		Thread *thd = new Thread;
+		if ((error = pthread_create(&hdl,
+			 &Thread_manager::get_instance()->thr_attr, thread_func_comp_prober, thd)))
+		{
+			char errmsg_buf[256];
+			syslog(Logger::ERROR, "Can not create computer node prober thread, error: %d, %s",
+			error, errno, strerror_r(errno, errmsg_buf, sizeof(errmsg_buf)));
+			delete thd;
+			do_exit = 1;
+			return;
+		}
+
+		thd->set_pthread_hdl(hdl);
+		thrds.emplace_back(thd);
+	}
 }
 
 
@@ -307,6 +370,7 @@ void Thread::run()
 			syslog(Logger::LOG, "Thread (%p, %d) finishes working on shard (%s.%s, %u)",
 				this, tid, cur_shard->get_cluster_name().c_str(),
 				cur_shard->get_name().c_str(), cur_shard->get_id());
+			cur_shard->set_thread_handler(NULL);
 		}
 		else
 			Thread_manager::get_instance()->sleep_wait(this, thread_work_interval * 1000);
@@ -354,3 +418,72 @@ extern "C" void *thread_func_storage_sync(void*thrdarg)
 	return NULL;
 }
 
+extern "C" void *thread_func_conn_keeper(void*thrdarg)
+{
+	Thread*thd = (Thread*)thrdarg;
+	Assert(thd);
+	mask_signals();
+
+	while (!Thread_manager::do_exit)
+	{
+		if(System::get_instance()->get_cluster_mgr_working())
+			System::get_instance()->keep_shard_conns();
+
+		Thread_manager::get_instance()->sleep_wait(thd, shard_conn_keepalive_interval * 1000);
+	}
+	
+	return NULL;
+}
+
+extern "C" void *thread_func_primary_balancer(void*thrdarg)
+{
+	Thread*thd = (Thread*)thrdarg;
+	Assert(thd);
+	mask_signals();
+
+	// the first round waits too, so that shards are checked by worker threads before.
+	int64_t next_run_ms = monotonic_ms() + primary_balance_interval * 1000;
+
+	while (!Thread_manager::do_exit)
+	{
+		// woken up early by wakeup_all(), keep the rate of moves bounded.
+		int64_t wait_ms = next_run_ms - monotonic_ms();
+		if (wait_ms > 0)
+		{
+			Thread_manager::get_instance()->sleep_wait(thd, wait_ms);
+			continue;
+		}
+
+		next_run_ms = monotonic_ms() + primary_balance_interval * 1000;
+		if(System::get_instance()->get_cluster_mgr_working())
+			System::get_instance()->balance_primaries(thd);
+	}
+
+	return NULL;
+}
+
+extern "C" void *thread_func_comp_prober(void*thrdarg)
+{
+	Thread*thd = (Thread*)thrdarg;
+	Assert(thd);
+	mask_signals();
+
+	int64_t next_run_ms = 0;
+
+	while (!Thread_manager::do_exit)
+	{
+		// woken up early by wakeup_all(), probe at the configured rate only.
+		int64_t wait_ms = next_run_ms - monotonic_ms();
+		if (wait_ms > 0)
+		{
+			Thread_manager::get_instance()->sleep_wait(thd, wait_ms);
+			continue;
+		}
+
+		next_run_ms = monotonic_ms() + comp_node_probe_interval_ms;
+		if(System::get_instance()->get_cluster_mgr_working())
+			System::get_instance()->probe_computers();
+	}
+
+	return NULL;
+}
@@ -0,0 +1,411 @@
+/*
+   Copyright (c) 2019-2021 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "sys_config.h"
+#include "global.h"
+#include "log.h"
+#include "shard.h"
+#include "kl_cluster.h"
+#include "topo_snapshot.h"
+#include <map>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char SNAPSHOT_MAGIC[8] = {'K', 'L', 'C', 'M', 'T', 'O', 'P', 'O'};
+
+static_assert(sizeof(Topo_snapshot::Header) % 8 == 0 &&
+	sizeof(Topo_snapshot::Cluster_rec) % 8 == 0 &&
+	sizeof(Topo_snapshot::Shard_rec) % 8 == 0 &&
+	sizeof(Topo_snapshot::Node_rec) % 8 == 0 &&
+	sizeof(Topo_snapshot::Comp_rec) % 8 == 0 &&
+	sizeof(Topo_snapshot::Txn_rec) % 8 == 0,
+	"snapshot records must keep the following ones aligned");
+
+// FNV-1a
+static uint64_t snapshot_checksum(const char *p, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// @retval false if s doesn't fit in dst with its terminating NUL.
+template <size_t N>
+static bool put_str(char (&dst)[N], const std::string &s)
+{
+	if (s.length() >= N)
+		return false;
+	memcpy(dst, s.c_str(), s.length() + 1);
+	return true;
+}
+
+template <size_t N>
+static bool valid_str(const char (&s)[N])
+{
+	return memchr(s, 0, N) != NULL;
+}
+
+template <typename T>
+static void append_rec(std::string &buf, const T &rec)
+{
+	buf.append((const char *)&rec, sizeof(rec));
+}
+
+int Topo_snapshot::save(const std::string &path, const std::vector<KunlunCluster *> &clusters)
+{
+	Header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.save_time = time(NULL);
+
+	// records of each kind are collected separately and concatenated
+	std::string cluster_recs, shard_recs, node_recs, comp_recs, txn_recs;
+	std::string ip, user, pwd;
+	int port = 0;
+	bool ok = true;
+
+	for (auto &cluster:clusters)
+	{
+		Cluster_rec crec;
+		memset(&crec, 0, sizeof(crec));
+		crec.id = cluster->get_id();
+		ok = ok && put_str(crec.name, cluster->get_name());
+		append_rec(cluster_recs, crec);
+		hdr.nclusters++;
+
+		for (auto &shard:cluster->storage_shards)
+		{
+			Shard_rec srec;
+			memset(&srec, 0, sizeof(srec));
+			srec.id = shard->get_id();
+			srec.cluster_id = crec.id;
+			srec.ha_mode = shard->get_mode();
+			Shard_node *master = shard->get_master();
+			srec.master_node_id = master ? master->get_id() : 0;
+			ok = ok && put_str(srec.name, shard->get_name());
+			append_rec(shard_recs, srec);
+			hdr.nshards++;
+
+			for (auto &node:shard->get_nodes())
+			{
+				Node_rec nrec;
+				memset(&nrec, 0, sizeof(nrec));
+				nrec.id = node->get_id();
+				nrec.shard_id = srec.id;
+				node->get_ip_port(ip, port);
+				node->get_user_pwd(user, pwd);
+				nrec.port = port;
+				ok = ok && put_str(nrec.ip, ip) && put_str(nrec.user, user) &&
+					put_str(nrec.pwd, pwd);
+				append_rec(node_recs, nrec);
+				hdr.nnodes++;
+			}
+
+			Shard::Txn_end_decisions_t decisions;
+			shard->get_txn_end_decisions(decisions);
+			for (auto &td:decisions)
+			{
+				Txn_rec trec;
+				memset(&trec, 0, sizeof(trec));
+				trec.start_ts = td.tk.start_ts;
+				trec.prepare_ts = td.prepare_ts;
+				trec.shard_id = srec.id;
+				trec.local_txnid = td.tk.local_txnid;
+				trec.comp_nodeid = td.tk.comp_nodeid;
+				trec.decision = td.decision;
+				append_rec(txn_recs, trec);
+				hdr.ntxns++;
+			}
+		}
+
+		for (auto &comp:cluster->computer_nodes)
+		{
+			Comp_rec cnrec;
+			memset(&cnrec, 0, sizeof(cnrec));
+			cnrec.id = comp->id;
+			cnrec.cluster_id = crec.id;
+			comp->get_ip_port(ip, port);
+			comp->get_user_pwd(user, pwd);
+			cnrec.port = port;
+			ok = ok && put_str(cnrec.name, comp->get_name()) && put_str(cnrec.ip, ip) &&
+				put_str(cnrec.user, user) && put_str(cnrec.pwd, pwd);
+			append_rec(comp_recs, cnrec);
+			hdr.ncomps++;
+		}
+	}
+
+	if (!ok)
+	{
+		syslog(Logger::ERROR, "Topology snapshot not saved: a name, address or account is too long for it.");
+		return -1;
+	}
+
+	std::string body;
+	body.reserve(cluster_recs.size() + shard_recs.size() + node_recs.size() +
+		comp_recs.size() + txn_recs.size());
+	body.append(cluster_recs).append(shard_recs).append(node_recs)
+		.append(comp_recs).append(txn_recs);
+	hdr.checksum = snapshot_checksum(body.data(), body.size());
+
+	// passwords are in it, only the owner can read it.
+	std::string tmp_path = path + ".tmp";
+	int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+	{
+		syslog(Logger::ERROR, "Failed to create topology snapshot file %s, errno=%d.",
+			   tmp_path.c_str(), errno);
+		return -1;
+	}
+
+	std::string buf((const char *)&hdr, sizeof(hdr));
+	buf.append(body);
+	size_t off = 0;
+	while (off < buf.size())
+	{
+		ssize_t n = write(fd, buf.data() + off, buf.size() - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		off += n;
+	}
+
+	if (off < buf.size() || fsync(fd) != 0)
+	{
+		syslog(Logger::ERROR, "Failed to write topology snapshot file %s, errno=%d.",
+			   tmp_path.c_str(), errno);
+		close(fd);
+		unlink(tmp_path.c_str());
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp_path.c_str(), path.c_str()) != 0)
+	{
+		syslog(Logger::ERROR, "Failed to rename topology snapshot file %s to %s, errno=%d.",
+			   tmp_path.c_str(), path.c_str(), errno);
+		unlink(tmp_path.c_str());
+		return -1;
+	}
+
+	// the rename isn't durable until the directory is synced.
+	std::string dir_path(path);
+	const char *dir = dirname(&dir_path[0]);
+	int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (dfd < 0 || fsync(dfd) != 0)
+	{
+		syslog(Logger::ERROR, "Failed to sync directory %s of topology snapshot file %s, errno=%d.",
+			   dir, path.c_str(), errno);
+		if (dfd >= 0)
+			close(dfd);
+		return -1;
+	}
+	close(dfd);
+
+	syslog(Logger::DEBUG1, "Saved topology snapshot of %u clusters, %u shards, %u shard nodes, %u computer nodes and %u txn decisions to %s.",
+		   hdr.nclusters, hdr.nshards, hdr.nnodes, hdr.ncomps, hdr.ntxns, path.c_str());
+	return 0;
+}
+
+/*
+  Check the snapshot mapped at p of len bytes, and set the record arrays.
+*/
+static bool check_snapshot(const char *p, size_t len,
+	const Topo_snapshot::Header *&hdr,
+	const Topo_snapshot::Cluster_rec *&crecs,
+	const Topo_snapshot::Shard_rec *&srecs,
+	const Topo_snapshot::Node_rec *&nrecs,
+	const Topo_snapshot::Comp_rec *&cnrecs,
+	const Topo_snapshot::Txn_rec *&trecs)
+{
+	if (len < sizeof(Topo_snapshot::Header))
+		return false;
+	hdr = (const Topo_snapshot::Header *)p;
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 ||
+		hdr->version != Topo_snapshot::VERSION ||
+		hdr->header_size != sizeof(Topo_snapshot::Header))
+		return false;
+
+	uint64_t expected = sizeof(Topo_snapshot::Header) +
+		(uint64_t)hdr->nclusters * sizeof(Topo_snapshot::Cluster_rec) +
+		(uint64_t)hdr->nshards * sizeof(Topo_snapshot::Shard_rec) +
+		(uint64_t)hdr->nnodes * sizeof(Topo_snapshot::Node_rec) +
+		(uint64_t)hdr->ncomps * sizeof(Topo_snapshot::Comp_rec) +
+		(uint64_t)hdr->ntxns * sizeof(Topo_snapshot::Txn_rec);
+	if (expected != len)
+		return false;
+
+	const char *body = p + sizeof(Topo_snapshot::Header);
+	if (snapshot_checksum(body, len - sizeof(Topo_snapshot::Header)) != hdr->checksum)
+		return false;
+
+	crecs = (const Topo_snapshot::Cluster_rec *)body;
+	srecs = (const Topo_snapshot::Shard_rec *)(crecs + hdr->nclusters);
+	nrecs = (const Topo_snapshot::Node_rec *)(srecs + hdr->nshards);
+	cnrecs = (const Topo_snapshot::Comp_rec *)(nrecs + hdr->nnodes);
+	trecs = (const Topo_snapshot::Txn_rec *)(cnrecs + hdr->ncomps);
+
+	for (uint32_t i = 0; i < hdr->nclusters; i++)
+		if (!valid_str(crecs[i].name))
+			return false;
+	for (uint32_t i = 0; i < hdr->nshards; i++)
+		if (!valid_str(srecs[i].name) || srecs[i].ha_mode > Shard::HA_rbr)
+			return false;
+	for (uint32_t i = 0; i < hdr->nnodes; i++)
+		if (!valid_str(nrecs[i].ip) || !valid_str(nrecs[i].user) ||
+			!valid_str(nrecs[i].pwd) || nrecs[i].port <= 0)
+			return false;
+	for (uint32_t i = 0; i < hdr->ncomps; i++)
+		if (!valid_str(cnrecs[i].name) || !valid_str(cnrecs[i].ip) ||
+			!valid_str(cnrecs[i].user) || !valid_str(cnrecs[i].pwd) ||
+			cnrecs[i].port <= 0)
+			return false;
+	for (uint32_t i = 0; i < hdr->ntxns; i++)
+		if (trecs[i].decision != Shard::COMMIT && trecs[i].decision != Shard::ABORT)
+			return false;
+	return true;
+}
+
+int Topo_snapshot::load(const std::string &path, std::vector<KunlunCluster *> &clusters)
+{
+	Assert(clusters.empty());
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return 1;
+		syslog(Logger::ERROR, "Failed to open topology snapshot file %s, errno=%d.",
+			   path.c_str(), errno);
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		syslog(Logger::WARNING, "Ignored empty or unreadable topology snapshot file %s.", path.c_str());
+		return -1;
+	}
+
+	size_t len = st.st_size;
+	void *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+	{
+		syslog(Logger::ERROR, "Failed to map topology snapshot file %s, errno=%d.",
+			   path.c_str(), errno);
+		return -1;
+	}
+
+	const Header *hdr = NULL;
+	const Cluster_rec *crecs = NULL;
+	const Shard_rec *srecs = NULL;
+	const Node_rec *nrecs = NULL;
+	const Comp_rec *cnrecs = NULL;
+	const Txn_rec *trecs = NULL;
+	if (!check_snapshot((const char *)addr, len, hdr, crecs, srecs, nrecs, cnrecs, trecs))
+	{
+		munmap(addr, len);
+		syslog(Logger::WARNING, "Ignored invalid or incompatible topology snapshot file %s.", path.c_str());
+		return -1;
+	}
+
+	std::map<uint, KunlunCluster *> cluster_by_id;
+	std::map<uint, Shard *> shard_by_id;
+
+	for (uint32_t i = 0; i < hdr->nclusters; i++)
+	{
+		if (cluster_by_id.find(crecs[i].id) != cluster_by_id.end())
+			continue;
+		KunlunCluster *cluster = new KunlunCluster(crecs[i].id, crecs[i].name);
+		cluster_by_id[crecs[i].id] = cluster;
+		clusters.emplace_back(cluster);
+	}
+
+	for (uint32_t i = 0; i < hdr->nshards; i++)
+	{
+		auto itr = cluster_by_id.find(srecs[i].cluster_id);
+		if (itr == cluster_by_id.end() || shard_by_id.find(srecs[i].id) != shard_by_id.end())
+			continue;
+		Shard *shard = new Shard(srecs[i].id, srecs[i].name, Shard::STORAGE,
+			(Shard::HAVL_mode)srecs[i].ha_mode);
+		shard->set_cluster_info(itr->second->get_name(), itr->first);
+		shard->set_cluster(itr->second);
+		itr->second->storage_shards.emplace_back(shard);
+		shard_by_id[srecs[i].id] = shard;
+	}
+
+	for (uint32_t i = 0; i < hdr->nnodes; i++)
+	{
+		auto itr = shard_by_id.find(nrecs[i].shard_id);
+		if (itr == shard_by_id.end())
+			continue;
+		bool changed = false;
+		itr->second->refresh_node_configs(nrecs[i].id, nrecs[i].ip, nrecs[i].port,
+			nrecs[i].user, nrecs[i].pwd, changed);
+	}
+
+	// masters are known only after the nodes are added
+	for (uint32_t i = 0; i < hdr->nshards; i++)
+	{
+		auto itr = shard_by_id.find(srecs[i].id);
+		if (itr == shard_by_id.end())
+			continue;
+		Shard *shard = itr->second;
+		Shard_node *master = shard->get_node_by_id(srecs[i].master_node_id);
+		if (master)
+			shard->set_master(master);
+	}
+
+	std::map<Shard *, Shard::Txn_end_decisions_t> decisions;
+	for (uint32_t i = 0; i < hdr->ntxns; i++)
+	{
+		auto itr = shard_by_id.find(trecs[i].shard_id);
+		if (itr == shard_by_id.end())
+			continue;
+		Shard::Txn_key tk;
+		tk.start_ts = trecs[i].start_ts;
+		tk.local_txnid = trecs[i].local_txnid;
+		tk.comp_nodeid = trecs[i].comp_nodeid;
+		decisions[itr->second].emplace_back(tk,
+			(Shard::Txn_decision_enum)trecs[i].decision, trecs[i].prepare_ts);
+	}
+	for (auto &i:decisions)
+		i.first->set_txn_end_decisions(i.second);
+
+	for (uint32_t i = 0; i < hdr->ncomps; i++)
+	{
+		auto itr = cluster_by_id.find(cnrecs[i].cluster_id);
+		if (itr == cluster_by_id.end())
+			continue;
+		itr->second->computer_nodes.emplace_back(new Computer_node(cnrecs[i].id,
+			itr->first, cnrecs[i].port, cnrecs[i].name, cnrecs[i].ip,
+			cnrecs[i].user, cnrecs[i].pwd));
+	}
+
+	for (auto &cluster:clusters)
+		cluster->refresh_master_push_conns();
+
+	syslog(Logger::INFO, "Loaded topology snapshot saved at %ld from %s: %u clusters, %u shards, %u shard nodes, %u computer nodes and %u txn decisions.",
+		   (long)hdr->save_time, path.c_str(), hdr->nclusters, hdr->nshards,
+		   hdr->nnodes, hdr->ncomps, hdr->ntxns);
+	munmap(addr, len);
+	return 0;
+}
@@ -0,0 +1,123 @@
+/*
+   Copyright (c) 2019-2021 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef TOPO_SNAPSHOT_H
+#define TOPO_SNAPSHOT_H
+#include "sys_config.h"
+#include "global.h"
+
+#include <string>
+#include <vector>
+
+class KunlunCluster;
+
+/*
+  Snapshot of the storage clusters' topology and recovery states in a local
+  file, so that a restarted cluster_mgr resumes working on the shards at
+  once, before the metadata shard is reachable and queried, and the
+  snapshot is then verified against the metadata shard.
+
+  The file is a header followed by arrays of fixed size records, in the
+  order of the header's counts, so it's read in place via mmap. All
+  integers are in host byte order, a file from a different host or
+  version is ignored.
+
+  Passwords of shard and computer nodes are saved in plaintext, the file
+  is created with mode 0600. An empty topology_snapshot_path disables it.
+
+  A shard's pending primary isn't in the snapshot, which could be older
+  than the shard's latest one, it's saved to the metadata shard when it's
+  set and restored from there, see Shard::set_pending_master().
+*/
+class Topo_snapshot
+{
+public:
+	static const uint32_t VERSION = 2;
+	static const size_t MAX_NAME = 128;
+	static const size_t MAX_HOST = 256;
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t header_size;
+		int64_t save_time;
+		uint32_t nclusters;
+		uint32_t nshards;
+		uint32_t nnodes;
+		uint32_t ncomps;
+		uint32_t ntxns;
+		uint32_t pad;
+		uint64_t checksum; // of all records following the header
+	};
+
+	struct Cluster_rec
+	{
+		uint32_t id;
+		uint32_t pad;
+		char name[MAX_NAME];
+	};
+
+	struct Shard_rec
+	{
+		uint32_t id;
+		uint32_t cluster_id;
+		uint32_t ha_mode;
+		uint32_t master_node_id; // 0 if unknown
+		char name[MAX_NAME];
+	};
+
+	struct Node_rec
+	{
+		uint32_t id;
+		uint32_t shard_id;
+		int32_t port;
+		uint32_t pad;
+		char ip[MAX_HOST];
+		char user[MAX_NAME];
+		char pwd[MAX_NAME];
+	};
+
+	struct Comp_rec
+	{
+		uint32_t id;
+		uint32_t cluster_id;
+		int32_t port;
+		uint32_t pad;
+		char name[MAX_NAME];
+		char ip[MAX_HOST];
+		char user[MAX_NAME];
+		char pwd[MAX_NAME];
+	};
+
+	// a txn end decision not yet carried out on a shard
+	struct Txn_rec
+	{
+		int64_t start_ts;
+		int64_t prepare_ts;
+		uint32_t shard_id;
+		uint32_t local_txnid;
+		uint32_t comp_nodeid;
+		uint32_t decision;
+	};
+
+	/*
+	  Write the topology of clusters to path atomically, by writing a
+	  temporary file and renaming it. Caller must hold System::mtx.
+	  @retval 0 on success, -1 on failure.
+	*/
+	static int save(const std::string &path, const std::vector<KunlunCluster *> &clusters);
+
+	/*
+	  Create clusters, shards, shard nodes and computer nodes from the
+	  snapshot at path into clusters, which must be empty.
+	  @retval 0 on success, 1 if there is no snapshot, -1 if it's invalid.
+	*/
+	static int load(const std::string &path, std::vector<KunlunCluster *> &clusters);
+};
+
+#endif // !TOPO_SNAPSHOT_H